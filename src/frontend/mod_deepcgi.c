@@ -1,8 +1,14 @@
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "httpd.h"
 #include "http_core.h"
 #include "http_protocol.h"
+#include "apr_strings.h"
 
 extern const char* replayserver_filename;
 
@@ -12,6 +18,12 @@ static int deepcgi_handler( request_rec* inpRequest );
 typedef struct {
     const char* working_dir;
     const char* recording_dir;
+    const char* recording_index;
+    const char* replay_socket;
+    const char* response_cache;
+    const char* timing_log;
+    const char* inject_script;
+    const char* gzip_level;
 } deepcgi_config;
 
 static deepcgi_config config;
@@ -30,6 +42,36 @@ const char* deepcgi_set_recordingdir(cmd_parms* cmd, void* cfg, const char* arg)
     return NULL;
 }
 
+const char* deepcgi_set_recordingindex(cmd_parms* cmd, void* cfg, const char* arg) {
+    config.recording_index = arg;
+    return NULL;
+}
+
+const char* deepcgi_set_replaysocket(cmd_parms* cmd, void* cfg, const char* arg) {
+    config.replay_socket = arg;
+    return NULL;
+}
+
+const char* deepcgi_set_responsecache(cmd_parms* cmd, void* cfg, const char* arg) {
+    config.response_cache = arg;
+    return NULL;
+}
+
+const char* deepcgi_set_timinglog(cmd_parms* cmd, void* cfg, const char* arg) {
+    config.timing_log = arg;
+    return NULL;
+}
+
+const char* deepcgi_set_injectscript(cmd_parms* cmd, void* cfg, const char* arg) {
+    config.inject_script = arg;
+    return NULL;
+}
+
+const char* deepcgi_set_gziplevel(cmd_parms* cmd, void* cfg, const char* arg) {
+    config.gzip_level = arg;
+    return NULL;
+}
+
 // ============================================================================
 // Directives to read configuration parameters
 // ============================================================================
@@ -38,6 +80,12 @@ static const command_rec deepcgi_directives[] =
 {
     AP_INIT_TAKE1( "workingDir", deepcgi_set_workingdir, NULL, RSRC_CONF, "Working directory" ),
     AP_INIT_TAKE1( "recordingDir", deepcgi_set_recordingdir, NULL, RSRC_CONF, "Recording directory" ),
+    AP_INIT_TAKE1( "recordingIndex", deepcgi_set_recordingindex, NULL, RSRC_CONF, "Index of recording directory" ),
+    AP_INIT_TAKE1( "replayServerSocket", deepcgi_set_replaysocket, NULL, RSRC_CONF, "Socket of long-lived replay server" ),
+    AP_INIT_TAKE1( "replayResponseCache", deepcgi_set_responsecache, NULL, RSRC_CONF, "Reply cache shared by replay servers" ),
+    AP_INIT_TAKE1( "replayTimingLog", deepcgi_set_timinglog, NULL, RSRC_CONF, "Log of per-request replay timings" ),
+    AP_INIT_TAKE1( "replayInjectScript", deepcgi_set_injectscript, NULL, RSRC_CONF, "Script to inject into HTML pages" ),
+    AP_INIT_TAKE1( "replayGzipLevel", deepcgi_set_gziplevel, NULL, RSRC_CONF, "Level to recompress rewritten pages" ),
     { NULL }
 };
 
@@ -56,6 +104,70 @@ module AP_MODULE_DECLARE_DATA deepcgi_module =
     deepcgi_hooks
 };
 
+// ============================================================================
+// Talking to the replay server
+// ============================================================================
+
+static int write_all( int fd, const char* buffer, size_t length )
+{
+    while ( length > 0 ) {
+        ssize_t num_bytes_written = write( fd, buffer, length );
+        if ( num_bytes_written <= 0 ) {
+            return -1;
+        }
+        buffer += num_bytes_written;
+        length -= num_bytes_written;
+    }
+    return 0;
+}
+
+/* send the request to the long-lived replay server (see replay_daemon.hh)
+   and return the connected socket, or -1 if it can't be reached */
+static int ask_replay_server( request_rec* inpRequest, const char* user_agent, int is_https,
+                              const char* request_time )
+{
+    struct sockaddr_un addr;
+    if ( config.replay_socket == NULL || strlen( config.replay_socket ) >= sizeof( addr.sun_path ) ) {
+        return -1;
+    }
+
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    strcpy( addr.sun_path, config.replay_socket );
+
+    int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( fd < 0 ) {
+        return -1;
+    }
+
+    if ( connect( fd, (struct sockaddr*) &addr, sizeof( addr ) ) < 0 ) {
+        close( fd );
+        return -1;
+    }
+
+    const char* request = apr_pstrcat( inpRequest->pool,
+                                       "REQUEST_METHOD=", inpRequest->method, "\n",
+                                       "REQUEST_URI=", inpRequest->unparsed_uri, "\n",
+                                       "SERVER_PROTOCOL=", inpRequest->protocol, "\n",
+                                       inpRequest->hostname ? "HTTP_HOST=" : "",
+                                       inpRequest->hostname ? inpRequest->hostname : "",
+                                       inpRequest->hostname ? "\n" : "",
+                                       user_agent ? "HTTP_USER_AGENT=" : "",
+                                       user_agent ? user_agent : "",
+                                       user_agent ? "\n" : "",
+                                       is_https ? "HTTPS=1\n" : "",
+                                       "REQUEST_TIME=", request_time, "\n",
+                                       "\n",
+                                       NULL );
+
+    if ( write_all( fd, request, strlen( request ) ) < 0 ) {
+        close( fd );
+        return -1;
+    }
+
+    return fd;
+}
+
 // ============================================================================
 // Module handler function
 // ============================================================================
@@ -73,16 +185,6 @@ int deepcgi_handler( request_rec* inpRequest )
     const char* http_host = inpRequest->hostname;
     const char* user_agent = apr_table_get( inpRequest->headers_in, "User-Agent" );
 
-    setenv( "MAHIMAHI_CHDIR", config.working_dir, TRUE );
-    setenv( "MAHIMAHI_RECORD_PATH", config.recording_dir, TRUE );
-    setenv( "REQUEST_METHOD", request_method, TRUE );
-    setenv( "REQUEST_URI", request_uri, TRUE );
-    setenv( "SERVER_PROTOCOL", protocol, TRUE );
-    setenv( "HTTP_HOST", http_host, TRUE );
-    if ( user_agent != NULL ) {
-        setenv( "HTTP_USER_AGENT", user_agent, TRUE );
-    }
-
     /* check if connection is HTTPS */
     /* see bug report at http://modpython.org/pipermail/mod_python/2006-February/020197.html */
     /* taken from fix at https://issues.apache.org/jira/secure/attachment/12321011/requestobject.c.patch */
@@ -90,16 +192,49 @@ int deepcgi_handler( request_rec* inpRequest )
     APR_OPTIONAL_FN_TYPE(ssl_is_https) *optfn_is_https
       = APR_RETRIEVE_OPTIONAL_FN(ssl_is_https);
 
-    if ( optfn_is_https ) {
-      if ( optfn_is_https( inpRequest->connection ) ) {
-	setenv( "HTTPS", "1", TRUE );
-      }
-    }
+    int is_https = optfn_is_https && optfn_is_https( inpRequest->connection );
 
-    FILE* fp = popen( replayserver_filename, "r" );
-    if ( fp == NULL ) {
-        // "Error encountered while running script"
-        return HTTP_INTERNAL_SERVER_ERROR;
+    /* when Apache read the request, so the replay server can time its whole trip */
+    const char* request_time = apr_psprintf( inpRequest->pool, "%" APR_TIME_T_FMT, inpRequest->request_time );
+
+    /* prefer the long-lived replay server; otherwise run mm-replayserver for this request */
+    FILE* fp = NULL;
+    int replay_fd = ask_replay_server( inpRequest, user_agent, is_https, request_time );
+    if ( replay_fd < 0 ) {
+        setenv( "MAHIMAHI_CHDIR", config.working_dir, TRUE );
+        setenv( "MAHIMAHI_RECORD_PATH", config.recording_dir, TRUE );
+        if ( config.recording_index != NULL ) {
+            setenv( "MAHIMAHI_RECORD_INDEX", config.recording_index, TRUE );
+        }
+        if ( config.response_cache != NULL ) {
+            setenv( "MAHIMAHI_RESPONSE_CACHE", config.response_cache, TRUE );
+        }
+        if ( config.timing_log != NULL ) {
+            setenv( "MAHIMAHI_TIMING_LOG", config.timing_log, TRUE );
+            setenv( "MAHIMAHI_REQUEST_TIME", request_time, TRUE );
+        }
+        if ( config.inject_script != NULL ) {
+            setenv( "MAHIMAHI_INJECT_SCRIPT", config.inject_script, TRUE );
+            if ( config.gzip_level != NULL ) {
+                setenv( "MAHIMAHI_GZIP_LEVEL", config.gzip_level, TRUE );
+            }
+        }
+        setenv( "REQUEST_METHOD", request_method, TRUE );
+        setenv( "REQUEST_URI", request_uri, TRUE );
+        setenv( "SERVER_PROTOCOL", protocol, TRUE );
+        setenv( "HTTP_HOST", http_host, TRUE );
+        if ( user_agent != NULL ) {
+            setenv( "HTTP_USER_AGENT", user_agent, TRUE );
+        }
+        if ( is_https ) {
+            setenv( "HTTPS", "1", TRUE );
+        }
+
+        fp = popen( replayserver_filename, "r" );
+        if ( fp == NULL ) {
+            // "Error encountered while running script"
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
     }
 
     char line[HUGE_STRING_LEN];
@@ -115,26 +250,63 @@ int deepcgi_handler( request_rec* inpRequest )
     inpRequest->output_filters = inpRequest->proto_output_filters = cur;
 
     // Write headers + body
+    int status = OK;
+    int read_failed = 0;
+    int bytes_sent = 0;
     int num_bytes_read;
     do {
-        num_bytes_read = fread( line, sizeof(char), HUGE_STRING_LEN, fp );
+        if ( fp != NULL ) {
+            num_bytes_read = fread( line, sizeof(char), HUGE_STRING_LEN, fp );
+            if ( num_bytes_read < HUGE_STRING_LEN && ferror( fp ) ) {
+                read_failed = 1;
+            }
+        } else {
+            do {
+                num_bytes_read = read( replay_fd, line, HUGE_STRING_LEN );
+            } while ( num_bytes_read < 0 && errno == EINTR );
+            if ( num_bytes_read < 0 ) {
+                // e.g. the replay server died in the middle of the reply
+                read_failed = 1;
+                num_bytes_read = 0;
+            }
+        }
         int num_bytes_left = num_bytes_read;
         while ( num_bytes_left > 0 ) {
             int offset = num_bytes_read - num_bytes_left;
             int num_bytes_written = ap_rwrite( line + offset, num_bytes_left, inpRequest );
             if ( num_bytes_written == -1 ) {
                 // "Error encountered while writing"
-                return HTTP_INTERNAL_SERVER_ERROR;
+                status = HTTP_INTERNAL_SERVER_ERROR;
+                break;
             }
             num_bytes_left -= num_bytes_written;
+            bytes_sent = 1;
         }
-    } while ( num_bytes_read == HUGE_STRING_LEN );
+    } while ( status == OK && !read_failed
+              && ( fp != NULL ? num_bytes_read == HUGE_STRING_LEN : num_bytes_read > 0 ) );
+
+    if ( fp != NULL ) {
+        pclose( fp );
+    } else {
+        close( replay_fd );
+    }
+
+    if ( read_failed ) {
+        if ( !bytes_sent ) {
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+        // the reply is cut short, so the client must not wait on this connection for the rest
+        inpRequest->connection->keepalive = AP_CONN_CLOSE;
+        return OK;
+    }
+
+    if ( status != OK ) {
+        return status;
+    }
 
     // To ensure that connection is kept-alive
     ap_set_keepalive( inpRequest );
 
-    pclose( fp );
-
     return OK;
 }
 
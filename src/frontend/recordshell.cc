@@ -4,18 +4,24 @@
 #include <sys/ioctl.h>
 #include <linux/if.h>
 #include <net/route.h>
+#include <getopt.h>
 
 #include "nat.hh"
 #include "util.hh"
+#include "ezio.hh"
 #include "interfaces.hh"
 #include "address.hh"
 #include "dns_proxy.hh"
 #include "http_proxy.hh"
+#include "certificate_authority.hh"
 #include "netdevice.hh"
 #include "event_loop.hh"
 #include "socketpair.hh"
 #include "config.h"
 #include "backing_store.hh"
+#include "replay_index.hh"
+#include "body_rewriter.hh"
+#include "http_message.hh"
 #include "exception.hh"
 
 using namespace std;
@@ -29,12 +35,99 @@ int main( int argc, char *argv[] )
 
         check_requirements( argc, argv );
 
-        if ( argc < 2 ) {
-            throw runtime_error( "Usage: " + string( argv[ 0 ] ) + " directory [command...]" );
+        const string usage = "Usage: " + string( argv[ 0 ] ) + " [--proxy-threads=N] [--sync] [--dedup[=DIR]] [--ca=FILE [--cert-cache=DIR]] [--inject=FILE|--no-inject] [--gzip-level=N] directory [command...]";
+
+        const option command_line_options[] = {
+            { "proxy-threads", required_argument, nullptr, 't' },
+            { "sync",                no_argument, nullptr, 's' },
+            { "dedup",           optional_argument, nullptr, 'd' },
+            { "ca",            required_argument, nullptr, 'a' },
+            { "cert-cache",    required_argument, nullptr, 'c' },
+            { "inject",        required_argument, nullptr, 'i' },
+            { "no-inject",           no_argument, nullptr, 'n' },
+            { "gzip-level",    required_argument, nullptr, 'z' },
+            { 0,                               0, nullptr,  0  }
+        };
+
+        /* worker threads in the recording proxy (0 for one per core) */
+        unsigned int proxy_threads = 0;
+
+        /* sync the recording to disk after each batch of saves */
+        bool sync_saves = false;
+
+        /* save each distinct large response body once, in the recording's
+           body store or (given a directory) one shared between recordings */
+        bool dedup = false;
+        string body_store;
+
+        /* local CA to sign a certificate for each HTTPS site (PEM certificate
+           and key), and where to keep the certificates between runs */
+        string ca_file, cert_cache;
+
+        /* script injected at the top of each HTML page (built in unless
+           given), or none to save pages as they came (e.g. to inject at
+           replay time instead), and how hard to recompress gzipped ones */
+        bool inject = true;
+        string script_file;
+        int gzip_level = BodyRewriter::DEFAULT_GZIP_LEVEL;
+
+        while ( true ) {
+            /* "+": stop at the directory, so options to the command are left alone */
+            const int opt = getopt_long( argc, argv, "+", command_line_options, nullptr );
+            if ( opt == -1 ) { /* end of options */
+                break;
+            }
+
+            switch ( opt ) {
+            case 't':
+                proxy_threads = myatoi( optarg );
+                break;
+            case 's':
+                sync_saves = true;
+                break;
+            case 'd':
+                dedup = true;
+                body_store = optarg ? optarg : "";
+                break;
+            case 'a':
+                ca_file = optarg;
+                break;
+            case 'c':
+                cert_cache = optarg;
+                break;
+            case 'i':
+                script_file = optarg;
+                break;
+            case 'n':
+                inject = false;
+                break;
+            case 'z':
+                gzip_level = myatoi( optarg );
+                break;
+            default:
+                throw runtime_error( usage );
+            }
+        }
+
+        if ( optind >= argc or (ca_file.empty() and not cert_cache.empty())
+             or (not inject and not script_file.empty()) ) {
+            throw runtime_error( usage );
+        }
+
+        if ( not inject ) {
+            HTTPMessage::rewrite_html_with( nullptr );
+        } else {
+            TemporarilyUnprivileged tu;
+            /* would be privilege escalation if we let the user read files as root */
+
+            HTTPMessage::rewrite_html_with( make_shared< BodyRewriter >( script_file.empty()
+                                                                         ? BodyRewriter::default_script()
+                                                                         : BodyRewriter::read_script( script_file ),
+                                                                         gzip_level ) );
         }
 
         /* Make sure directory ends with '/' so we can prepend directory to file name for storage */
-        string directory( argv[ 1 ] );
+        string directory( argv[ optind ] );
 
         if ( directory.empty() ) {
             throw runtime_error( string( argv[ 0 ] ) + ": directory name must be non-empty" );
@@ -46,10 +139,10 @@ int main( int argc, char *argv[] )
 
         /* what command will we run inside the container? */
         vector < string > command;
-        if ( argc == 2 ) {
+        if ( optind + 1 == argc ) {
             command.push_back( shell_path() );
         } else {
-            for ( int i = 2; i < argc; i++ ) {
+            for ( int i = optind + 1; i < argc; i++ ) {
                 command.push_back( argv[ i ] );
             }
         }
@@ -74,7 +167,7 @@ int main( int argc, char *argv[] )
         NAT nat_rule( ingress_addr );
 
         /* set up http proxy for tcp */
-        HTTPProxy http_proxy( egress_addr );
+        HTTPProxy http_proxy( egress_addr, proxy_threads );
 
         /* set up dnat */
         DNAT dnat( http_proxy.tcp_listener().local_address(), egress_name );
@@ -152,12 +245,23 @@ int main( int argc, char *argv[] )
                 make_directory( directory );
 
                 /* set up backing store to save to disk */
-                HTTPDiskStore disk_backing_store( directory );
+                HTTPDiskStore disk_backing_store( directory, sync_saves,
+                                                  not dedup ? ""
+                                                  : body_store.empty() ? directory + BODY_STORE_NAME
+                                                  : body_store );
+
+                if ( not ca_file.empty() ) {
+                    http_proxy.sign_certificates_with( make_shared< CertificateAuthority >( ca_file, cert_cache ) );
+                }
 
                 EventLoop recordr_event_loop;
                 dns_outside.register_handlers( recordr_event_loop );
                 http_proxy.register_handlers( recordr_event_loop, disk_backing_store );
-                return recordr_event_loop.loop();
+                const int ret = recordr_event_loop.loop();
+
+                /* no more saves, so the store can finish writing them out */
+                http_proxy.stop();
+                return ret;
             } );
 
         return outer_event_loop.loop();
@@ -0,0 +1,169 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <unistd.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <map>
+#include <sstream>
+
+#include "replay_daemon.hh"
+#include "replay_index.hh"
+#include "response_cache.hh"
+#include "replay_timing.hh"
+#include "http_response.hh"
+#include "exception.hh"
+
+using namespace std;
+
+ReplayDaemon::ReplayDaemon( const string & socket_path )
+    : socket_path_( socket_path ),
+      listener_()
+{
+    listener_.bind( socket_path_ );
+    listener_.listen();
+}
+
+ReplayDaemon::~ReplayDaemon()
+{
+    try {
+        SystemCall( "unlink " + socket_path_, unlink( socket_path_.c_str() ) );
+    } catch ( const exception & e ) { /* don't throw from destructor */
+        print_exception( e );
+    }
+}
+
+/* read "NAME=value" lines up to the empty line that ends the request */
+static map< string, string > read_request( UnixStreamSocket & connection )
+{
+    string buffer;
+    size_t end_of_request;
+    while ( (end_of_request = buffer.find( "\n\n" )) == string::npos ) {
+        const string chunk = connection.read();
+        if ( chunk.empty() ) {
+            throw runtime_error( "ReplayDaemon: connection closed in middle of request" );
+        }
+        buffer.append( chunk );
+    }
+
+    map< string, string > fields;
+    istringstream lines( buffer.substr( 0, end_of_request + 1 ) );
+    string line;
+    while ( getline( lines, line ) ) {
+        const auto equals = line.find( '=' );
+        if ( equals == string::npos ) {
+            throw runtime_error( "ReplayDaemon: malformed request line: " + line );
+        }
+        fields[ line.substr( 0, equals ) ] = line.substr( equals + 1 );
+    }
+
+    return fields;
+}
+
+void ReplayDaemon::serve_connection( const ReplayIndex & index, ResponseCache * const cache,
+                                     ReplayTimingLog * const timing_log, UnixStreamSocket & connection )
+{
+    ReplayTimer timer( ReplayTimingRecord::DAEMON );
+
+    try {
+        const map< string, string > fields = read_request( connection );
+
+        const auto request_time = fields.find( "REQUEST_TIME" );
+        if ( request_time != fields.end() ) {
+            timer.arrived( stoull( request_time->second ) * 1000 );
+        } else {
+            timer.end_stage( ReplayTimingRecord::DISPATCH );
+        }
+
+        const string request_line = fields.at( "REQUEST_METHOD" )
+            + " " + fields.at( "REQUEST_URI" )
+            + " " + fields.at( "SERVER_PROTOCOL" );
+        const bool is_https = fields.count( "HTTPS" );
+        const auto host = fields.find( "HTTP_HOST" );
+        const bool has_host = host != fields.end();
+
+        const int best_match
+            = index.best_match_position( is_https, has_host, has_host ? host->second : "", request_line );
+        timer.end_stage( ReplayTimingRecord::MATCH );
+
+        if ( best_match < 0 ) {
+            connection.write( not_found_reply() );
+            timer.set_outcome( ReplayTimingRecord::NOT_FOUND );
+        } else if ( cache ) {
+            string reply;
+            if ( cache->get( best_match, reply ) ) {
+                timer.set_outcome( ReplayTimingRecord::CACHED );
+            } else {
+                reply = index.response( index.entries().Get( best_match ) ).str();
+                cache->put( best_match, reply );
+                timer.set_outcome( ReplayTimingRecord::MATCHED );
+            }
+            timer.end_stage( ReplayTimingRecord::LOAD );
+
+            connection.write( reply );
+        } else {
+            const ReplayResponse reply = index.response( index.entries().Get( best_match ) );
+            timer.end_stage( ReplayTimingRecord::LOAD );
+
+            reply.write_to( connection );
+            timer.set_outcome( ReplayTimingRecord::MATCHED );
+        }
+    } catch ( const exception & e ) {
+        ostringstream reply;
+        reply << "HTTP/1.1 500 Internal Server Error" << CRLF;
+        reply << "Content-Type: text/plain" << CRLF << CRLF;
+        reply << "mahimahi mm-webreplay received an exception:" << CRLF << CRLF;
+        print_exception( e, reply );
+
+        try {
+            connection.write( reply.str() );
+        } catch ( const exception & write_error ) {
+            print_exception( write_error );
+        }
+    }
+
+    timer.end_stage( ReplayTimingRecord::WRITE );
+
+    if ( timing_log ) {
+        try {
+            timing_log->append( timer.record() );
+        } catch ( const exception & e ) {
+            print_exception( e );
+        }
+    }
+}
+
+int ReplayDaemon::serve( const ReplayIndex & index, const unsigned int worker_count,
+                         ResponseCache * const cache, ReplayTimingLog * const timing_log )
+{
+    mutex queue_mutex;
+    condition_variable queue_nonempty;
+    queue< UnixStreamSocket > connections;
+
+    /* each worker answers one connection at a time */
+    for ( unsigned int i = 0; i < worker_count; i++ ) {
+        thread( [&] () {
+                while ( true ) {
+                    unique_lock<mutex> ul( queue_mutex );
+                    queue_nonempty.wait( ul, [&] () { return not connections.empty(); } );
+                    UnixStreamSocket connection( move( connections.front() ) );
+                    connections.pop();
+                    ul.unlock();
+
+                    serve_connection( index, cache, timing_log, connection );
+                }
+            } ).detach();
+    }
+
+    /* this thread only accepts */
+    while ( true ) {
+        UnixStreamSocket connection = listener_.accept();
+        {
+            unique_lock<mutex> ul( queue_mutex );
+            connections.emplace( move( connection ) );
+        }
+        queue_nonempty.notify_one();
+    }
+}
@@ -0,0 +1,49 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef REPLAY_DAEMON_HH
+#define REPLAY_DAEMON_HH
+
+#include <string>
+
+#include "socket.hh"
+
+class ReplayIndex;
+class ResponseCache;
+class ReplayTimingLog;
+
+/* long-lived replacement for running mm-replayserver once per request.
+
+   mod_deepcgi connects to the Unix socket and sends the request as
+   CGI-style "NAME=value\n" lines (REQUEST_METHOD, REQUEST_URI,
+   SERVER_PROTOCOL, and optionally HTTP_HOST, HTTP_USER_AGENT, HTTPS and
+   REQUEST_TIME, when Apache read the request in microseconds since the
+   epoch), terminated by an empty line. The daemon writes back the
+   complete HTTP reply and closes the connection. */
+class ReplayDaemon
+{
+private:
+    std::string socket_path_;
+    UnixStreamSocket listener_;
+
+    static void serve_connection( const ReplayIndex & index, ResponseCache * const cache,
+                                  ReplayTimingLog * const timing_log, UnixStreamSocket & connection );
+
+public:
+    /* binds and listens, so call while unprivileged */
+    ReplayDaemon( const std::string & socket_path );
+    ~ReplayDaemon();
+
+    const std::string & socket_path( void ) const { return socket_path_; }
+
+    /* answer requests from the index with a pool of worker threads, keeping
+       replies in the cache (if any) shared with mm-replayserver, and
+       appending each request's timings to the log (if any); never returns */
+    int serve( const ReplayIndex & index, const unsigned int worker_count,
+               ResponseCache * const cache, ReplayTimingLog * const timing_log );
+
+    /* ban copying */
+    ReplayDaemon( const ReplayDaemon & other ) = delete;
+    ReplayDaemon & operator=( const ReplayDaemon & other ) = delete;
+};
+
+#endif /* REPLAY_DAEMON_HH */
@@ -1,21 +1,22 @@
 /* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
 #include <unistd.h>
 
 #include <iostream>
-#include <vector>
-#include <limits>
+#include <memory>
+#include <functional>
 
 #include "util.hh"
+#include "ezio.hh"
 #include "http_record.pb.h"
-#include "http_header.hh"
 #include "exception.hh"
-#include "http_request.hh"
 #include "http_response.hh"
 #include "file_descriptor.hh"
+#include "replay_index.hh"
+#include "recording_archive.hh"
+#include "response_cache.hh"
+#include "replay_timing.hh"
+#include "body_rewriter.hh"
 
 using namespace std;
 
@@ -28,81 +29,47 @@ string safe_getenv( const string & key )
     return value;
 }
 
-/* does the actual HTTP header match this stored request? */
-bool header_match( const string & env_var_name,
-                   const string & header_name,
-                   const HTTPRequest & saved_request )
+/* give client the reply for the record at this position in directory order,
+   from the cache shared with the other replay servers if it's there */
+void send_reply( ResponseCache * const cache, const uint32_t position,
+                 const function< ReplayResponse( void ) > & response, ReplayTimer & timer )
 {
-    const char * const env_value = getenv( env_var_name.c_str() );
-
-    /* case 1: neither header exists (OK) */
-    if ( (not env_value) and (not saved_request.has_header( header_name )) ) {
-        return true;
-    }
-
-    /* case 2: headers both exist (OK if values match) */
-    if ( env_value and saved_request.has_header( header_name ) ) {
-        return saved_request.get_header_value( header_name ) == string( env_value );
+    FileDescriptor output( SystemCall( "dup", dup( STDOUT_FILENO ) ) );
+
+    if ( not cache ) { /* body straight from the recording */
+        const ReplayResponse reply = response();
+        timer.end_stage( ReplayTimingRecord::LOAD );
+        reply.write_to( output );
+        timer.end_stage( ReplayTimingRecord::WRITE );
+        timer.set_outcome( ReplayTimingRecord::MATCHED );
+        return;
     }
 
-    /* case 3: one exists but the other doesn't (failure) */
-    return false;
-}
-
-string strip_query( const string & request_line )
-{
-    const auto index = request_line.find( "?" );
-    if ( index == string::npos ) {
-        return request_line;
+    string reply;
+    if ( cache->get( position, reply ) ) {
+        timer.set_outcome( ReplayTimingRecord::CACHED );
     } else {
-        return request_line.substr( 0, index );
+        reply = response().str();
+        cache->put( position, reply );
+        timer.set_outcome( ReplayTimingRecord::MATCHED );
     }
+    timer.end_stage( ReplayTimingRecord::LOAD );
+
+    output.write( reply );
+    timer.end_stage( ReplayTimingRecord::WRITE );
 }
 
-/* compare request_line and certain headers of incoming request and stored request */
-unsigned int match_score( const MahimahiProtobufs::RequestResponse & saved_record,
-                          const string & request_line,
-                          const bool is_https )
+int main( void )
 {
-    const HTTPRequest saved_request( saved_record.request() );
-
-    /* match HTTP/HTTPS */
-    if ( is_https and (saved_record.scheme() != MahimahiProtobufs::RequestResponse_Scheme_HTTPS) ) {
-        return 0;
-    }
-
-    if ( (not is_https) and (saved_record.scheme() != MahimahiProtobufs::RequestResponse_Scheme_HTTP) ) {
-        return 0;
-    }
-
-    /* match host header */
-    if ( not header_match( "HTTP_HOST", "Host", saved_request ) ) {
-        return 0;
-    }
+    ReplayTimer timer( ReplayTimingRecord::CGI_SERVER );
+    unique_ptr< ReplayTimingLog > timing_log;
 
-    /* match user agent */
-    // if ( not header_match( "HTTP_USER_AGENT", "User-Agent", saved_request ) ) {
-    //     return 0;
-    // }
-
-    /* must match first line up to "?" at least */
-    if ( strip_query( request_line ) != strip_query( saved_request.first_line() ) ) {
-        return 0;
-    }
-
-    /* success! return size of common prefix */
-    const auto max_match = min( request_line.size(), saved_request.first_line().size() );
-    for ( unsigned int i = 0; i < max_match; i++ ) {
-        if ( request_line.at( i ) != saved_request.first_line().at( i ) ) {
-            return i;
-        }
+    /* mod_deepcgi passes on when Apache read the request, in microseconds */
+    const char * const request_time = getenv( "MAHIMAHI_REQUEST_TIME" );
+    if ( request_time ) {
+        timer.arrived( strtoull( request_time, nullptr, 10 ) * 1000 );
     }
 
-    return max_match;
-}
-
-int main( void )
-{
     try {
         assert_not_root();
 
@@ -115,46 +82,96 @@ int main( void )
 
         SystemCall( "chdir", chdir( working_directory.c_str() ) );
 
-        const vector< string > files = list_directory_contents( recording_directory );
+        const char * const host = getenv( "HTTP_HOST" );
 
-        unsigned int best_score = 0;
-        MahimahiProtobufs::RequestResponse best_match;
+        const char * const timing_log_filename = getenv( "MAHIMAHI_TIMING_LOG" );
+        if ( timing_log_filename ) {
+            timing_log.reset( new ReplayTimingLog( timing_log_filename ) );
+        }
 
-        for ( const auto & filename : files ) {
-            FileDescriptor fd( SystemCall( "open", open( filename.c_str(), O_RDONLY ) ) );
-            MahimahiProtobufs::RequestResponse current_record;
-            if ( not current_record.ParseFromFileDescriptor( fd.fd_num() ) ) {
-                throw runtime_error( filename + ": invalid HTTP request/response" );
-            }
+        const char * const cache_filename = getenv( "MAHIMAHI_RESPONSE_CACHE" );
+        unique_ptr< ResponseCache > cache;
+        if ( cache_filename ) {
+            cache.reset( new ResponseCache( cache_filename ) );
+        }
+
+        /* mm-webreplay --inject: rewrite HTML pages as they're served */
+        shared_ptr< BodyRewriter > rewriter;
+        const char * const script_filename = getenv( "MAHIMAHI_INJECT_SCRIPT" );
+        if ( script_filename ) {
+            const char * const gzip_level = getenv( "MAHIMAHI_GZIP_LEVEL" );
+            rewriter = make_shared< BodyRewriter >( BodyRewriter::read_script( script_filename ),
+                                                    gzip_level ? myatoi( gzip_level )
+                                                    : BodyRewriter::DEFAULT_GZIP_LEVEL );
+        }
 
-            unsigned int score = match_score( current_record, request_line, is_https );
-            if ( score > best_score ) {
-                best_match = current_record;
-                best_score = score;
+        bool found = false;
+
+        if ( RecordingArchive::is_archive( recording_directory ) ) {
+            /* an archive carries its own sorted index; look up straight from the mapping */
+            const shared_ptr< const RecordingArchive > archive = make_shared< RecordingArchive >( recording_directory );
+            timer.end_stage( ReplayTimingRecord::INDEX );
+
+            const RecordingArchiveEntry * const entry
+                = archive->best_match( is_https, host, host ? host : "", request_line );
+            timer.end_stage( ReplayTimingRecord::MATCH );
+
+            if ( entry ) {
+                send_reply( cache.get(), entry->position,
+                            [&] () {
+                                ReplayResponse reply = RecordingArchive::response( archive, *entry );
+                                if ( rewriter ) {
+                                    reply.rewrite_body( *rewriter );
+                                }
+                                return reply;
+                            }, timer );
+                found = true;
             }
+        } else {
+            /* mm-webreplay builds the index once per recording; scan the directory only if it didn't */
+            const char * const index_filename = getenv( "MAHIMAHI_RECORD_INDEX" );
+            ReplayIndex index = index_filename
+                ? ReplayIndex( recording_directory, index_filename )
+                : ReplayIndex( recording_directory );
+            index.rewrite_html_with( rewriter );
+            timer.end_stage( ReplayTimingRecord::INDEX );
+
+            const int position = index.best_match_position( is_https, host, host ? host : "", request_line );
+            timer.end_stage( ReplayTimingRecord::MATCH );
+
+            if ( position >= 0 ) {
+                send_reply( cache.get(), position,
+                            [&] () { return index.response( index.entries().Get( position ) ); }, timer );
+                found = true;
+            }
+        }
+
+        if ( not found ) { /* no acceptable matches for request */
+            cout << not_found_reply() << flush;
+            timer.end_stage( ReplayTimingRecord::WRITE );
+            timer.set_outcome( ReplayTimingRecord::NOT_FOUND );
         }
 
-        if ( best_score > 0 ) { /* give client the best match */
-            cout << HTTPResponse( best_match.response() ).str();
-            return EXIT_SUCCESS;
-        } else {                /* no acceptable matches for request */
-            //cout << "HTTP/1.1 404 Not Found" << CRLF;
-            //cout << "Content-Type: text/plain" << CRLF << CRLF;
-            //cout << "replayserver: could not find a match for " << request_line << CRLF;
-            //return EXIT_FAILURE;
-	    string response_body = "replayserver: could not find a match.";
-      	    cout << "HTTP/1.1 404 Not Found" << CRLF;
-            cout << "Content-Type: text/plain" << CRLF;
-            cout << "Content-Length: " << response_body.length() << CRLF;
-            cout << "Cache-Control: max-age=60" << CRLF << CRLF;
-            cout << response_body << CRLF;
-            return EXIT_FAILURE;
+        if ( timing_log ) {
+            timing_log->append( timer.record() );
         }
+
+        return found ? EXIT_SUCCESS : EXIT_FAILURE;
     } catch ( const exception & e ) {
         cout << "HTTP/1.1 500 Internal Server Error" << CRLF;
         cout << "Content-Type: text/plain" << CRLF << CRLF;
         cout << "mahimahi mm-webreplay received an exception:" << CRLF << CRLF;
         print_exception( e, cout );
+
+        if ( timing_log ) {
+            try {
+                timer.end_stage( ReplayTimingRecord::WRITE );
+                timing_log->append( timer.record() );
+            } catch ( const exception & log_error ) {
+                print_exception( log_error );
+            }
+        }
+
         return EXIT_FAILURE;
     }
 }
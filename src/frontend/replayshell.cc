@@ -2,18 +2,30 @@
 
 #include <net/route.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <getopt.h>
 
 #include <vector>
 #include <set>
+#include <memory>
+#include <thread>
+#include <algorithm>
 
 #include "util.hh"
+#include "ezio.hh"
 #include "netdevice.hh"
 #include "web_server.hh"
 #include "system_runner.hh"
 #include "socket.hh"
 #include "event_loop.hh"
 #include "temp_file.hh"
-#include "http_response.hh"
+#include "replay_index.hh"
+#include "replay_daemon.hh"
+#include "response_cache.hh"
+#include "replay_timing.hh"
+#include "body_rewriter.hh"
+#include "native_replay_server.hh"
+#include "certificate_authority.hh"
 #include "dns_server.hh"
 #include "exception.hh"
 
@@ -33,6 +45,16 @@ void add_dummy_interface( const string & name, const Address & addr )
                      [&] ( ifreq &ifr ) { ifr.ifr_addr = addr.to_sockaddr(); } );
 }
 
+/* tmpfs if there is one, so the shared reply cache stays in memory */
+string shared_memory_directory( void )
+{
+    struct stat info;
+    if ( stat( "/dev/shm", &info ) == 0 and S_ISDIR( info.st_mode ) ) {
+        return "/dev/shm";
+    }
+    return "/tmp";
+}
+
 int main( int argc, char *argv[] )
 {
     try {
@@ -42,20 +64,94 @@ int main( int argc, char *argv[] )
 
         check_requirements( argc, argv );
 
-        if ( argc < 2 ) {
-            throw runtime_error( "Usage: " + string( argv[ 0 ] ) + " directory [command...]" );
+        const string usage = "Usage: " + string( argv[ 0 ] ) + " [--server=apache|native] [--cache-size=MiB] [--timing-log=FILE] [--ca=FILE [--cert-cache=DIR]] [--inject[=FILE] [--gzip-level=N]] directory|archive [command...]";
+
+        const option command_line_options[] = {
+            { "server",     required_argument, nullptr, 's' },
+            { "cache-size", required_argument, nullptr, 'c' },
+            { "timing-log", required_argument, nullptr, 't' },
+            { "ca",         required_argument, nullptr, 'a' },
+            { "cert-cache", required_argument, nullptr, 'k' },
+            { "inject",     optional_argument, nullptr, 'i' },
+            { "gzip-level", required_argument, nullptr, 'z' },
+            { 0,                            0, nullptr,  0  }
+        };
+
+        /* serve from one multi-threaded process instead of an Apache per address? */
+        bool native_server = false;
+
+        /* memory for replies shared by the replay servers (0 to disable) */
+        uint64_t cache_megabytes = 256;
+
+        /* where the replay servers log how long each request took (see mm-replaystats) */
+        string timing_log_filename;
+
+        /* native server: local CA to sign a certificate for each HTTPS site
+           (PEM certificate and key), and where to keep them between runs */
+        string ca_file, cert_cache;
+
+        /* inject a script (built in unless given) into HTML pages as they're
+           served, for recordings saved with mm-webrecord --no-inject, and
+           how hard to recompress gzipped ones */
+        bool inject = false;
+        string script_file;
+        int gzip_level = BodyRewriter::DEFAULT_GZIP_LEVEL;
+        bool gzip_level_given = false;
+
+        while ( true ) {
+            /* "+": stop at the recording, so options to the command are left alone */
+            const int opt = getopt_long( argc, argv, "+", command_line_options, nullptr );
+            if ( opt == -1 ) { /* end of options */
+                break;
+            }
+
+            switch ( opt ) {
+            case 's':
+                if ( string( optarg ) == "native" ) {
+                    native_server = true;
+                } else if ( string( optarg ) != "apache" ) {
+                    throw runtime_error( usage );
+                }
+                break;
+            case 'c':
+                cache_megabytes = myatoi( optarg );
+                break;
+            case 't':
+                timing_log_filename = optarg;
+                break;
+            case 'a':
+                ca_file = optarg;
+                break;
+            case 'k':
+                cert_cache = optarg;
+                break;
+            case 'i':
+                inject = true;
+                script_file = optarg ? optarg : "";
+                break;
+            case 'z':
+                gzip_level = myatoi( optarg );
+                gzip_level_given = true;
+                break;
+            default:
+                throw runtime_error( usage );
+            }
         }
 
-        /* clean directory name */
-        string directory = argv[ 1 ];
+        if ( optind >= argc or (ca_file.empty() and not cert_cache.empty())
+             or (gzip_level_given and not inject) ) {
+            throw runtime_error( usage );
+        }
 
-        if ( directory.empty() ) {
-            throw runtime_error( string( argv[ 0 ] ) + ": directory name must be non-empty" );
+        if ( not ca_file.empty() and not native_server ) {
+            throw runtime_error( string( argv[ 0 ] ) + ": --ca needs --server=native" );
         }
 
-        /* make sure directory ends with '/' so we can prepend directory to file name for storage */
-        if ( directory.back() != '/' ) {
-            directory.append( "/" );
+        /* recording directory, or archive packed by mm-webarchive */
+        const string recording = argv[ optind ];
+
+        if ( recording.empty() ) {
+            throw runtime_error( string( argv[ 0 ] ) + ": recording name must be non-empty" );
         }
 
         /* get working directory */
@@ -64,12 +160,17 @@ int main( int argc, char *argv[] )
         /* chdir to result of getcwd just in case */
         SystemCall( "chdir", chdir( working_directory.c_str() ) );
 
+        /* Apache and mm-replayserver open the log from elsewhere */
+        if ( not timing_log_filename.empty() and timing_log_filename.front() != '/' ) {
+            timing_log_filename = working_directory + "/" + timing_log_filename;
+        }
+
         /* what command will we run inside the container? */
         vector< string > command;
-        if ( argc == 2 ) {
+        if ( optind + 1 == argc ) {
             command.push_back( shell_path() );
         } else {
-            for ( int i = 2; i < argc; i++ ) {
+            for ( int i = optind + 1; i < argc; i++ ) {
                 command.push_back( argv[ i ] );
             }
         }
@@ -89,27 +190,66 @@ int main( int argc, char *argv[] )
         set< Address > unique_ip_and_port;
         vector< pair< string, Address > > hostname_to_ip;
 
+        /* index of the recording, built once here and shared with every replay server */
+        unique_ptr< ReplayIndex > index;
+        unique_ptr< TempFile > index_file;
+        unique_ptr< ReplayDaemon > replay_daemon;
+        unique_ptr< TempFile > cache_file;
+        unique_ptr< ResponseCache > cache;
+        unique_ptr< ReplayTimingLog > timing_log;
+        unique_ptr< TempFile > script;
+
         {
             TemporarilyUnprivileged tu;
             /* would be privilege escalation if we let the user read directories or open files as root */
 
-            const vector< string > files = list_directory_contents( directory  );
+            index.reset( new ReplayIndex( recording ) );
 
-            for ( const auto filename : files ) {
-                FileDescriptor fd( SystemCall( "open", open( filename.c_str(), O_RDONLY ) ) );
+            if ( inject ) {
+                const auto rewriter = make_shared< BodyRewriter >( script_file.empty()
+                                                                   ? BodyRewriter::default_script()
+                                                                   : BodyRewriter::read_script( script_file ),
+                                                                   gzip_level );
+                index->rewrite_html_with( rewriter );
 
-                MahimahiProtobufs::RequestResponse protobuf;
-                if ( not protobuf.ParseFromFileDescriptor( fd.fd_num() ) ) {
-                    throw runtime_error( filename + ": invalid HTTP request/response" );
+                if ( not native_server ) {
+                    /* for mm-replayserver, should Apache run it */
+                    script.reset( new TempFile( "/tmp/replayshell_script" ) );
+                    script->write( rewriter->script() );
                 }
+            }
 
-                const Address address( protobuf.ip(), protobuf.port() );
+            for ( const auto & entry : index->entries() ) {
+                const Address address( entry.ip(), entry.port() );
 
                 unique_ip.emplace( address.ip(), 0 );
                 unique_ip_and_port.emplace( address );
 
-                hostname_to_ip.emplace_back( HTTPRequest( protobuf.request() ).get_header_value( "Host" ),
-                                             address );
+                if ( entry.has_host() ) {
+                    hostname_to_ip.emplace_back( entry.host(), address );
+                }
+            }
+
+            if ( not native_server ) {
+                /* created unprivileged so mm-replayserver (running as the user) can read it */
+                index_file.reset( new TempFile( "/tmp/replayshell_index" ) );
+                index->save( index_file->fd().fd_num() );
+
+                replay_daemon.reset( new ReplayDaemon( "/tmp/replayshell_replayserver." + to_string( getpid() )
+                                                       + "." + to_string( random() ) ) );
+
+                if ( cache_megabytes > 0 ) {
+                    /* replies are built once, then shared by the daemon and every mm-replayserver */
+                    cache_file.reset( new TempFile( shared_memory_directory() + "/replayshell_cache" ) );
+                    ResponseCache::initialize( cache_file->name(), cache_megabytes << 20, index->entries().size() );
+                    cache.reset( new ResponseCache( cache_file->name() ) );
+                }
+
+                if ( not timing_log_filename.empty() ) {
+                    /* one log per session */
+                    timing_log.reset( new ReplayTimingLog( timing_log_filename ) );
+                    SystemCall( "truncate " + timing_log_filename, truncate( timing_log_filename.c_str(), 0 ) );
+                }
             }
         }
 
@@ -120,10 +260,36 @@ int main( int argc, char *argv[] )
             interface_counter++;
         }
 
-        /* set up web servers */
+        /* one long-lived process answers requests for every recorded address */
+        unique_ptr< ChildProcess > replay_server;
         vector< WebServer > servers;
-        for ( const auto ip_port : unique_ip_and_port ) {
-            servers.emplace_back( ip_port, working_directory, directory );
+
+        if ( native_server ) {
+            /* bind while still privileged, then serve as the user */
+            NativeReplayServer server( unique_ip_and_port );
+
+            replay_server.reset( new ChildProcess( "replayserver", [&] () {
+                        drop_privileges();
+
+                        if ( not ca_file.empty() ) {
+                            server.sign_certificates_with( make_shared< CertificateAuthority >( ca_file, cert_cache ) );
+                        }
+
+                        return server.serve( *index );
+                    } ) );
+        } else {
+            replay_server.reset( new ChildProcess( "replayserver", [&] () {
+                        drop_privileges();
+                        return replay_daemon->serve( *index, max( 4u, thread::hardware_concurrency() ),
+                                                     cache.get(), timing_log.get() );
+                    } ) );
+
+            /* set up web servers, which forward each request to the replay server */
+            for ( const auto ip_port : unique_ip_and_port ) {
+                servers.emplace_back( ip_port, working_directory, recording, index_file->name(),
+                                      replay_daemon->socket_path(), cache_file ? cache_file->name() : "",
+                                      timing_log_filename, script ? script->name() : "", gzip_level );
+            }
         }
 
         /* set up DNS server */
@@ -144,6 +310,8 @@ int main( int argc, char *argv[] )
             add_dummy_interface( interface_name, nameservers.at( server_num ) );
         }
 
+        event_loop.add_child_process( move( *replay_server ) );
+
         /* start dnsmasq */
         event_loop.add_child_process( start_dnsmasq( dnsmasq_args ) );
 
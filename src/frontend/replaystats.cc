@@ -0,0 +1,82 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+
+#include "replay_timing.hh"
+#include "exception.hh"
+
+using namespace std;
+
+/* nearest-rank percentile of sorted values */
+static uint64_t percentile( const vector< uint64_t > & sorted, const double p )
+{
+    const size_t rank = max( size_t( 1 ), size_t( p / 100.0 * sorted.size() + 0.999999 ) );
+    return sorted.at( min( rank, sorted.size() ) - 1 );
+}
+
+static void print_row( const string & name, vector< uint64_t > values )
+{
+    sort( values.begin(), values.end() );
+
+    cout << left << setw( 10 ) << name << right;
+    for ( const double p : { 50.0, 90.0, 99.0, 99.9 } ) {
+        cout << setw( 11 ) << percentile( values, p ) / 1000.0;
+    }
+    cout << setw( 11 ) << values.back() / 1000.0 << endl;
+}
+
+int main( int argc, char *argv[] )
+{
+    try {
+        if ( argc != 2 ) {
+            throw runtime_error( "Usage: " + string( argv[ 0 ] ) + " timing-log" );
+        }
+
+        const vector< ReplayTimingRecord > records = ReplayTimingLog::read( argv[ 1 ] );
+
+        if ( records.empty() ) {
+            cout << "no requests" << endl;
+            return EXIT_SUCCESS;
+        }
+
+        vector< vector< uint64_t > > stages( ReplayTimingRecord::STAGE_COUNT );
+        vector< uint64_t > totals;
+        unsigned int outcomes[ ReplayTimingRecord::ERROR + 1 ] = {};
+
+        for ( const auto & record : records ) {
+            for ( unsigned int stage = 0; stage < ReplayTimingRecord::STAGE_COUNT; stage++ ) {
+                stages.at( stage ).push_back( record.stage_ns[ stage ] );
+            }
+            totals.push_back( record.total_ns() );
+            if ( record.outcome <= ReplayTimingRecord::ERROR ) {
+                outcomes[ record.outcome ]++;
+            }
+        }
+
+        cout << records.size() << " requests ("
+             << outcomes[ ReplayTimingRecord::MATCHED ] << " matched, "
+             << outcomes[ ReplayTimingRecord::CACHED ] << " from cache, "
+             << outcomes[ ReplayTimingRecord::NOT_FOUND ] << " not found, "
+             << outcomes[ ReplayTimingRecord::ERROR ] << " errors)" << endl << endl;
+
+        cout << fixed << setprecision( 1 );
+        cout << left << setw( 10 ) << "us" << right;
+        for ( const string column : { "p50", "p90", "p99", "p99.9", "max" } ) {
+            cout << setw( 11 ) << column;
+        }
+        cout << endl;
+
+        for ( unsigned int stage = 0; stage < ReplayTimingRecord::STAGE_COUNT; stage++ ) {
+            print_row( ReplayTimingRecord::stage_name( stage ), stages.at( stage ) );
+        }
+        print_row( "total", totals );
+
+        return EXIT_SUCCESS;
+    } catch ( const exception & e ) {
+        print_exception( e );
+        return EXIT_FAILURE;
+    }
+}
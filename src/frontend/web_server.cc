@@ -13,7 +13,10 @@
 
 using namespace std;
 
-WebServer::WebServer( const Address & addr, const string & working_directory, const string & record_path )
+WebServer::WebServer( const Address & addr, const string & working_directory, const string & record_path,
+                      const string & index_path, const string & replay_socket_path,
+                      const string & cache_path, const string & timing_log_path,
+                      const string & inject_script_path, const int gzip_level )
     : config_file_( "/tmp/replayshell_apache_config" ),
       moved_away_( false )
 {
@@ -21,6 +24,18 @@ WebServer::WebServer( const Address & addr, const string & working_directory, co
 
     config_file_.write( "WorkingDir " + working_directory + "\n" );
     config_file_.write( "RecordingDir " + record_path + "\n" );
+    config_file_.write( "RecordingIndex " + index_path + "\n" );
+    config_file_.write( "ReplayServerSocket " + replay_socket_path + "\n" );
+    if ( not cache_path.empty() ) {
+        config_file_.write( "ReplayResponseCache " + cache_path + "\n" );
+    }
+    if ( not timing_log_path.empty() ) {
+        config_file_.write( "ReplayTimingLog " + timing_log_path + "\n" );
+    }
+    if ( not inject_script_path.empty() ) {
+        config_file_.write( "ReplayInjectScript " + inject_script_path + "\n" );
+        config_file_.write( "ReplayGzipLevel " + to_string( gzip_level ) + "\n" );
+    }
 
     /* if port 443, add ssl components */
     if ( addr.port() == 443 ) { /* ssl */
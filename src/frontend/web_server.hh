@@ -17,7 +17,10 @@ private:
     bool moved_away_;
 
 public:
-    WebServer( const Address & addr, const std::string & working_directory, const std::string & record_path );
+    WebServer( const Address & addr, const std::string & working_directory, const std::string & record_path,
+               const std::string & index_path, const std::string & replay_socket_path,
+               const std::string & cache_path, const std::string & timing_log_path,
+               const std::string & inject_script_path, const int gzip_level );
     ~WebServer();
 
     /* ban copying */
@@ -0,0 +1,35 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <iostream>
+
+#include "recording_archive.hh"
+#include "exception.hh"
+
+using namespace std;
+
+int main( int argc, char *argv[] )
+{
+    try {
+        if ( argc != 3 ) {
+            throw runtime_error( "Usage: " + string( argv[ 0 ] ) + " directory archive" );
+        }
+
+        string directory = argv[ 1 ];
+
+        if ( directory.empty() ) {
+            throw runtime_error( string( argv[ 0 ] ) + ": directory name must be non-empty" );
+        }
+
+        /* make sure directory ends with '/' so we can prepend directory to file name */
+        if ( directory.back() != '/' ) {
+            directory.append( "/" );
+        }
+
+        RecordingArchive::pack( directory, argv[ 2 ] );
+
+        return EXIT_SUCCESS;
+    } catch ( const exception & e ) {
+        print_exception( e );
+        return EXIT_FAILURE;
+    }
+}
@@ -1,36 +1,209 @@
 /* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdlib>
+
+#include <openssl/evp.h>
+
 #include "backing_store.hh"
+#include "replay_index.hh"
 #include "http_record.pb.h"
 #include "temp_file.hh"
+#include "exception.hh"
 
 using namespace std;
 
-HTTPDiskStore::HTTPDiskStore( const string & record_folder )
+/* a smaller body saves no disk space by being stored once, and would cost a file of its own */
+static const size_t MIN_STORED_BODY = 4096;
+
+/* mkdir, unless it's already there (a shared store usually is) */
+static void make_store_directory( const string & directory )
+{
+    if ( mkdir( directory.c_str(), 00700 ) < 0 and errno != EEXIST ) {
+        throw unix_error( "mkdir " + directory );
+    }
+}
+
+HTTPDiskStore::HTTPDiskStore( const string & record_folder, const bool sync, const string & body_store )
     : record_folder_( record_folder ),
-      mutex_()
-{}
+      sync_( sync ),
+      body_store_( body_store ),
+      index_( SystemCall( "open " + record_folder_ + RECORD_INDEX_NAME,
+                          open( (record_folder_ + RECORD_INDEX_NAME).c_str(),
+                                O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 00600 ) ) ),
+      queue_(),
+      wakeup_( SystemCall( "eventfd", eventfd( 0, 0 ) ) ),
+      writer_sleeping_( false ),
+      exiting_( false ),
+      writer_()
+{
+    if ( not body_store_.empty() ) {
+        if ( body_store_.back() != '/' ) {
+            body_store_.append( "/" );
+        }
 
-void HTTPDiskStore::save( const HTTPResponse & response, const Address & server_address )
+        make_store_directory( body_store_ );
+
+        /* replay always looks in the recording, so link a store kept elsewhere into it */
+        const string link = record_folder_ + BODY_STORE_NAME;
+        if ( body_store_ != link + "/" ) {
+            unique_ptr< char, void (*)( void * ) > target( realpath( body_store_.c_str(), nullptr ), free );
+            if ( not target ) {
+                throw unix_error( "realpath " + body_store_ );
+            }
+            SystemCall( "symlink " + link, symlink( target.get(), link.c_str() ) );
+        }
+    }
+
+    /* start last, once everything the thread uses exists */
+    writer_ = thread( [&] () { writer_loop(); } );
+}
+
+static void wake( const FileDescriptor & eventfd )
 {
-    unique_lock<mutex> ul( mutex_ );
+    const uint64_t one = 1;
+    SystemCall( "write eventfd", ::write( eventfd.fd_num(), &one, sizeof( one ) ) );
+}
 
-    /* output file to write current request/response pair protobuf (user has all permissions) */
-    UniqueFile file( record_folder_ + "save" );
+HTTPDiskStore::~HTTPDiskStore()
+{
+    try {
+        exiting_ = true;
+        wake( wakeup_ );
+        writer_.join();
+    } catch ( const exception & e ) { /* don't throw from destructor */
+        print_exception( e );
+    }
+}
 
+void HTTPDiskStore::save( const HTTPResponse & response, const Address & server_address )
+{
     /* construct protocol buffer */
-    MahimahiProtobufs::RequestResponse output;
+    Item output( new MahimahiProtobufs::RequestResponse );
+
+    output->set_ip( server_address.ip() );
+    output->set_port( server_address.port() );
+    output->set_scheme( server_address.port() == 443
+                        ? MahimahiProtobufs::RequestResponse_Scheme_HTTPS
+                        : MahimahiProtobufs::RequestResponse_Scheme_HTTP );
+    output->mutable_request()->CopyFrom( response.request().toprotobuf() );
+    output->mutable_response()->CopyFrom( response.toprotobuf() );
 
-    output.set_ip( server_address.ip() );
-    output.set_port( server_address.port() );
-    output.set_scheme( server_address.port() == 443
-                       ? MahimahiProtobufs::RequestResponse_Scheme_HTTPS
-                       : MahimahiProtobufs::RequestResponse_Scheme_HTTP );
-    output.mutable_request()->CopyFrom( response.request().toprotobuf() );
-    output.mutable_response()->CopyFrom( response.toprotobuf() );
+    queue_.push( move( output ) );
+
+    /* only costs a system call when the writer has run out of work */
+    if ( writer_sleeping_.exchange( false ) ) {
+        wake( wakeup_ );
+    }
+}
 
-    if ( not output.SerializeToFileDescriptor( file.fd().fd_num() ) ) {
+string HTTPDiskStore::store_body( const string & body ) const
+{
+    unsigned char digest[ EVP_MAX_MD_SIZE ];
+    unsigned int digest_length;
+    if ( EVP_Digest( body.data(), body.size(), digest, &digest_length, EVP_sha256(), nullptr ) != 1 ) {
+        throw runtime_error( "EVP_Digest: failed" );
+    }
+
+    string hex_digest;
+    for ( unsigned int i = 0; i < digest_length; i++ ) {
+        hex_digest.push_back( "0123456789abcdef"[ digest[ i ] >> 4 ] );
+        hex_digest.push_back( "0123456789abcdef"[ digest[ i ] & 0xf ] );
+    }
+
+    /* written whole under a temporary name, so the digest's file is always complete */
+    const string filename = body_store_ + hex_digest;
+    if ( access( filename.c_str(), F_OK ) < 0 ) {
+        UniqueFile file( filename );
+        file.write( body );
+        SystemCall( "rename " + filename, rename( file.name().c_str(), filename.c_str() ) );
+    }
+
+    return hex_digest;
+}
+
+void HTTPDiskStore::write( const Item & item, MahimahiProtobufs::ReplayIndex & index )
+{
+    if ( not body_store_.empty() and item->response().body().size() >= MIN_STORED_BODY ) {
+        try {
+            const string digest = store_body( item->response().body() );
+            item->mutable_response()->clear_body();
+            item->mutable_response()->set_body_digest( digest );
+        } catch ( const exception & e ) { /* keep the body in the record instead */
+            print_exception( e );
+        }
+    }
+
+    /* output file to write current request/response pair protobuf (user has all permissions) */
+    UniqueFile file( record_folder_ + "save" );
+
+    if ( not item->SerializeToFileDescriptor( file.fd().fd_num() ) ) {
         throw runtime_error( "save_to_disk: failure to serialize HTTP request/response pair" );
     }
 
+    /* the scan finds the record's fields just as replay would, from the page cache */
+    MahimahiProtobufs::ReplayIndexEntry entry = index_record( file.name() );
+    entry.set_filename( file.name().substr( record_folder_.size() ) );
+    index.add_entry()->Swap( &entry );
+}
+
+void HTTPDiskStore::writer_loop( void )
+{
+    while ( true ) {
+        const vector< Item > batch = queue_.pop_all();
+
+        if ( batch.empty() ) {
+            if ( exiting_ ) { /* everything saved before the destructor started is written */
+                return;
+            }
+
+            /* announce the nap, then check again, so a save() in between can't be missed */
+            writer_sleeping_ = true;
+            if ( queue_.empty() and not exiting_ ) {
+                wakeup_.read();
+            }
+            writer_sleeping_ = false;
+            continue;
+        }
+
+        MahimahiProtobufs::ReplayIndex index;
+        for ( const auto & item : batch ) {
+            try {
+                write( item, index );
+            } catch ( const exception & e ) {
+                print_exception( e );
+            }
+        }
+
+        if ( sync_ ) { /* once per batch, rather than an fsync() per file */
+            /* a shared body store may be on another filesystem */
+            for ( const auto & directory : { record_folder_, body_store_ } ) {
+                if ( directory.empty() ) {
+                    continue;
+                }
+
+                try {
+                    FileDescriptor folder( SystemCall( "open " + directory,
+                                                       open( directory.c_str(), O_RDONLY | O_DIRECTORY ) ) );
+                    SystemCall( "syncfs", syncfs( folder.fd_num() ) );
+                } catch ( const exception & e ) {
+                    print_exception( e );
+                }
+            }
+        }
+
+        /* after the records, so (once synced) an entry never refers to a record
+           that isn't on disk; a crash can at worst cut this append short */
+        try {
+            index_.write( index.SerializeAsString() );
+            if ( sync_ ) {
+                SystemCall( "fdatasync", fdatasync( index_.fd_num() ) );
+            }
+        } catch ( const exception & e ) {
+            print_exception( e );
+        }
+    }
 }
@@ -4,11 +4,20 @@
 #define BACKING_STORE_HH
 
 #include <string>
-#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
 
 #include "http_request.hh"
 #include "http_response.hh"
 #include "address.hh"
+#include "file_descriptor.hh"
+#include "mpsc_queue.hh"
+
+namespace MahimahiProtobufs {
+    class RequestResponse;
+    class ReplayIndex;
+}
 
 /* abstract base class to store an HTTP request/response from a particular server address */
 class HTTPBackingStore
@@ -18,14 +27,53 @@ public:
     virtual ~HTTPBackingStore() {}
 };
 
+/* saves each pair to its own file in a directory, behind the proxy's back:
+   save() just converts the pair to a protobuf and queues it, and a writer
+   thread drains the queue a batch at a time, so no connection ever waits
+   on the disk or on another's save. After each batch, the writer appends
+   the batch's replay index entries to the directory's RECORD_INDEX_NAME
+   file, so replay needn't scan the records. */
 class HTTPDiskStore : public HTTPBackingStore
 {
 private:
+    typedef std::unique_ptr< MahimahiProtobufs::RequestResponse > Item;
+
     std::string record_folder_;
-    std::mutex mutex_;
+
+    /* sync the filesystem after each batch, so a crash loses at most the batch being written */
+    bool sync_;
+
+    /* if not empty (then ending in '/'), large response bodies are saved
+       here once each, named by digest, and records refer to them */
+    std::string body_store_;
+
+    /* the recorder's index, opened for appending */
+    FileDescriptor index_;
+
+    MPSCQueue< Item > queue_;
+
+    /* eventfd the writer sleeps on when the queue is empty */
+    FileDescriptor wakeup_;
+    std::atomic<bool> writer_sleeping_, exiting_;
+
+    std::thread writer_;
+
+    /* write one record, and add its entry to the batch's index */
+    void write( const Item & item, MahimahiProtobufs::ReplayIndex & index );
+    void writer_loop( void );
+
+    /* save a body to the body store (if it isn't there already) and return its digest */
+    std::string store_body( const std::string & body ) const;
 
 public:
-    HTTPDiskStore( const std::string & record_folder );
+    /* body_store is the recording's own BODY_STORE_NAME subdirectory, or
+       a directory shared by many recordings (which each link to it) */
+    HTTPDiskStore( const std::string & record_folder, const bool sync = false,
+                   const std::string & body_store = "" );
+
+    /* writes out everything saved so far before returning */
+    ~HTTPDiskStore();
+
     void save( const HTTPResponse & response, const Address & server_address ) override;
 };
 
@@ -3,6 +3,9 @@
 #ifndef BODY_PARSER_HH
 #define BODY_PARSER_HH
 
+#include <string>
+#include <boost/utility/string_ref.hpp>
+
 class BodyParser
 {
 public:
@@ -10,7 +13,7 @@ public:
         - entire string belongs to body
         - only some of string (0 bytes to n bytes) belongs to body */
 
-    virtual std::string::size_type read( const std::string & str ) = 0;
+    virtual std::string::size_type read( const boost::string_ref & str ) = 0;
 
     /* does message become complete upon EOF in body? */
     virtual bool eof( void ) const = 0;
@@ -23,7 +26,7 @@ class Rule5BodyParser : public BodyParser
 {
 public:
     /* all of buffer always belongs to body */
-    std::string::size_type read( const std::string & ) override
+    std::string::size_type read( const boost::string_ref & ) override
     {
         return std::string::npos;
     }
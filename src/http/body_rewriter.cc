@@ -0,0 +1,157 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <fcntl.h>
+
+#include <ios>
+#include <functional>
+#include <boost/iostreams/filtering_streambuf.hpp>
+#include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+
+#include "body_rewriter.hh"
+#include "http_message.hh"
+#include "file_descriptor.hh"
+#include "exception.hh"
+
+using namespace std;
+
+const string & BodyRewriter::default_script( void )
+{
+    static const string script = "<script> Date=function(r){function n(n,t,a,u,i,f,o){var c;switch(arguments.length){case 0:case 1:c=new r(e);break;default:a=a||1,u=u||0,i=i||0,f=f||0,o=o||0,c=new r(e)}return c}var e=1619575609705;return n.parse=r.parse,n.UTC=r.UTC,n.toString=r.toString,n.prototype=r.prototype,n.now=function(){return e},n}(Date),Math.exp=function(){function r(r){var n=new ArrayBuffer(8);return new Float64Array(n)[0]=r,0|new Uint32Array(n)[1]}function n(r){var n=new ArrayBuffer(8);return new Float64Array(n)[0]=r,new Uint32Array(n)[0]}function e(r,n){var e=new ArrayBuffer(8);return new Uint32Array(e)[1]=r,new Uint32Array(e)[0]=n,new Float64Array(e)[0]}var t=[.5,-.5],a=[.6931471803691238,-.6931471803691238],u=[1.9082149292705877e-10,-1.9082149292705877e-10];return function(i){var f,o=0,c=0,w=0,y=r(i),v=y>>31&1;if((y&=2147483647)>=1082535490){if(y>=2146435072)return isNaN(i)?i:0==v?i:0;if(i>709.782712893384)return 1/0;if(i<-745.1332191019411)return 0}if(y>1071001154){if(y<1072734898){if(1==i)return Math.E;c=i-a[v],w=u[v],o=1-v-v}else o=1.4426950408889634*i+t[v]|0,f=o,c=i-f*a[0],w=f*u[0];i=c-w}else{if(y<1043333120)return 1+i;o=0}f=i*i;var s=i-f*(.16666666666666602+f*(f*(6613756321437934e-20+f*(4.1381367970572385e-8*f-16533902205465252e-22))-.0027777777777015593));if(0==o)return 1-(i*s/(s-2)-i);var A=1-(w-i*s/(2-s)-c);return o>=-1021?A=e((o<<20)+r(A),n(A)):(A=e((o+1e3<<20)+r(A),n(A)),A*=9.332636185032189e-302)}}(),/*Math.random=function(){var r,n,e,t;return r=.8725217853207141,n=.520505596883595,e=.22893249243497849,t=1,function(){var a=2091639*r+2.3283064365386963e-10*t;return r=n,n=e,t=0|a,e=a-t}}()*/Math.random = function(){return 0.9322873996837797},Object.keys=function(r){return function(n){var e;return e=r(n),e.sort(),e}}(Object.keys); </script>";
+    return script;
+}
+
+string BodyRewriter::read_script( const string & filename )
+{
+    FileDescriptor file( SystemCall( "open " + filename, open( filename.c_str(), O_RDONLY ) ) );
+
+    string ret;
+    while ( not file.eof() ) {
+        ret.append( file.read() );
+    }
+
+    return ret;
+}
+
+BodyRewriter::BodyRewriter( const string & script, const int gzip_level, const size_t cache_capacity )
+    : script_( script ),
+      gzip_level_( gzip_level ),
+      cache_capacity_( cache_capacity )
+{
+    if ( gzip_level_ < 0 or gzip_level_ > 9 ) {
+        throw runtime_error( "BodyRewriter: gzip level must be between 0 and 9" );
+    }
+}
+
+/* is the body gzipped? (the caller has checked can_decode()) */
+static bool is_gzip( const string & content_encoding )
+{
+    return HTTPMessage::equivalent_strings( content_encoding, "gzip" )
+        or HTTPMessage::equivalent_strings( content_encoding, "x-gzip" );
+}
+
+bool BodyRewriter::can_decode( const string & content_encoding )
+{
+    return content_encoding.empty()
+        or HTTPMessage::equivalent_strings( content_encoding, "identity" )
+        or is_gzip( content_encoding );
+}
+
+string BodyRewriter::rewrite_uncached( const string & body, const bool gzipped ) const
+{
+    if ( not gzipped ) {
+        return script_ + body;
+    }
+
+    namespace bio = boost::iostreams;
+
+    string ret;
+
+    bio::filtering_streambuf< bio::output > out;
+    out.push( bio::gzip_compressor( bio::gzip_params( gzip_level_ ) ) );
+    out.push( bio::back_inserter( ret ) );
+    out.sputn( script_.data(), script_.size() );
+
+    /* the page goes straight from the decompressor to the compressor */
+    bio::filtering_streambuf< bio::input > in;
+    in.push( bio::gzip_decompressor() );
+    in.push( bio::array_source( body.data(), body.size() ) );
+
+    /* closes out, which finishes the gzip stream */
+    bio::copy( in, out );
+
+    return ret;
+}
+
+bool BodyRewriter::cache_lookup( const size_t digest, const string & body, const bool gzipped,
+                                 string & rewritten )
+{
+    unique_lock<mutex> ul( cache_mutex_ );
+
+    const auto entry = cache_.find( digest );
+    if ( entry == cache_.end()
+         or entry->second.gzipped != gzipped
+         or entry->second.original != body ) {
+        return false;
+    }
+
+    recently_used_.splice( recently_used_.begin(), recently_used_, entry->second.recency );
+    rewritten = entry->second.rewritten;
+    return true;
+}
+
+void BodyRewriter::cache_insert( const size_t digest, const string & body, const bool gzipped,
+                                 const string & rewritten )
+{
+    const size_t bytes = body.size() + rewritten.size();
+    if ( bytes > cache_capacity_ ) {
+        return;
+    }
+
+    unique_lock<mutex> ul( cache_mutex_ );
+
+    /* a body with the same digest gives way to this one */
+    const auto existing = cache_.find( digest );
+    if ( existing != cache_.end() ) {
+        cache_bytes_ -= existing->second.original.size() + existing->second.rewritten.size();
+        recently_used_.erase( existing->second.recency );
+        cache_.erase( existing );
+    }
+
+    while ( cache_bytes_ + bytes > cache_capacity_ ) {
+        const auto victim = cache_.find( recently_used_.back() );
+        cache_bytes_ -= victim->second.original.size() + victim->second.rewritten.size();
+        cache_.erase( victim );
+        recently_used_.pop_back();
+    }
+
+    recently_used_.push_front( digest );
+    cache_.emplace( digest, CachedRewrite { body, gzipped, rewritten, recently_used_.begin() } );
+    cache_bytes_ += bytes;
+}
+
+bool BodyRewriter::rewrite( const string & content_encoding, string & body )
+{
+    if ( not can_decode( content_encoding ) ) {
+        return false;
+    }
+
+    const bool gzipped = is_gzip( content_encoding );
+    const size_t digest = hash< string >()( body );
+
+    string rewritten;
+    if ( not cache_lookup( digest, body, gzipped, rewritten ) ) {
+        try {
+            rewritten = rewrite_uncached( body, gzipped );
+        } catch ( const ios_base::failure & e ) { /* gzip_error: not really gzip, or cut short */
+            return false;
+        }
+
+        cache_insert( digest, body, gzipped, rewritten );
+    }
+
+    body = move( rewritten );
+    return true;
+}
@@ -0,0 +1,87 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef BODY_REWRITER_HH
+#define BODY_REWRITER_HH
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+
+/* injects a script at the top of HTML pages (by default, one that pins
+   Date, Math.random and friends, so a page runs the same way each time it
+   is loaded). A gzipped page is inflated and deflated again in one pass,
+   without holding the uncompressed page.
+
+   Sites serve the same document many times (and the replay servers serve
+   each one over and over), so rewritten pages are cached, keyed by a digest
+   of the body as it arrived, up to a limit on the bytes held. A hit is
+   checked against the whole body, so a collision only costs a rewrite.
+   Thread-safe. */
+class BodyRewriter
+{
+private:
+    std::string script_;
+    int gzip_level_;
+    size_t cache_capacity_;
+
+    struct CachedRewrite
+    {
+        std::string original;
+        bool gzipped;
+        std::string rewritten;
+        std::list< size_t >::iterator recency; /* position in recently_used_ */
+    };
+
+    std::mutex cache_mutex_ {};
+
+    /* digest of the original body -> its rewrite */
+    std::unordered_map< size_t, CachedRewrite > cache_ {};
+
+    /* digests in cache_, most recently used first */
+    std::list< size_t > recently_used_ {};
+
+    size_t cache_bytes_ {0};
+
+    std::string rewrite_uncached( const std::string & body, const bool gzipped ) const;
+
+    bool cache_lookup( const size_t digest, const std::string & body, const bool gzipped,
+                       std::string & rewritten );
+
+    void cache_insert( const size_t digest, const std::string & body, const bool gzipped,
+                       const std::string & rewritten );
+
+public:
+    /* zlib's default, which compresses HTML nearly as well as level 9 in much less time */
+    static const int DEFAULT_GZIP_LEVEL = 6;
+
+    static const size_t DEFAULT_CACHE_CAPACITY = 64 << 20;
+
+    /* what mahimahi has always injected */
+    static const std::string & default_script( void );
+
+    /* the contents of a file, to pass as the script */
+    static std::string read_script( const std::string & filename );
+
+    BodyRewriter( const std::string & script = default_script(),
+                  const int gzip_level = DEFAULT_GZIP_LEVEL,
+                  const size_t cache_capacity = DEFAULT_CACHE_CAPACITY );
+
+    const std::string & script( void ) const { return script_; }
+    int gzip_level( void ) const { return gzip_level_; }
+
+    /* can a body with this Content-Encoding (empty if none) be rewritten?
+       (only identity and gzip can) */
+    static bool can_decode( const std::string & content_encoding );
+
+    /* inject the script into an HTML body with this Content-Encoding.
+       Returns false (leaving the body alone) if the encoding can't be
+       decoded, or the body isn't the gzip stream it's labeled as. */
+    bool rewrite( const std::string & content_encoding, std::string & body );
+
+    /* ban copying */
+    BodyRewriter( const BodyRewriter & other ) = delete;
+    BodyRewriter & operator=( const BodyRewriter & other ) = delete;
+};
+
+#endif /* BODY_REWRITER_HH */
@@ -1,123 +1,133 @@
 /* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
 #include <cassert>
+#include <cstring>
+#include <limits>
+#include <algorithm>
 
-#include "ezio.hh"
 #include "chunked_parser.hh"
 
 using namespace std;
 
-/* Take a chunk header and parse it assuming no folding */
-uint32_t ChunkedBodyParser::get_chunk_size( const string & chunk_hdr ) const
+static int hex_digit_value( const char c )
 {
-    /* Check that the chunk header ends with a CRLF */
-    assert(chunk_hdr.substr( chunk_hdr.length() - 2, 2 ) == "\r\n" );
+    if ( c >= '0' and c <= '9' ) {
+        return c - '0';
+    } else if ( c >= 'a' and c <= 'f' ) {
+        return c - 'a' + 10;
+    } else if ( c >= 'A' and c <= 'F' ) {
+        return c - 'A' + 10;
+    }
 
-    /* If there are chunk extensions, ';' terminates chunk size */
-    auto pos = chunk_hdr.find( ";" );
+    return -1;
+}
 
-    /* There are no ';'s, and hence no chunk externsions, CRLF terminates chunk size */
-    if ( pos == string::npos ) {
-        pos = chunk_hdr.find( "\r\n" );
+static void expect( const char c, const char expected, const char * where )
+{
+    if ( c != expected ) {
+        throw runtime_error( string( "ChunkedBodyParser: malformed " ) + where );
     }
+}
 
-    /* Can't be npos even now */
-    assert( pos != string::npos );
-
-    /* Parse hex string, after removing trailing spaces (RFC 2616 Section 2.1) */
-    auto hex_string = chunk_hdr.substr( 0, pos );
-    auto space_loc = hex_string.find( " " );
-    if ( space_loc != string::npos ) hex_string.erase( space_loc, hex_string.length() - space_loc );
-    return myatoi( hex_string, 16 );
+/* position of the next CR at or after pos, or end if there isn't one */
+static size_t find_cr( const boost::string_ref & str, const size_t pos )
+{
+    const void * cr = memchr( str.data() + pos, '\r', str.size() - pos );
+    return cr ? static_cast<const char *>( cr ) - str.data() : str.size();
 }
 
-string::size_type ChunkedBodyParser::read( const std::string & input_buffer )
+/* returns npos while all of input belongs to the body, and
+   once the body is complete, how much of input finished it */
+string::size_type ChunkedBodyParser::read( const boost::string_ref & input )
 {
-    parser_buffer_ += input_buffer;
-
-    while ( !parser_buffer_.empty() ) {
-        switch (state_) {
-        case CHUNK_HDR: {
-            auto it = parser_buffer_.find( "\r\n" );
-            if (it != string::npos) {
-                /* if you have CRLF, get chunk size & transition to CHUNK/TRAILER */
-                current_chunk_size_ = get_chunk_size( parser_buffer_.substr( 0, it + 2 ) );
-
-                /* Transition appropriately */
-                state_ = ( current_chunk_size_ == 0 ) ? TRAILER : CHUNK;
-
-                /* shrink parser_buffer_ */
-                parsed_so_far_ += ( it + 2 );
-                parser_buffer_ = parser_buffer_.substr( it + 2 );
-                break;
+    assert( state_ != DONE );
+
+    size_t pos = 0;
+
+    while ( pos < input.size() ) {
+        switch ( state_ ) {
+        case SIZE: {
+            const int digit = hex_digit_value( input[ pos ] );
+            if ( digit >= 0 ) {
+                if ( chunk_remaining_ > numeric_limits<uint64_t>::max() >> 4 ) {
+                    throw runtime_error( "ChunkedBodyParser: chunk size too large" );
+                }
+                chunk_remaining_ = (chunk_remaining_ << 4) | digit;
+                size_digits_++;
+            } else if ( size_digits_ == 0 ) {
+                throw runtime_error( "ChunkedBodyParser: malformed chunk size" );
+            } else if ( input[ pos ] == '\r' ) {
+                state_ = SIZE_LF;
             } else {
-                /* if you haven't seen a CRLF so far, do nothing */
-                acked_so_far_ += input_buffer.length();
-                return string::npos;
+                /* trailing whitespace or chunk extensions, which are ignored */
+                state_ = SIZE_EXTENSION;
             }
+            pos++;
+            break;
         }
 
-        case CHUNK: {
-            if ( parser_buffer_.length() >= current_chunk_size_ + 2 ) {
-                /* accumulated enough bytes, check CRLF at the end of the chunk */
-                assert( parser_buffer_.substr( current_chunk_size_, 2 ) == "\r\n" );
-
-                /* Transition to next state */
-                state_ = CHUNK_HDR;
-
-                /* shrink parser_buffer_ */
-                parsed_so_far_ += current_chunk_size_ + 2;
-                parser_buffer_ = parser_buffer_.substr( current_chunk_size_ + 2 );
-                break;
-            } else {
-                /* Haven't seen enough bytes so far, do nothing */
-                acked_so_far_ += input_buffer.length();
-                return string::npos;
+        case SIZE_EXTENSION:
+            pos = find_cr( input, pos );
+            if ( pos < input.size() ) {
+                state_ = SIZE_LF;
+                pos++;
+            }
+            break;
+
+        case SIZE_LF:
+            expect( input[ pos++ ], '\n', "chunk header" );
+            size_digits_ = 0;
+            state_ = chunk_remaining_ ? DATA : TRAILER_LINE_START;
+            break;
+
+        case DATA: {
+            const size_t amount = min( chunk_remaining_, uint64_t( input.size() - pos ) );
+            pos += amount;
+            chunk_remaining_ -= amount;
+            if ( chunk_remaining_ == 0 ) {
+                state_ = DATA_CR;
             }
+            break;
         }
 
-        case TRAILER: {
-            if ( trailers_enabled_) {
-                /* We need two consecutive CRLFs */
-                return compute_ack_size( parser_buffer_,
-                                         "\r\n\r\n",
-                                         input_buffer.length() );
-            } else {
-                /* We need only one CRLF now */
-                return compute_ack_size( parser_buffer_,
-                                         "\r\n",
-                                         input_buffer.length() );
+        case DATA_CR:
+            expect( input[ pos++ ], '\r', "chunk ending" );
+            state_ = DATA_LF;
+            break;
+
+        case DATA_LF:
+            expect( input[ pos++ ], '\n', "chunk ending" );
+            state_ = SIZE;
+            break;
+
+        /* after the last chunk, any trailer fields and then an empty line */
+        case TRAILER_LINE_START:
+            state_ = input[ pos++ ] == '\r' ? LAST_LF : TRAILER_LINE;
+            break;
+
+        case TRAILER_LINE:
+            pos = find_cr( input, pos );
+            if ( pos < input.size() ) {
+                state_ = TRAILER_LF;
+                pos++;
             }
-        }
+            break;
+
+        case TRAILER_LF:
+            expect( input[ pos++ ], '\n', "trailer" );
+            state_ = TRAILER_LINE_START;
+            break;
 
-        default: {
+        case LAST_LF:
+            expect( input[ pos++ ], '\n', "end of chunked body" );
+            state_ = DONE;
+            return pos;
+
+        case DONE: /* nobody should be reading past the end */
             assert( false );
-            return false;
-        }
+            return 0;
         }
     }
-    acked_so_far_ += input_buffer.length();
-    return string::npos;
-}
 
-/*
-   Computes the acknowledgement from the BodyParser to its caller,
-   telling it how much of the current input_buffer has been
-   successfully parsed.
-*/
-string::size_type ChunkedBodyParser::compute_ack_size( const string & haystack,
-                                                       const string & needle,
-                                                       const string::size_type input_size )
-{
-    auto loc = haystack.find( needle );
-    if ( loc != string::npos ) {
-        /* Found it, eat up the whole buffer */
-        parsed_so_far_ += loc + needle.length();
-        assert( parsed_so_far_ > acked_so_far_ );
-        return ( parsed_so_far_ - acked_so_far_ );
-    } else {
-        /* Find unacknowledged buffer so far, ack it, and be done */
-        acked_so_far_ += input_size;
-        return loc;
-    }
+    return string::npos;
 }
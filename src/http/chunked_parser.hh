@@ -3,30 +3,31 @@
 #ifndef CHUNKED_BODY_PARSER_HH
 #define CHUNKED_BODY_PARSER_HH
 
+#include <cstdint>
+
 #include "body_parser.hh"
 #include "exception.hh"
 
+/* follows the chunked framing (RFC 7230 section 4.1) as the body goes by,
+   without keeping any of it: all that carries over from one read() to the
+   next is where in the framing it got to */
 class ChunkedBodyParser : public BodyParser
 {
 private:
-    std::string::size_type compute_ack_size(const std::string & haystack,
-                                            const std::string & needle,
-                                            std::string::size_type input_size);
-    uint32_t get_chunk_size(const std::string & chunk_hdr) const;
-    std::string parser_buffer_ {""};
-    uint32_t current_chunk_size_ {0};
-    std::string::size_type acked_so_far_ {0};
-    std::string::size_type parsed_so_far_ {0};
-    enum {CHUNK_HDR, CHUNK, TRAILER} state_ {CHUNK_HDR};
-    const bool trailers_enabled_ {false};
+    enum { SIZE, SIZE_EXTENSION, SIZE_LF, DATA, DATA_CR, DATA_LF,
+           TRAILER_LINE_START, TRAILER_LINE, TRAILER_LF, LAST_LF, DONE } state_ {SIZE};
+
+    /* hex digits of the chunk size read so far */
+    unsigned int size_digits_ {0};
+
+    /* the chunk size, as far as it's been read; then, in the chunk, the bytes left */
+    uint64_t chunk_remaining_ {0};
 
 public:
-    std::string::size_type read( const std::string & ) override;
+    std::string::size_type read( const boost::string_ref & ) override;
 
     /* Follow item 2, Section 4.4 of RFC 2616 */
     bool eof( void ) const override { return true; }
-
-    ChunkedBodyParser(bool t_trailers_enabled) : trailers_enabled_( t_trailers_enabled ) {}
 };
 
 #endif /* CHUNKED_BODY_PARSER_HH */
@@ -1,6 +1,7 @@
 /* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
 #include <string>
+#include <cstring>
 #include <assert.h>
 
 #include "http_header.hh"
@@ -10,29 +11,29 @@
 using namespace std;
 
 /* parse a header line into a key and a value */
-HTTPHeader::HTTPHeader( const string & buf )
-  : key_(), value_()
+HTTPHeader::HTTPHeader( const boost::string_ref & buf )
+  : key_(), value_(), key_hash_()
 {
-    const string separator = ":";
-
-    /* step 1: does buffer contain colon? */
-    size_t colon_location = buf.find( separator );
-    if ( colon_location == std::string::npos ) {
-        fprintf( stderr, "Buffer: %s\n", buf.c_str() );
+    /* step 1: does buffer contain colon? (memchr is vectorized, unlike string_ref::find) */
+    const void * colon = memchr( buf.data(), ':', buf.size() );
+    if ( not colon ) {
+        fprintf( stderr, "Buffer: %s\n", buf.to_string().c_str() );
         throw runtime_error( "HTTPHeader: buffer does not contain colon" ); 
     }
+    const size_t colon_location = static_cast<const char *>( colon ) - buf.data();
 
     /* step 2: split buffer */
-    key_ = buf.substr( 0, colon_location );
-    string value_temp = buf.substr( colon_location + separator.size() );
-
-    /* strip whitespace */
-    size_t first_nonspace = value_temp.find_first_not_of( " " );
-    if ( first_nonspace == std::string::npos ) { /* handle case where value is only space */
-        value_ = value_temp;
-    } else {
-        value_ = value_temp.substr( first_nonspace );
+    key_.assign( buf.data(), colon_location );
+    boost::string_ref value_temp = buf.substr( colon_location + 1 );
+
+    /* strip whitespace, unless the value is only space */
+    size_t first_nonspace = value_temp.find_first_not_of( ' ' );
+    if ( first_nonspace != boost::string_ref::npos ) {
+        value_temp.remove_prefix( first_nonspace );
     }
+    value_.assign( value_temp.data(), value_temp.size() );
+
+    key_hash_ = hash_name( key_ );
 
     /*
     fprintf( stderr, "Got header. key=[[%s]] value = [[%s]]\n",
@@ -41,8 +42,29 @@ HTTPHeader::HTTPHeader( const string & buf )
 }
 
 HTTPHeader::HTTPHeader( const MahimahiProtobufs::HTTPHeader & proto )
-    : key_( proto.key() ), value_( proto.value() )
+    : key_( proto.key() ), value_( proto.value() ), key_hash_( hash_name( key_ ) )
+{
+}
+
+/* FNV-1a over the name in lowercase (locale-insensitive ASCII) */
+uint32_t HTTPHeader::hash_name( const boost::string_ref & name )
 {
+    uint32_t hash = 2166136261u;
+
+    bool leading = true;
+    for ( char c : name ) {
+        if ( leading and c == ' ' ) {
+            continue;
+        }
+        leading = false;
+
+        if ( c >= 'A' and c <= 'Z' ) {
+            c += 'a' - 'A';
+        }
+        hash = (hash ^ static_cast<unsigned char>( c )) * 16777619u;
+    }
+
+    return hash;
 }
 
 MahimahiProtobufs::HTTPHeader HTTPHeader::toprotobuf( void ) const
@@ -4,6 +4,8 @@
 #define HTTP_HEADER_HH
 
 #include <string>
+#include <cstdint>
+#include <boost/utility/string_ref.hpp>
 
 #include "http_record.pb.h"
 
@@ -12,10 +14,17 @@ class HTTPHeader
 private:
     std::string key_, value_;
 
+    /* hash_name( key_ ), for finding the header by name */
+    uint32_t key_hash_;
+
 public:
-    HTTPHeader( const std::string & buf );
+    HTTPHeader( const boost::string_ref & buf );
+
+    /* of a header name, ignoring case and leading spaces (as names are compared) */
+    static uint32_t hash_name( const boost::string_ref & name );
 
     const std::string & key( void ) const { return key_; }
+    uint32_t key_hash( void ) const { return key_hash_; }
     const std::string & value( void ) const { return value_; }
     void set_value(std::string val) {value_ = val;}
 
@@ -5,10 +5,16 @@
 
 #include <string>
 #include <vector>
+#include <memory>
+#include <cstdint>
+#include <boost/utility/string_ref.hpp>
+#include <boost/container/small_vector.hpp>
 
 #include "http_header.hh"
 #include "http_record.pb.h"
 
+class BodyRewriter;
+
 enum HTTPMessageState { FIRST_LINE_PENDING, HEADERS_PENDING, BODY_PENDING, COMPLETE };
 
 /* helper for parsers */
@@ -26,17 +32,34 @@ private:
     virtual void calculate_expected_body_size( void ) = 0;
 
     /* bodies with size not known in advance must be handled by subclass */
-    virtual size_t read_in_complex_body( const std::string & str ) = 0;
+    virtual size_t read_in_complex_body( const boost::string_ref & str ) = 0;
 
     /* does message become complete upon EOF in body? */
     virtual bool eof_in_body( void ) const = 0;
 
+    /* open-addressed hash index of headers_ by name: each slot holds a
+       position in headers_ plus one, or zero if empty. Kept at most half
+       full, so a lookup is a probe or two and allocates nothing. */
+    boost::container::small_vector< uint16_t, 32 > header_index_ {};
+
+    void index_header( const size_t position );
+
+    /* call found( position ) for each header with this name, in no particular order */
+    template <class Callback>
+    void find_headers( const boost::string_ref & header_name, Callback && found ) const;
+
+    /* the first (or last) header with this name, or null */
+    const HTTPHeader * find_header( const boost::string_ref & header_name, const bool last = false ) const;
+
+    /* once a body of known size is complete, inject the script into it if it's HTML */
+    void rewrite_body( void );
+
 protected:
     /* request line or status line */
     std::string first_line_ {};
 
-    /* request/response headers */
-    std::vector< HTTPHeader > headers_ {};
+    /* request/response headers, in order (see header_index_ to find one) */
+    boost::container::small_vector< HTTPHeader, 16 > headers_ {};
 
     /* body may be empty */
     std::string body_ {};
@@ -51,11 +74,11 @@ public:
     HTTPMessage() {}
     virtual ~HTTPMessage() {}
 
-    /* methods called by an external parser */
-    void set_first_line( const std::string & str );
-    void add_header( const std::string & str );
+    /* methods called by an external parser (which needn't keep str afterwards) */
+    void set_first_line( const boost::string_ref & str );
+    void add_header( const boost::string_ref & str );
     void done_with_headers( void );
-    size_t read_in_body( const std::string & str );
+    size_t read_in_body( const boost::string_ref & str );
     void eof( void );
 
     /* getters */
@@ -68,9 +91,25 @@ public:
     bool has_header( const std::string & header_name ) const;
     const std::string & get_header_value( const std::string & header_name ) const;
 
-    void rewrite_body( std::string & body);
+    /* does the comma-separated header list the token (e.g. Connection: close)? */
+    bool has_header_token( const std::string & header_name, const std::string & token ) const;
+
+    /* is the (last) Content-Type some kind of HTML? */
+    bool is_html( void ) const;
+
+    /* the (last) Content-Encoding, or empty if none */
+    std::string content_encoding( void ) const;
+
+    /* the rewriter applied to the body of each HTML message parsed (by
+       default, one injecting BodyRewriter::default_script()), or null to
+       leave bodies alone. Not thread-safe, so call before parsing. */
+    static void rewrite_html_with( const std::shared_ptr< BodyRewriter > & rewriter );
+
+    /* will the body be rewritten once it's complete? (if so, the
+       message can't be passed on until then.) call once headers are done */
+    bool body_will_be_rewritten( void ) const;
+
     void update_header( const std::string & header_name, std::string val );
-    const std::string gen_random(const int len) const;
 
     /* serialize the request or response as one string */
     std::string str( void ) const;
@@ -80,7 +119,7 @@ public:
 
     /* compare two strings for (case-insensitive) equality,
        in ASCII without sensitivity to locale */
-    static bool equivalent_strings( const std::string & a, const std::string & b );
+    static bool equivalent_strings( const boost::string_ref & a, const boost::string_ref & b );
 
     /* construct from protobuf */
     HTTPMessage( const MahimahiProtobufs::HTTPMessage & proto );
@@ -5,30 +5,51 @@
 
 #include <string>
 #include <queue>
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <boost/utility/string_ref.hpp>
 
 #include "http_message.hh"
+#include "line_scanner.hh"
 
 template <class MessageType>
 class HTTPMessageSequence
 {
 private:
+    /* the unparsed bytes are buffer_[offset_, end). Popping just moves
+       offset_, and the consumed bytes are only reclaimed (on append) once
+       they outnumber the rest, so each byte is copied down at most once. */
     class InternalBuffer
     {
     private:
         std::string buffer_ {};
-    
+        size_t offset_ {0};
+
+        /* the CRLFs that end the lines of a message's head are found in
+           one pass (see line_scanner.hh). These are the ones not yet popped,
+           from next_line_ on; no others start in [offset_, scanned_). */
+        std::vector< size_t > line_ends_ {};
+        size_t next_line_ {0};
+        size_t scanned_ {0};
+
     public:
-        bool have_complete_line( void ) const;
+        bool have_complete_line( void );
 
-        std::string get_and_pop_line( void );
+        /* the line (without its CRLF), valid until the next append */
+        boost::string_ref get_and_pop_line( void );
 
         void pop_bytes( const size_t n );
 
-        bool empty( void ) const { return buffer_.empty(); }
+        bool empty( void ) const { return offset_ == buffer_.size(); }
 
-        void append( const std::string & str ) { buffer_.append( str ); }
+        void append( const std::string & str );
 
-        const std::string & str( void ) const { return buffer_; }
+        /* the unparsed bytes, valid until the next append */
+        boost::string_ref unparsed( void ) const
+        {
+            return boost::string_ref( buffer_.data() + offset_, buffer_.size() - offset_ );
+        }
     };
 
     /* bytes that haven't been parsed yet */
@@ -37,6 +58,17 @@ private:
     /* complete messages ready to go */
     std::queue< MessageType > complete_messages_ {};
 
+    /* optionally, the bytes of each message as soon as they can be passed on */
+    bool forwarding_ { false };
+    std::string forwarded_ {};
+
+    /* raw first line and headers of the message in progress, until we know
+       whether its body will be rewritten */
+    std::string raw_headers_ {};
+
+    /* is the message in progress being passed on as it's parsed? */
+    bool streaming_ { false };
+
     /* one loop through the parser */
     /* returns whether to continue */
     bool parsing_step( void );
@@ -45,6 +77,9 @@ private:
        must be implemented by subclass */
     virtual void initialize_new_message( void ) = 0;
 
+    /* what to do once the message in progress is complete, before it's queued */
+    virtual void finish_message( void ) {}
+
 protected:
     /* the current message we're working on */
     MessageType message_in_progress_ {};
@@ -62,32 +97,79 @@ public:
 
     /* pop one request */
     void pop( void ) { complete_messages_.pop(); }
+
+    /* nothing parsed or buffered beyond the complete messages */
+    bool between_messages( void ) const
+    {
+        return message_in_progress_.state() == FIRST_LINE_PENDING and buffer_.empty();
+    }
+
+    /* for proxies: make the bytes of each message available to pass on as
+       they're parsed, without waiting for the message to be complete. The
+       exception is a message whose body will be rewritten, which is passed
+       on (rewritten) once it's complete. Messages are still queued whole. */
+    void forward_while_parsing( void ) { forwarding_ = true; }
+
+    /* move whatever is ready to pass on to the end of output */
+    void take_forwarded( std::string & output )
+    {
+        output.append( forwarded_ );
+        forwarded_.clear();
+    }
 };
 
 template <class MessageType>
-bool HTTPMessageSequence<MessageType>::InternalBuffer::have_complete_line( void ) const
+bool HTTPMessageSequence<MessageType>::InternalBuffer::have_complete_line( void )
 {
-    size_t first_line_ending = buffer_.find( CRLF );
-    return first_line_ending != std::string::npos;
+    if ( next_line_ == line_ends_.size() ) {
+        line_ends_.clear();
+        next_line_ = 0;
+        scanned_ = scan_lines( buffer_, std::max( offset_, scanned_ ), line_ends_ );
+    }
+
+    return next_line_ < line_ends_.size();
 }
 
 template <class MessageType>
-std::string HTTPMessageSequence<MessageType>::InternalBuffer::get_and_pop_line( void )
+boost::string_ref HTTPMessageSequence<MessageType>::InternalBuffer::get_and_pop_line( void )
 {
-    size_t first_line_ending = buffer_.find( CRLF );
-    assert( first_line_ending != std::string::npos );
+    /* the caller has checked have_complete_line() */
+    assert( next_line_ < line_ends_.size() );
 
-    std::string first_line( buffer_.substr( 0, first_line_ending ) );
-    pop_bytes( first_line_ending + CRLF.size() );
+    const boost::string_ref line( buffer_.data() + offset_, line_ends_[ next_line_ ] - offset_ );
+    pop_bytes( line.size() + CRLF.size() );
 
-    return first_line;
+    return line;
 }
 
 template <class MessageType>
 void HTTPMessageSequence<MessageType>::InternalBuffer::pop_bytes( const size_t num )
 {
-    assert( buffer_.size() >= num );
-    buffer_.replace( 0, num, std::string() );
+    assert( buffer_.size() - offset_ >= num );
+    offset_ += num;
+    scanned_ = std::max( scanned_, offset_ );
+
+    while ( next_line_ < line_ends_.size() and line_ends_[ next_line_ ] < offset_ ) {
+        next_line_++;
+    }
+}
+
+template <class MessageType>
+void HTTPMessageSequence<MessageType>::InternalBuffer::append( const std::string & str )
+{
+    if ( offset_ == buffer_.size() ) {
+        buffer_.clear();
+        offset_ = scanned_ = 0;
+    } else if ( offset_ >= buffer_.size() - offset_ ) {
+        buffer_.erase( 0, offset_ );
+        scanned_ -= offset_;
+        for ( size_t i = next_line_; i < line_ends_.size(); i++ ) {
+            line_ends_[ i ] -= offset_;
+        }
+        offset_ = 0;
+    }
+
+    buffer_.append( str );
 }
 
 template <class MessageType>
@@ -101,7 +183,13 @@ bool HTTPMessageSequence<MessageType>::parsing_step( void )
         /* supply status line to request/response initialization routine */
         initialize_new_message();
 
-        message_in_progress_.set_first_line( buffer_.get_and_pop_line() );
+        {
+            const boost::string_ref line = buffer_.get_and_pop_line();
+            if ( forwarding_ ) {
+                raw_headers_.assign( line.data(), line.size() ).append( CRLF );
+            }
+            message_in_progress_.set_first_line( line );
+        }
 
         return true;
     case HEADERS_PENDING:
@@ -110,9 +198,22 @@ bool HTTPMessageSequence<MessageType>::parsing_step( void )
 
         /* is line blank? */
         {
-            std::string line( buffer_.get_and_pop_line() );
+            const boost::string_ref line = buffer_.get_and_pop_line();
+            if ( forwarding_ ) {
+                raw_headers_.append( line.data(), line.size() ).append( CRLF );
+            }
+
             if ( line.empty() ) {
                 message_in_progress_.done_with_headers();
+
+                /* pass the headers on now, unless the message must wait for its rewritten body */
+                if ( forwarding_ ) {
+                    streaming_ = not message_in_progress_.body_will_be_rewritten();
+                    if ( streaming_ ) {
+                        forwarded_.append( raw_headers_ );
+                    }
+                    raw_headers_.clear();
+                }
             } else {
                 message_in_progress_.add_header( line );
             }
@@ -121,13 +222,23 @@ bool HTTPMessageSequence<MessageType>::parsing_step( void )
 
     case BODY_PENDING:
         {
-            size_t bytes_read = message_in_progress_.read_in_body( buffer_.str() );
-            assert( bytes_read == buffer_.str().size() or message_in_progress_.state() == COMPLETE );
+            const boost::string_ref unparsed = buffer_.unparsed();
+            size_t bytes_read = message_in_progress_.read_in_body( unparsed );
+            assert( bytes_read == unparsed.size() or message_in_progress_.state() == COMPLETE );
+            if ( streaming_ ) {
+                forwarded_.append( unparsed.data(), bytes_read );
+            }
             buffer_.pop_bytes( bytes_read );
         }
         return message_in_progress_.state() == COMPLETE;
 
     case COMPLETE:
+        if ( forwarding_ and not streaming_ ) {
+            forwarded_.append( message_in_progress_.str() );
+        }
+        streaming_ = false;
+
+        finish_message();
         complete_messages_.emplace( std::move( message_in_progress_ ) );
         message_in_progress_ = MessageType();
         return true;
@@ -24,7 +24,7 @@ void HTTPRequest::calculate_expected_body_size( void )
     }
 }
 
-size_t HTTPRequest::read_in_complex_body( const std::string & )
+size_t HTTPRequest::read_in_complex_body( const boost::string_ref & )
 {
     /* we don't support complex bodies */
     throw runtime_error( "HTTPRequest: does not support chunked requests" );
@@ -42,3 +42,11 @@ bool HTTPRequest::is_head( void ) const
     return first_line_.substr( 0, 5 ) == "HEAD ";
 }
 
+bool HTTPRequest::is_idempotent( void ) const
+{
+    assert( state_ > FIRST_LINE_PENDING );
+    const string method = first_line_.substr( 0, first_line_.find( ' ' ) );
+    return method == "GET" or method == "HEAD" or method == "OPTIONS" or method == "TRACE"
+        or method == "PUT" or method == "DELETE";
+}
+
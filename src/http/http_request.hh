@@ -12,7 +12,7 @@ private:
     void calculate_expected_body_size( void ) override;
 
     /* we have no complex bodies */
-    size_t read_in_complex_body( const std::string & str ) override;
+    size_t read_in_complex_body( const boost::string_ref & str ) override;
 
     /* connection closed while body was pending */
     bool eof_in_body( void ) const override;
@@ -20,6 +20,9 @@ private:
 public:
     bool is_head( void ) const;
 
+    /* can the request be repeated without changing its effect (RFC 7231 4.2.2)? */
+    bool is_idempotent( void ) const;
+
     using HTTPMessage::HTTPMessage;
 };
 
@@ -21,6 +21,12 @@ string HTTPResponse::status_code( void ) const
     return tokens.at( 1 );
 }
 
+bool HTTPResponse::is_interim( void ) const
+{
+    const string status = status_code();
+    return status.at( 0 ) == '1' and status != "101";
+}
+
 void HTTPResponse::calculate_expected_body_size( void )
 {
     assert( state_ == BODY_PENDING );
@@ -43,8 +49,8 @@ void HTTPResponse::calculate_expected_body_size( void )
 
         set_expected_body_size( false );
 
-        /* Create body_parser_ with trailers_enabled if requied (RFC 2616 section 14.40) */
-        body_parser_ = unique_ptr< BodyParser >( new ChunkedBodyParser( has_header( "Trailer" ) ) );
+        /* the parser takes trailer fields whether or not a Trailer header announced them */
+        body_parser_ = unique_ptr< BodyParser >( new ChunkedBodyParser() );
     } else if ( (not has_header( "Transfer-Encoding" ) )
                 and has_header( "Content-Length" ) ) {
 
@@ -65,7 +71,7 @@ void HTTPResponse::calculate_expected_body_size( void )
     }
 }
 
-size_t HTTPResponse::read_in_complex_body( const std::string & str )
+size_t HTTPResponse::read_in_complex_body( const boost::string_ref & str )
 {
     assert( state_ == BODY_PENDING );
     assert( body_parser_ );
@@ -73,11 +79,11 @@ size_t HTTPResponse::read_in_complex_body( const std::string & str )
     auto amount_parsed = body_parser_->read( str );
     if ( amount_parsed == std::string::npos ) {
         /* all of it belongs to the body */
-        body_.append( str );
+        body_.append( str.data(), str.size() );
         return str.size();
     } else {
         /* body is now complete */
-        body_.append( str.substr( 0, amount_parsed ) );
+        body_.append( str.data(), amount_parsed );
         state_ = COMPLETE;
         return amount_parsed;
     }
@@ -18,7 +18,7 @@ private:
 
     /* required methods */
     void calculate_expected_body_size( void ) override;
-    size_t read_in_complex_body( const std::string & str ) override;
+    size_t read_in_complex_body( const boost::string_ref & str ) override;
     bool eof_in_body( void ) const override;
 
     std::unique_ptr< BodyParser > body_parser_ { nullptr };
@@ -27,6 +27,9 @@ public:
     void set_request( const HTTPRequest & request );
     const HTTPRequest & request( void ) const { return request_; }
 
+    /* 1xx (other than 101): more responses to the same request will follow */
+    bool is_interim( void ) const;
+
     using HTTPMessage::HTTPMessage;
 };
 
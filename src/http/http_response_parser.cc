@@ -17,8 +17,14 @@ void HTTPResponseParser::initialize_new_message( void )
     }
 
     message_in_progress_.set_request( requests_.front() );
+}
 
-    requests_.pop();
+void HTTPResponseParser::finish_message( void )
+{
+    /* the request is answered once it has a final response (after any interim ones) */
+    if ( not message_in_progress_.is_interim() ) {
+        requests_.pop();
+    }
 }
 
 void HTTPResponseParser::new_request_arrived( const HTTPRequest & request )
@@ -14,9 +14,13 @@ private:
     std::queue< HTTPRequest > requests_ {};
 
     void initialize_new_message( void ) override;
+    void finish_message( void ) override;
 
 public:
     void new_request_arrived( const HTTPRequest & request );
+
+    /* every request has had its whole response */
+    bool all_answered( void ) const { return requests_.empty() and between_messages(); }
 };
 
 #endif /* HTTP_RESPONSE_PARSER_HH */
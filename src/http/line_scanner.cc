@@ -0,0 +1,175 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <cstring>
+
+#if defined( __GNUC__ ) and (defined( __x86_64__ ) or defined( __i386__ ))
+#define LINE_SCANNER_X86 1
+#include <immintrin.h>
+#endif
+
+#include "line_scanner.hh"
+
+using namespace std;
+
+/* note a CRLF; returns whether it ends an empty line */
+static inline bool found_crlf( const char * data, const size_t crlf, vector< size_t > & line_ends )
+{
+    line_ends.push_back( crlf );
+    return crlf >= 2 and data[ crlf - 2 ] == '\r' and data[ crlf - 1 ] == '\n';
+}
+
+static size_t scan_lines_scalar( const char * data, const size_t size, size_t pos,
+                                 vector< size_t > & line_ends )
+{
+    while ( pos + 1 < size ) {
+        const void * cr = memchr( data + pos, '\r', size - pos - 1 );
+        if ( not cr ) {
+            break;
+        }
+
+        const size_t at = static_cast<const char *>( cr ) - data;
+        if ( data[ at + 1 ] != '\n' ) {
+            pos = at + 1;
+        } else if ( found_crlf( data, at, line_ends ) ) {
+            return at + 2;
+        } else {
+            pos = at + 2;
+        }
+    }
+
+    /* a CR at the very end could still be the start of a CRLF */
+    return size > pos ? size - 1 : pos;
+}
+
+#ifdef LINE_SCANNER_X86
+
+#ifdef __SSE2__
+static size_t scan_lines_sse2( const char * data, const size_t size, size_t pos,
+                               vector< size_t > & line_ends )
+{
+    const __m128i cr = _mm_set1_epi8( '\r' ), lf = _mm_set1_epi8( '\n' );
+
+    /* each block reads one byte past itself */
+    while ( pos + sizeof( __m128i ) < size ) {
+        const __m128i here = _mm_loadu_si128( reinterpret_cast<const __m128i *>( data + pos ) );
+        const __m128i next = _mm_loadu_si128( reinterpret_cast<const __m128i *>( data + pos + 1 ) );
+        unsigned int mask = _mm_movemask_epi8( _mm_and_si128( _mm_cmpeq_epi8( here, cr ),
+                                                              _mm_cmpeq_epi8( next, lf ) ) );
+
+        for ( ; mask; mask &= mask - 1 ) {
+            const size_t crlf = pos + __builtin_ctz( mask );
+            if ( found_crlf( data, crlf, line_ends ) ) {
+                return crlf + 2;
+            }
+        }
+
+        pos += sizeof( __m128i );
+    }
+
+    return scan_lines_scalar( data, size, pos, line_ends );
+}
+#endif
+
+__attribute__(( target( "avx2" ) ))
+static size_t scan_lines_avx2( const char * data, const size_t size, size_t pos,
+                               vector< size_t > & line_ends )
+{
+    const __m256i cr = _mm256_set1_epi8( '\r' ), lf = _mm256_set1_epi8( '\n' );
+
+    while ( pos + sizeof( __m256i ) < size ) {
+        const __m256i here = _mm256_loadu_si256( reinterpret_cast<const __m256i *>( data + pos ) );
+        const __m256i next = _mm256_loadu_si256( reinterpret_cast<const __m256i *>( data + pos + 1 ) );
+        unsigned int mask = _mm256_movemask_epi8( _mm256_and_si256( _mm256_cmpeq_epi8( here, cr ),
+                                                                    _mm256_cmpeq_epi8( next, lf ) ) );
+
+        for ( ; mask; mask &= mask - 1 ) {
+            const size_t crlf = pos + __builtin_ctz( mask );
+            if ( found_crlf( data, crlf, line_ends ) ) {
+                return crlf + 2;
+            }
+        }
+
+        pos += sizeof( __m256i );
+    }
+
+    return scan_lines_scalar( data, size, pos, line_ends );
+}
+
+#endif /* LINE_SCANNER_X86 */
+
+static bool cpu_has( const ScanLevel level )
+{
+    switch ( level ) {
+    case ScanLevel::SCALAR:
+        return true;
+#ifdef LINE_SCANNER_X86
+#ifdef __SSE2__
+    case ScanLevel::SSE2:
+        return true;
+#endif
+    case ScanLevel::AVX2:
+        return __builtin_cpu_supports( "avx2" );
+#endif
+    default:
+        return false;
+    }
+}
+
+ScanLevel best_scan_level( void )
+{
+    for ( const auto level : { ScanLevel::AVX2, ScanLevel::SSE2 } ) {
+        if ( cpu_has( level ) ) {
+            return level;
+        }
+    }
+
+    return ScanLevel::SCALAR;
+}
+
+static ScanLevel & current_level( void )
+{
+    static ScanLevel level = best_scan_level();
+    return level;
+}
+
+bool set_scan_level( const ScanLevel level )
+{
+    if ( not cpu_has( level ) ) {
+        return false;
+    }
+
+    current_level() = level;
+    return true;
+}
+
+ScanLevel scan_level( void )
+{
+    return current_level();
+}
+
+string scan_level_name( const ScanLevel level )
+{
+    switch ( level ) {
+    case ScanLevel::SCALAR: return "scalar";
+    case ScanLevel::SSE2: return "sse2";
+    case ScanLevel::AVX2: return "avx2";
+    }
+
+    return "unknown";
+}
+
+size_t scan_lines( const boost::string_ref & str, const size_t from, vector< size_t > & line_ends )
+{
+    switch ( current_level() ) {
+#ifdef LINE_SCANNER_X86
+#ifdef __SSE2__
+    case ScanLevel::SSE2:
+        return scan_lines_sse2( str.data(), str.size(), from, line_ends );
+#endif
+    case ScanLevel::AVX2:
+        return scan_lines_avx2( str.data(), str.size(), from, line_ends );
+#endif
+    default:
+        return scan_lines_scalar( str.data(), str.size(), from, line_ends );
+    }
+}
@@ -0,0 +1,33 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef LINE_SCANNER_HH
+#define LINE_SCANNER_HH
+
+#include <string>
+#include <vector>
+#include <boost/utility/string_ref.hpp>
+
+/* finds the CRLFs that end the lines of an HTTP message's first line and
+   headers, a block of 32 (AVX2) or 16 (SSE2) bytes at a time where the
+   CPU can, and with memchr() otherwise. Each block is compared against
+   CR, and the same block one byte on against LF, so a CRLF costs the same
+   to find as any other pair of bytes, and a CR without an LF costs nothing. */
+
+enum class ScanLevel { SCALAR, SSE2, AVX2 };
+
+/* append the position of each CRLF in str, from "from" on, to line_ends,
+   stopping after one that ends an empty line (so after the headers, and
+   before any body). Returns where to resume once more has been appended. */
+size_t scan_lines( const boost::string_ref & str, const size_t from, std::vector< size_t > & line_ends );
+
+/* the best this CPU can do */
+ScanLevel best_scan_level( void );
+
+/* for benchmarks and tests: scan with a particular level, if the CPU
+   has it (false otherwise). Not thread-safe, so call before parsing. */
+bool set_scan_level( const ScanLevel level );
+ScanLevel scan_level( void );
+
+std::string scan_level_name( const ScanLevel level );
+
+#endif /* LINE_SCANNER_HH */
@@ -0,0 +1,245 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "record_scan.hh"
+#include "http_request.hh"
+#include "exception.hh"
+
+using namespace std;
+
+namespace {
+
+/* random access to a file through a small buffer */
+class WireReader
+{
+private:
+    const int fd_;
+    uint64_t size_;
+
+    std::string window_;
+    uint64_t window_start_;
+
+    static const size_t WINDOW_SIZE = 16384;
+
+public:
+    WireReader( const FileDescriptor & file )
+        : fd_( file.fd_num() ), size_(), window_(), window_start_()
+    {
+        struct stat info;
+        SystemCall( "fstat", fstat( fd_, &info ) );
+        size_ = info.st_size;
+    }
+
+    uint64_t size( void ) const { return size_; }
+
+    /* bytes [pos, pos + length), which must lie within the file */
+    std::string bytes( const uint64_t pos, const uint64_t length )
+    {
+        if ( length > WINDOW_SIZE ) {
+            return read( pos, length );
+        }
+
+        fill( pos, length );
+        return window_.substr( pos - window_start_, length );
+    }
+
+    uint8_t byte( const uint64_t pos )
+    {
+        fill( pos, 1 );
+        return window_[ pos - window_start_ ];
+    }
+
+    /* make sure the window covers [pos, pos + length) */
+    void fill( const uint64_t pos, const uint64_t length )
+    {
+        if ( pos < window_start_ or pos + length > window_start_ + window_.size() ) {
+            window_ = read( pos, max( length, min( uint64_t( WINDOW_SIZE ), size_ - pos ) ) );
+            window_start_ = pos;
+        }
+    }
+
+    std::string read( const uint64_t pos, const uint64_t length ) const
+    {
+        std::string buffer( length, 0 );
+        size_t done = 0;
+        while ( done < length ) {
+            const ssize_t bytes_read = SystemCall( "pread", pread( fd_, &buffer[ done ], length - done, pos + done ) );
+            if ( bytes_read == 0 ) {
+                throw runtime_error( "record file shrank while being indexed" );
+            }
+            done += bytes_read;
+        }
+        return buffer;
+    }
+
+    bool varint( uint64_t & pos, const uint64_t end, uint64_t & value )
+    {
+        value = 0;
+        for ( unsigned int shift = 0; shift < 64 and pos < end; shift += 7 ) {
+            const uint8_t byte = this->byte( pos++ );
+            value |= uint64_t( byte & 0x7f ) << shift;
+            if ( not ( byte & 0x80 ) ) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+};
+
+struct WireField
+{
+    uint64_t number, wire_type;
+    uint64_t begin;       /* start of tag */
+    uint64_t value_begin; /* contents, for a length-delimited field */
+    uint64_t end;
+};
+
+/* list the fields of a serialized message occupying [begin, end), without reading their contents */
+bool wire_fields( WireReader & reader, const uint64_t begin, const uint64_t end, vector< WireField > & fields )
+{
+    uint64_t pos = begin;
+
+    while ( pos < end ) {
+        WireField field;
+        field.begin = pos;
+
+        uint64_t tag, value, length = 0;
+        if ( not reader.varint( pos, end, tag ) ) {
+            return false;
+        }
+        field.number = tag >> 3;
+        field.wire_type = tag & 7;
+
+        switch ( field.wire_type ) {
+        case 0: /* varint */
+            if ( not reader.varint( pos, end, value ) ) {
+                return false;
+            }
+            break;
+        case 1: /* 64-bit */
+            length = 8;
+            break;
+        case 2: /* length-delimited */
+            if ( not reader.varint( pos, end, length ) ) {
+                return false;
+            }
+            break;
+        case 5: /* 32-bit */
+            length = 4;
+            break;
+        default: /* groups are never used here */
+            return false;
+        }
+
+        if ( length > end - pos ) {
+            return false;
+        }
+
+        field.value_begin = pos;
+        pos += length;
+        field.end = pos;
+
+        fields.push_back( field );
+    }
+
+    return true;
+}
+
+/* an HTTPMessage without its body, and where each body field lies */
+bool scan_message( WireReader & reader, const WireField & message,
+                   MahimahiProtobufs::HTTPMessage & head, vector< WireField > & bodies )
+{
+    vector< WireField > fields;
+    if ( message.wire_type != 2
+         or not wire_fields( reader, message.value_begin, message.end, fields ) ) {
+        return false;
+    }
+
+    /* parsing the other fields as one message gives what a full parse would */
+    string kept;
+    for ( const auto & field : fields ) {
+        if ( field.number == 3 ) { /* HTTPMessage.body */
+            if ( field.wire_type != 2 ) {
+                return false;
+            }
+            bodies.push_back( field );
+        } else {
+            kept.append( reader.bytes( field.begin, field.end - field.begin ) );
+        }
+    }
+
+    MahimahiProtobufs::HTTPMessage part;
+    if ( not part.ParseFromString( kept ) ) {
+        return false;
+    }
+    head.MergeFrom( part );
+
+    return true;
+}
+
+}
+
+bool scan_record( const FileDescriptor & file, MahimahiProtobufs::ReplayIndexEntry & entry )
+{
+    WireReader reader( file );
+
+    vector< WireField > fields;
+    if ( not wire_fields( reader, 0, reader.size(), fields ) ) {
+        return false;
+    }
+
+    /* ip, port and scheme are small; keep them and decode them together */
+    string kept;
+    MahimahiProtobufs::HTTPMessage request_head, response_head;
+    vector< WireField > request_bodies, response_bodies;
+    unsigned int response_count = 0;
+
+    for ( const auto & field : fields ) {
+        if ( field.number == 4 ) { /* RequestResponse.request */
+            if ( not scan_message( reader, field, request_head, request_bodies ) ) {
+                return false;
+            }
+        } else if ( field.number == 5 ) { /* RequestResponse.response */
+            response_count++;
+            if ( not scan_message( reader, field, response_head, response_bodies ) ) {
+                return false;
+            }
+        } else {
+            kept.append( reader.bytes( field.begin, field.end - field.begin ) );
+        }
+    }
+
+    MahimahiProtobufs::RequestResponse record;
+    if ( not record.ParseFromString( kept ) ) {
+        return false;
+    }
+
+    const HTTPRequest request( request_head );
+
+    entry.set_ip( record.ip() );
+    entry.set_port( record.port() );
+    entry.set_scheme( record.scheme() );
+    if ( request.has_header( "Host" ) ) {
+        entry.set_host( request.get_header_value( "Host" ) );
+    }
+    entry.set_first_line( request.first_line() );
+
+    /* the body can only be sent in place if a full parse would find exactly this one */
+    if ( response_count == 1 and response_bodies.size() == 1 ) {
+        entry.mutable_response_head()->CopyFrom( response_head );
+        entry.set_body_offset( response_bodies.front().value_begin );
+        entry.set_body_length( response_bodies.front().end - response_bodies.front().value_begin );
+    } else if ( response_count == 1 and response_bodies.empty() and response_head.has_body_digest() ) {
+        entry.set_body_digest( response_head.body_digest() );
+        response_head.clear_body_digest();
+        entry.mutable_response_head()->CopyFrom( response_head );
+    }
+
+    return true;
+}
@@ -0,0 +1,17 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef RECORD_SCAN_HH
+#define RECORD_SCAN_HH
+
+#include "file_descriptor.hh"
+#include "http_record.pb.h"
+
+/* Fill in the replay index fields for one saved request/response file
+   (everything but the filename) by walking the protobuf wire format,
+   reading the file only around the fields the index needs. Request and
+   response bodies are skipped over, not read, so the cost doesn't grow
+   with body size. Returns false if the record isn't encoded the usual
+   way, in which case the caller should parse it in full. */
+bool scan_record( const FileDescriptor & file, MahimahiProtobufs::ReplayIndexEntry & entry );
+
+#endif /* RECORD_SCAN_HH */
@@ -0,0 +1,389 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <limits>
+#include <cstring>
+
+#include "recording_archive.hh"
+#include "replay_index.hh"
+#include "temp_file.hh"
+#include "exception.hh"
+#include "util.hh"
+
+using namespace std;
+
+static const char archive_magic[ 8 ] = { 'M', 'M', 'W', 'E', 'B', 'A', 'R', 'C' };
+static const uint32_t archive_byte_order = 0x01020304;
+
+static_assert( sizeof( RecordingArchiveHeader ) == 64, "unexpected archive header layout" );
+static_assert( sizeof( RecordingArchiveEntry ) == 80, "unexpected archive entry layout" );
+
+/* 64-bit FNV-1a */
+static uint64_t bucket_hash( const string & key )
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for ( const unsigned char ch : key ) {
+        hash ^= ch;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+template <typename T>
+static void append_raw( string & out, const T & x )
+{
+    out.append( reinterpret_cast<const char *>( &x ), sizeof( x ) );
+}
+
+/* add a string to the table and return its offset */
+static uint32_t add_string( string & strings, const string & str )
+{
+    if ( strings.size() + str.size() > numeric_limits<uint32_t>::max() ) {
+        throw runtime_error( "RecordingArchive: string table too large" );
+    }
+
+    const uint32_t offset = strings.size();
+    strings.append( str );
+    return offset;
+}
+
+void RecordingArchive::pack( const string & directory, const string & archive_filename )
+{
+    /* first pass: index every record (without reading bodies) */
+    const ReplayIndex index( directory );
+
+    if ( uint64_t( index.entries().size() ) > numeric_limits<uint32_t>::max() ) {
+        throw runtime_error( directory + ": too many saved request/response pairs" );
+    }
+
+    vector< RecordingArchiveEntry > entries;
+    vector< string > files;
+    vector< uint64_t > lengths;
+    string strings;
+    uint64_t records_length = 0;
+
+    /* bodies from the body store go in once each, right after the first record to use them */
+    vector< string > body_files;
+    map< string, uint64_t > body_offsets;
+
+    for ( uint32_t position = 0; position < uint32_t( index.entries().size() ); position++ ) {
+        const MahimahiProtobufs::ReplayIndexEntry & indexed = index.entries().Get( position );
+
+        files.push_back( directory + indexed.filename() );
+        struct stat info;
+        SystemCall( "stat " + files.back(), stat( files.back().c_str(), &info ) );
+
+        RecordingArchiveEntry entry;
+        zero( entry );
+        entry.bucket_hash = bucket_hash( ReplayIndex::bucket_key( indexed.scheme() == MahimahiProtobufs::RequestResponse_Scheme_HTTPS,
+                                                                  indexed.has_host(), indexed.host(),
+                                                                  indexed.first_line() ) );
+        entry.record_offset = records_length; /* relative for now */
+        entry.record_length = info.st_size;
+        entry.position = position;
+        entry.first_line_offset = add_string( strings, indexed.first_line() );
+        entry.first_line_length = indexed.first_line().size();
+        entry.host_offset = add_string( strings, indexed.host() );
+        entry.host_length = indexed.host().size();
+        entry.ip_offset = add_string( strings, indexed.ip() );
+        entry.ip_length = indexed.ip().size();
+
+        if ( indexed.has_body_offset() ) {
+            const string serialized_head = indexed.response_head().SerializeAsString();
+
+            entry.body_offset = records_length + indexed.body_offset(); /* relative for now */
+            entry.body_length = indexed.body_length();
+            entry.response_head_offset = add_string( strings, serialized_head );
+            entry.response_head_length = serialized_head.size();
+            entry.flags |= RecordingArchiveEntry::HAS_BODY_LOCATION;
+        }
+        entry.port = indexed.port();
+        entry.scheme = indexed.scheme();
+        entry.flags |= indexed.has_host() ? RecordingArchiveEntry::HAS_HOST : 0;
+
+        lengths.push_back( info.st_size );
+        records_length += info.st_size;
+        body_files.emplace_back();
+
+        if ( indexed.has_body_digest() ) {
+            const string serialized_head = indexed.response_head().SerializeAsString();
+            const string body_file = body_store_file( directory, indexed.body_digest() );
+            SystemCall( "stat " + body_file, stat( body_file.c_str(), &info ) );
+
+            auto stored = body_offsets.find( indexed.body_digest() );
+            if ( stored == body_offsets.end() ) {
+                stored = body_offsets.emplace( indexed.body_digest(), records_length ).first;
+                body_files.back() = body_file;
+                lengths.push_back( info.st_size );
+                records_length += info.st_size;
+            }
+
+            entry.body_offset = stored->second; /* relative for now */
+            entry.body_length = info.st_size;
+            entry.response_head_offset = add_string( strings, serialized_head );
+            entry.response_head_length = serialized_head.size();
+            entry.flags |= RecordingArchiveEntry::HAS_BODY_LOCATION;
+        }
+
+        entries.push_back( entry );
+    }
+
+    /* lookups binary-search on the bucket hash; within a bucket, keep directory order */
+    sort( entries.begin(), entries.end(),
+          [] ( const RecordingArchiveEntry & a, const RecordingArchiveEntry & b ) {
+              return a.bucket_hash < b.bucket_hash
+                  or ( a.bucket_hash == b.bucket_hash and a.position < b.position ); } );
+
+    RecordingArchiveHeader header;
+    zero( header );
+    memcpy( header.magic, archive_magic, sizeof( header.magic ) );
+    header.version = VERSION;
+    header.byte_order = archive_byte_order;
+    header.entry_count = entries.size();
+    header.entries_offset = sizeof( header );
+    header.strings_offset = header.entries_offset + entries.size() * sizeof( RecordingArchiveEntry );
+    header.strings_length = strings.size();
+    header.records_offset = header.strings_offset + strings.size();
+    header.records_length = records_length;
+
+    string preamble;
+    append_raw( preamble, header );
+    for ( auto & entry : entries ) {
+        entry.record_offset += header.records_offset;
+        if ( entry.flags & RecordingArchiveEntry::HAS_BODY_LOCATION ) {
+            entry.body_offset += header.records_offset;
+        }
+        append_raw( preamble, entry );
+    }
+    preamble.append( strings );
+
+    /* second pass: copy the records in directory order, then move the archive into place */
+    UniqueFile archive( archive_filename );
+    try {
+        archive.write( preamble );
+
+        auto length = lengths.cbegin();
+        for ( size_t position = 0; position < files.size(); position++ ) {
+            for ( const auto & filename : { files.at( position ), body_files.at( position ) } ) {
+                if ( filename.empty() ) {
+                    continue;
+                }
+
+                const string contents = read_record_file( filename );
+                if ( contents.size() != *length++ ) {
+                    throw runtime_error( filename + ": changed while packing" );
+                }
+                archive.write( contents );
+            }
+        }
+
+        SystemCall( "fsync", fsync( archive.fd().fd_num() ) );
+        SystemCall( "rename " + archive_filename,
+                    rename( archive.name().c_str(), archive_filename.c_str() ) );
+    } catch ( ... ) {
+        unlink( archive.name().c_str() );
+        throw;
+    }
+}
+
+bool RecordingArchive::is_archive( const string & path )
+{
+    struct stat info;
+    SystemCall( "stat " + path, stat( path.c_str(), &info ) );
+    return S_ISREG( info.st_mode );
+}
+
+RecordingArchive::RecordingArchive( const string & filename )
+    : fd_( SystemCall( "open " + filename, open( filename.c_str(), O_RDONLY ) ) ),
+      length_(),
+      base_()
+{
+    struct stat info;
+    SystemCall( "fstat " + filename, fstat( fd_.fd_num(), &info ) );
+    length_ = info.st_size;
+
+    if ( length_ < sizeof( RecordingArchiveHeader ) ) {
+        throw runtime_error( filename + ": not a recording archive" );
+    }
+
+    void * base = mmap( nullptr, length_, PROT_READ, MAP_SHARED, fd_.fd_num(), 0 );
+    if ( base == MAP_FAILED ) {
+        throw unix_error( "mmap " + filename );
+    }
+    base_ = static_cast<const char *>( base );
+
+    try {
+        if ( memcmp( header().magic, archive_magic, sizeof( archive_magic ) ) ) {
+            throw runtime_error( filename + ": not a recording archive" );
+        }
+
+        if ( header().byte_order != archive_byte_order ) {
+            throw runtime_error( filename + ": recording archive has wrong byte order" );
+        }
+
+        if ( header().version != VERSION ) {
+            throw runtime_error( filename + ": unsupported recording archive version "
+                                 + to_string( header().version ) );
+        }
+
+        if ( header().entry_count > length_ / sizeof( RecordingArchiveEntry ) ) {
+            throw runtime_error( filename + ": recording archive is truncated" );
+        }
+        check_bounds( header().entries_offset, header().entry_count * sizeof( RecordingArchiveEntry ), "index" );
+        check_bounds( header().strings_offset, header().strings_length, "string table" );
+        check_bounds( header().records_offset, header().records_length, "records" );
+
+        if ( header().entries_offset % alignof( RecordingArchiveEntry ) ) {
+            throw runtime_error( filename + ": misaligned recording archive index" );
+        }
+    } catch ( ... ) {
+        munmap( const_cast<char *>( base_ ), length_ );
+        throw;
+    }
+}
+
+RecordingArchive::~RecordingArchive()
+{
+    if ( munmap( const_cast<char *>( base_ ), length_ ) < 0 ) {
+        print_exception( unix_error( "munmap" ) );
+    }
+}
+
+void RecordingArchive::check_bounds( const uint64_t offset, const uint64_t length, const string & what ) const
+{
+    if ( offset > length_ or length > length_ - offset ) {
+        throw runtime_error( "RecordingArchive: " + what + " extends past end of archive" );
+    }
+}
+
+string RecordingArchive::table_string( const uint32_t offset, const uint32_t length ) const
+{
+    if ( uint64_t( offset ) + length > header().strings_length ) {
+        throw runtime_error( "RecordingArchive: string extends past end of string table" );
+    }
+
+    return string( base_ + header().strings_offset + offset, length );
+}
+
+const RecordingArchiveEntry & RecordingArchive::entry( const uint64_t i ) const
+{
+    if ( i >= size() ) {
+        throw out_of_range( "RecordingArchive: no entry " + to_string( i ) );
+    }
+
+    return reinterpret_cast<const RecordingArchiveEntry *>( base_ + header().entries_offset )[ i ];
+}
+
+string RecordingArchive::first_line( const RecordingArchiveEntry & entry ) const
+{
+    return table_string( entry.first_line_offset, entry.first_line_length );
+}
+
+string RecordingArchive::host( const RecordingArchiveEntry & entry ) const
+{
+    return table_string( entry.host_offset, entry.host_length );
+}
+
+string RecordingArchive::ip( const RecordingArchiveEntry & entry ) const
+{
+    return table_string( entry.ip_offset, entry.ip_length );
+}
+
+MahimahiProtobufs::HTTPMessage RecordingArchive::response_head( const RecordingArchiveEntry & entry ) const
+{
+    MahimahiProtobufs::HTTPMessage ret;
+    if ( not ret.ParseFromString( table_string( entry.response_head_offset, entry.response_head_length ) ) ) {
+        throw runtime_error( "RecordingArchive: invalid response headers in record "
+                             + to_string( entry.position ) );
+    }
+
+    if ( entry.flags & RecordingArchiveEntry::HAS_BODY_LOCATION ) {
+        check_bounds( entry.body_offset, entry.body_length, "response body" );
+    }
+
+    return ret;
+}
+
+const RecordingArchiveEntry * RecordingArchive::best_match( const bool is_https,
+                                                            const bool has_host, const string & host,
+                                                            const string & request_line ) const
+{
+    const uint64_t hash = bucket_hash( ReplayIndex::bucket_key( is_https, has_host, host, request_line ) );
+    const uint8_t scheme = is_https ? MahimahiProtobufs::RequestResponse_Scheme_HTTPS
+                                    : MahimahiProtobufs::RequestResponse_Scheme_HTTP;
+    const string stripped_request_line = strip_query( request_line );
+
+    const RecordingArchiveEntry * const first = reinterpret_cast<const RecordingArchiveEntry *>( base_ + header().entries_offset );
+    const RecordingArchiveEntry * const last = first + size();
+
+    /* entries sharing the hash are in directory order, so the first of equal scores wins */
+    size_t best_score = 0;
+    const RecordingArchiveEntry * best = nullptr;
+
+    for ( auto candidate = lower_bound( first, last, hash,
+                                        [] ( const RecordingArchiveEntry & e, const uint64_t h ) {
+                                            return e.bucket_hash < h; } );
+          candidate != last and candidate->bucket_hash == hash;
+          candidate++ ) {
+        /* rule out hash collisions */
+        if ( candidate->scheme != scheme
+             or bool( candidate->flags & RecordingArchiveEntry::HAS_HOST ) != has_host
+             or ( has_host and this->host( *candidate ) != host ) ) {
+            continue;
+        }
+
+        const string candidate_line = first_line( *candidate );
+        if ( strip_query( candidate_line ) != stripped_request_line ) {
+            continue;
+        }
+
+        const size_t score = common_prefix( request_line, candidate_line );
+        if ( score > best_score ) {
+            best = candidate;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
+MahimahiProtobufs::RequestResponse RecordingArchive::record( const RecordingArchiveEntry & entry ) const
+{
+    check_bounds( entry.record_offset, entry.record_length, "record" );
+
+    MahimahiProtobufs::RequestResponse ret;
+    if ( entry.record_length > uint64_t( numeric_limits<int>::max() )
+         or not ret.ParseFromArray( base_ + entry.record_offset, entry.record_length ) ) {
+        throw runtime_error( "RecordingArchive: invalid HTTP request/response in record "
+                             + to_string( entry.position ) );
+    }
+
+    /* a body from the body store was packed on its own */
+    if ( ret.response().has_body_digest() and (entry.flags & RecordingArchiveEntry::HAS_BODY_LOCATION) ) {
+        check_bounds( entry.body_offset, entry.body_length, "response body" );
+        ret.mutable_response()->set_body( base_ + entry.body_offset, entry.body_length );
+        ret.mutable_response()->clear_body_digest();
+    }
+
+    return ret;
+}
+
+ReplayResponse RecordingArchive::response( const shared_ptr< const RecordingArchive > & archive,
+                                           const RecordingArchiveEntry & entry )
+{
+    if ( entry.flags & RecordingArchiveEntry::HAS_BODY_LOCATION ) {
+        return ReplayResponse( archive->response_head( entry ),
+                               shared_ptr< const FileDescriptor >( archive, &archive->fd() ),
+                               entry.body_offset, entry.body_length );
+    }
+
+    return ReplayResponse( archive->record( entry ).response() );
+}
@@ -0,0 +1,125 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef RECORDING_ARCHIVE_HH
+#define RECORDING_ARCHIVE_HH
+
+#include <string>
+#include <cstdint>
+#include <memory>
+
+#include "file_descriptor.hh"
+#include "http_record.pb.h"
+#include "replay_index.hh"
+
+/* A whole recording packed into one file that can be mmap()ed:
+
+     header | fixed-size index entries | string table | records
+
+   Records are the saved RequestResponse protobufs, byte for byte, laid
+   out contiguously in directory order. A body the recording kept in its
+   body store follows the first record that refers to it, and is shared
+   by every later one with the same digest. Each entry also gives the
+   response's headers (as a body-less HTTPMessage in the string table)
+   and where its body lies in the file, so the body can be sent with
+   sendfile() without parsing the record. Index entries are sorted by the
+   hash of their lookup bucket (scheme, Host, request line up to "?"),
+   then by directory order, so a lookup is a binary search that never
+   parses a protobuf. All integers are in host byte order; byte_order
+   catches an archive carried to a host of the other endianness. */
+
+struct RecordingArchiveHeader
+{
+    char magic[ 8 ];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t entry_count;
+    uint64_t entries_offset;
+    uint64_t strings_offset;
+    uint64_t strings_length;
+    uint64_t records_offset;
+    uint64_t records_length;
+};
+
+struct RecordingArchiveEntry
+{
+    uint64_t bucket_hash;
+    uint64_t record_offset;     /* from start of file */
+    uint64_t record_length;
+    uint64_t body_offset;       /* response body, from start of file */
+    uint64_t body_length;
+    uint32_t position;          /* order in the original directory */
+    uint32_t first_line_offset; /* strings are offsets into the string table */
+    uint32_t first_line_length;
+    uint32_t host_offset;
+    uint32_t host_length;
+    uint32_t ip_offset;
+    uint32_t ip_length;
+    uint32_t response_head_offset;
+    uint32_t response_head_length;
+    uint16_t port;
+    uint8_t scheme;
+    uint8_t flags;
+
+    static const uint8_t HAS_HOST = 1;
+    static const uint8_t HAS_BODY_LOCATION = 2; /* body_offset and response head are valid */
+};
+
+class RecordingArchive
+{
+private:
+    FileDescriptor fd_;
+    size_t length_;
+    const char * base_;
+
+    const RecordingArchiveHeader & header( void ) const
+    {
+        return *reinterpret_cast<const RecordingArchiveHeader *>( base_ );
+    }
+
+    void check_bounds( const uint64_t offset, const uint64_t length, const std::string & what ) const;
+    std::string table_string( const uint32_t offset, const uint32_t length ) const;
+
+public:
+    static const uint32_t VERSION = 2;
+
+    /* mmap an existing archive */
+    RecordingArchive( const std::string & filename );
+    ~RecordingArchive();
+
+    /* is this path an archive (a regular file) rather than a recording directory? */
+    static bool is_archive( const std::string & path );
+
+    /* pack a recording directory (ending with '/') into a new archive file */
+    static void pack( const std::string & directory, const std::string & archive_filename );
+
+    uint64_t size( void ) const { return header().entry_count; }
+    const RecordingArchiveEntry & entry( const uint64_t i ) const;
+
+    std::string first_line( const RecordingArchiveEntry & entry ) const;
+    std::string host( const RecordingArchiveEntry & entry ) const;
+    std::string ip( const RecordingArchiveEntry & entry ) const;
+    MahimahiProtobufs::HTTPMessage response_head( const RecordingArchiveEntry & entry ) const;
+
+    /* for sending bodies straight from the archive */
+    const FileDescriptor & fd( void ) const { return fd_; }
+
+    /* best-matching entry for an incoming request, scored like ReplayIndex::best_match(),
+       or nullptr if none */
+    const RecordingArchiveEntry * best_match( const bool is_https,
+                                              const bool has_host, const std::string & host,
+                                              const std::string & request_line ) const;
+
+    /* parse the saved request/response pair for an entry */
+    MahimahiProtobufs::RequestResponse record( const RecordingArchiveEntry & entry ) const;
+
+    /* the saved response for an entry, with its body left in the archive;
+       the response keeps the archive open */
+    static ReplayResponse response( const std::shared_ptr< const RecordingArchive > & archive,
+                                    const RecordingArchiveEntry & entry );
+
+    /* ban copying */
+    RecordingArchive( const RecordingArchive & other ) = delete;
+    RecordingArchive & operator=( const RecordingArchive & other ) = delete;
+};
+
+#endif /* RECORDING_ARCHIVE_HH */
@@ -0,0 +1,538 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
+
+#include "replay_index.hh"
+#include "recording_archive.hh"
+#include "record_scan.hh"
+#include "body_rewriter.hh"
+#include "http_request.hh"
+#include "file_descriptor.hh"
+#include "exception.hh"
+#include "util.hh"
+
+using namespace std;
+
+string strip_query( const string & request_line )
+{
+    const auto index = request_line.find( "?" );
+    if ( index == string::npos ) {
+        return request_line;
+    } else {
+        return request_line.substr( 0, index );
+    }
+}
+
+string not_found_reply( void )
+{
+    const string response_body = "replayserver: could not find a match.";
+
+    return "HTTP/1.1 404 Not Found" + CRLF
+        + "Content-Type: text/plain" + CRLF
+        + "Content-Length: " + to_string( response_body.length() ) + CRLF
+        + "Cache-Control: max-age=60" + CRLF + CRLF
+        + response_body;
+}
+
+string read_record_file( const string & filename )
+{
+    FileDescriptor fd( SystemCall( "open " + filename, open( filename.c_str(), O_RDONLY ) ) );
+
+    string contents;
+    while ( not fd.eof() ) {
+        contents.append( fd.read() );
+    }
+
+    return contents;
+}
+
+const string BODY_STORE_NAME = ".bodies";
+const string RECORD_INDEX_NAME = ".index";
+
+string body_store_file( const string & recording_directory, const string & digest )
+{
+    /* the digest comes from a record, so make sure it can only name a file in the store */
+    if ( digest.size() != 64
+         or digest.find_first_not_of( "0123456789abcdef" ) != string::npos ) {
+        throw runtime_error( "invalid body digest \"" + digest + "\"" );
+    }
+
+    return recording_directory + BODY_STORE_NAME + "/" + digest;
+}
+
+ReplayResponse::ReplayResponse( const MahimahiProtobufs::HTTPMessage & head,
+                                const shared_ptr< const FileDescriptor > & file,
+                                const uint64_t body_offset, const uint64_t body_length )
+    : head_( head ),
+      head_string_( head_.str() ),
+      file_( file ),
+      body_offset_( body_offset ),
+      body_length_( body_length ),
+      body_()
+{}
+
+static MahimahiProtobufs::HTTPMessage without_body( const MahimahiProtobufs::HTTPMessage & message )
+{
+    MahimahiProtobufs::HTTPMessage ret = message;
+    ret.clear_body();
+    return ret;
+}
+
+ReplayResponse::ReplayResponse( const MahimahiProtobufs::HTTPMessage & response )
+    : head_( without_body( response ) ),
+      head_string_( head_.str() ),
+      file_(),
+      body_offset_(),
+      body_length_(),
+      body_( response.body() )
+{}
+
+string ReplayResponse::body( void ) const
+{
+    if ( not file_ ) {
+        return body_;
+    }
+
+    string ret( body_length_, 0 );
+    size_t done = 0;
+    while ( done < body_length_ ) {
+        const ssize_t bytes_read = SystemCall( "pread", pread( file_->fd_num(), &ret[ done ],
+                                                               body_length_ - done, body_offset_ + done ) );
+        if ( bytes_read == 0 ) {
+            throw runtime_error( "ReplayResponse: recording ended in middle of body" );
+        }
+        done += bytes_read;
+    }
+
+    return ret;
+}
+
+void ReplayResponse::write_to( FileDescriptor & out ) const
+{
+    if ( not file_ ) {
+        return out.writev( head_string_, body_ );
+    }
+
+    out.write( head_string_ );
+    out.sendfile( *file_, body_offset_, body_length_ );
+}
+
+uint64_t ReplayResponse::size( void ) const
+{
+    return head_string_.size() + (file_ ? body_length_ : body_.size());
+}
+
+void ReplayResponse::rewrite_body( BodyRewriter & rewriter )
+{
+    /* a chunked body can't simply be prefixed, and HEAD or 304 replies have none */
+    if ( not head_.is_html() or not head_.has_header( "Content-Length" )
+         or head_.has_header( "Transfer-Encoding" ) or size() == head_string_.size() ) {
+        return;
+    }
+
+    string new_body = body();
+    if ( not rewriter.rewrite( head_.content_encoding(), new_body ) ) {
+        return;
+    }
+
+    head_.update_header( "Content-Length", to_string( new_body.size() ) );
+    head_string_ = head_.str();
+    file_.reset();
+    body_ = move( new_body );
+}
+
+uint64_t ReplayResponse::write_some( FileDescriptor & out, const uint64_t sent ) const
+{
+    if ( sent < head_string_.size() ) {
+        return out.write( head_string_.cbegin() + sent, head_string_.cend() ) - head_string_.cbegin();
+    }
+
+    const uint64_t body_sent = sent - head_string_.size();
+
+    if ( not file_ ) {
+        if ( body_sent == body_.size() ) {
+            return sent;
+        }
+        return head_string_.size() + (out.write( body_.cbegin() + body_sent, body_.cend() ) - body_.cbegin());
+    }
+
+    if ( body_sent == body_length_ ) {
+        return sent;
+    }
+
+    off_t position = body_offset_ + body_sent;
+    const ssize_t bytes_sent = ::sendfile( out.fd_num(), file_->fd_num(), &position, body_length_ - body_sent );
+    if ( bytes_sent < 0 and (errno == EAGAIN or errno == EWOULDBLOCK) ) { /* not ready */
+        return sent;
+    }
+    if ( SystemCall( "sendfile", bytes_sent ) == 0 ) {
+        throw runtime_error( "ReplayResponse: recording ended in middle of body" );
+    }
+
+    return sent + bytes_sent;
+}
+
+static MahimahiProtobufs::RequestResponse read_record( const string & recording_directory,
+                                                       const string & filename )
+{
+    FileDescriptor fd( SystemCall( "open " + filename, open( filename.c_str(), O_RDONLY ) ) );
+
+    MahimahiProtobufs::RequestResponse record;
+    if ( not record.ParseFromFileDescriptor( fd.fd_num() ) ) {
+        throw runtime_error( filename + ": invalid HTTP request/response" );
+    }
+
+    /* put back a body saved in the body store */
+    if ( record.response().has_body_digest() ) {
+        MahimahiProtobufs::HTTPMessage & response = *record.mutable_response();
+        response.set_body( read_record_file( body_store_file( recording_directory, response.body_digest() ) ) );
+        response.clear_body_digest();
+    }
+
+    return record;
+}
+
+/* index fields from a full parse of a saved record */
+static void full_index_record( const string & filename, MahimahiProtobufs::ReplayIndexEntry & entry )
+{
+    MahimahiProtobufs::RequestResponse record;
+    if ( not record.ParseFromString( read_record_file( filename ) ) ) {
+        throw runtime_error( filename + ": invalid HTTP request/response" );
+    }
+    const HTTPRequest request( record.request() );
+
+    entry.set_ip( record.ip() );
+    entry.set_port( record.port() );
+    entry.set_scheme( record.scheme() );
+    if ( request.has_header( "Host" ) ) {
+        entry.set_host( request.get_header_value( "Host" ) );
+    }
+    entry.set_first_line( request.first_line() );
+}
+
+static uint64_t mtime_ns( const struct stat & info )
+{
+    return uint64_t( info.st_mtim.tv_sec ) * 1000000000 + info.st_mtim.tv_nsec;
+}
+
+/* does a record file still look as it did when this entry was made? */
+static bool record_unchanged( const string & filename, const MahimahiProtobufs::ReplayIndexEntry & entry )
+{
+    struct stat info;
+    if ( not entry.has_record_size() or not entry.has_record_mtime_ns()
+         or stat( filename.c_str(), &info ) < 0 ) {
+        return false;
+    }
+
+    return uint64_t( info.st_size ) == entry.record_size() and mtime_ns( info ) == entry.record_mtime_ns();
+}
+
+/* index fields for one saved record, reading as little of it as possible */
+MahimahiProtobufs::ReplayIndexEntry index_record( const string & filename )
+{
+    FileDescriptor fd( SystemCall( "open " + filename, open( filename.c_str(), O_RDONLY ) ) );
+
+    struct stat info;
+    SystemCall( "fstat " + filename, fstat( fd.fd_num(), &info ) );
+
+    MahimahiProtobufs::ReplayIndexEntry entry;
+    if ( not scan_record( fd, entry ) ) {
+        /* unusual encoding: parse it all, and always serve it from a full parse */
+        entry.Clear();
+        full_index_record( filename, entry );
+    }
+
+    entry.set_record_size( info.st_size );
+    entry.set_record_mtime_ns( mtime_ns( info ) );
+
+    return entry;
+}
+
+static bool read_varint( const string & data, size_t & pos, uint64_t & value )
+{
+    value = 0;
+    for ( unsigned int shift = 0; shift < 64 and pos < data.size(); shift += 7 ) {
+        const uint8_t byte = data[ pos++ ];
+        value |= uint64_t( byte & 0x7f ) << shift;
+        if ( not ( byte & 0x80 ) ) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* entries of the recorder's index, by filename. A crash can cut the last
+   append short, so read entry by entry and stop at the first bad one. */
+static unordered_map< string, MahimahiProtobufs::ReplayIndexEntry > read_record_index( const string & filename )
+{
+    unordered_map< string, MahimahiProtobufs::ReplayIndexEntry > ret;
+
+    if ( access( filename.c_str(), F_OK ) < 0 ) { /* recorded without one */
+        return ret;
+    }
+
+    const string data = read_record_file( filename );
+    size_t pos = 0;
+    while ( pos < data.size() ) {
+        uint64_t tag, length;
+        if ( not read_varint( data, pos, tag ) or tag != ((1 << 3) | 2) /* ReplayIndex.entry */
+             or not read_varint( data, pos, length ) or length > data.size() - pos ) {
+            break;
+        }
+
+        MahimahiProtobufs::ReplayIndexEntry entry;
+        if ( not entry.ParseFromArray( data.data() + pos, length ) or not entry.has_filename() ) {
+            break;
+        }
+        pos += length;
+
+        ret.emplace( entry.filename(), move( entry ) );
+    }
+
+    return ret;
+}
+
+/* directories are listed by prefixing their contents with the path */
+static string recording_path( const string & recording )
+{
+    if ( RecordingArchive::is_archive( recording ) or recording.empty() or recording.back() == '/' ) {
+        return recording;
+    }
+
+    return recording + "/";
+}
+
+ReplayIndex::ReplayIndex( const string & recording )
+    : recording_( recording_path( recording ) ),
+      archive_()
+{
+    if ( RecordingArchive::is_archive( recording_ ) ) {
+        archive_ = make_shared< RecordingArchive >( recording_ );
+
+        /* lay the entries out in directory order, as if the directory had been scanned */
+        for ( uint64_t i = 0; i < archive_->size(); i++ ) {
+            index_.add_entry();
+        }
+
+        for ( uint64_t i = 0; i < archive_->size(); i++ ) {
+            const RecordingArchiveEntry & archive_entry = archive_->entry( i );
+            if ( archive_entry.position >= archive_->size()
+                 or index_.entry( archive_entry.position ).has_archive_entry() ) {
+                throw runtime_error( recording_ + ": invalid position in archive index" );
+            }
+
+            MahimahiProtobufs::ReplayIndexEntry & entry = *index_.mutable_entry( archive_entry.position );
+            entry.set_archive_entry( i );
+            entry.set_ip( archive_->ip( archive_entry ) );
+            entry.set_port( archive_entry.port );
+            if ( MahimahiProtobufs::RequestResponse_Scheme_IsValid( archive_entry.scheme ) ) {
+                entry.set_scheme( MahimahiProtobufs::RequestResponse_Scheme( archive_entry.scheme ) );
+            }
+            if ( archive_entry.flags & RecordingArchiveEntry::HAS_HOST ) {
+                entry.set_host( archive_->host( archive_entry ) );
+            }
+            entry.set_first_line( archive_->first_line( archive_entry ) );
+        }
+
+        for ( int i = 0; i < index_.entry_size(); i++ ) {
+            add_to_bucket( i );
+        }
+
+        return;
+    }
+
+    /* records are everything but the body store and the recorder's index */
+    vector< string > files = list_directory_contents( recording_ );
+    files.erase( remove_if( files.begin(), files.end(),
+                            [&] ( const string & file ) { return file.compare( recording_.size(), 1, "." ) == 0; } ),
+                 files.end() );
+
+    /* the recorder's index covers every record it finished saving; a record
+       it lacks (e.g., from a crash between the two writes) is scanned, and
+       one whose file is gone is never looked up */
+    auto recorded = read_record_index( recording_ + RECORD_INDEX_NAME );
+    vector< MahimahiProtobufs::ReplayIndexEntry > entries( files.size() );
+    for ( size_t position = 0; position < files.size(); position++ ) {
+        const auto found = recorded.find( files.at( position ).substr( recording_.size() ) );
+        if ( found != recorded.end() ) {
+            entries.at( position ).Swap( &found->second );
+        }
+    }
+
+    /* across all cores, check that each indexed record is still the file the
+       recorder saved (its entry is scanned afresh if the file was rewritten,
+       or the entry predates this check) and scan the rest; then bucket them
+       all in directory order */
+    atomic< size_t > next_file( 0 );
+    mutex error_mutex;
+    exception_ptr error;
+
+    vector< thread > workers;
+    const size_t worker_count = min( files.size(), size_t( max( 1u, thread::hardware_concurrency() ) ) );
+    for ( size_t i = 0; i < worker_count; i++ ) {
+        workers.emplace_back( [&] () {
+                try {
+                    for ( size_t position; (position = next_file++) < files.size(); ) {
+                        if ( entries.at( position ).has_filename()
+                             and record_unchanged( files.at( position ), entries.at( position ) ) ) {
+                            continue;
+                        }
+                        entries.at( position ) = index_record( files.at( position ) );
+                        entries.at( position ).set_filename( files.at( position ).substr( recording_.size() ) );
+                    }
+                } catch ( ... ) {
+                    unique_lock<mutex> ul( error_mutex );
+                    if ( not error ) {
+                        error = current_exception();
+                    }
+                    next_file = files.size();
+                }
+            } );
+    }
+
+    for ( auto & worker : workers ) {
+        worker.join();
+    }
+
+    if ( error ) {
+        rethrow_exception( error );
+    }
+
+    for ( auto & entry : entries ) {
+        index_.add_entry()->Swap( &entry );
+        add_to_bucket( index_.entry_size() - 1 );
+    }
+}
+
+ReplayIndex::ReplayIndex( const string & recording, const string & index_filename )
+    : recording_( recording_path( recording ) ),
+      archive_()
+{
+    FileDescriptor fd( SystemCall( "open " + index_filename, open( index_filename.c_str(), O_RDONLY ) ) );
+    if ( not index_.ParseFromFileDescriptor( fd.fd_num() ) ) {
+        throw runtime_error( index_filename + ": invalid replay index" );
+    }
+
+    if ( RecordingArchive::is_archive( recording_ ) ) {
+        archive_ = make_shared< RecordingArchive >( recording_ );
+    }
+
+    for ( int i = 0; i < index_.entry_size(); i++ ) {
+        add_to_bucket( i );
+    }
+}
+
+void ReplayIndex::save( const int fd ) const
+{
+    if ( not index_.SerializeToFileDescriptor( fd ) ) {
+        throw runtime_error( "ReplayIndex: failure to serialize index" );
+    }
+}
+
+string ReplayIndex::bucket_key( const bool is_https,
+                                const bool has_host, const string & host,
+                                const string & request_line )
+{
+    string key( is_https ? "https " : "http " );
+    key.append( has_host ? host : string() );
+    key.push_back( has_host ? '\n' : '\0' );
+    key.append( strip_query( request_line ) );
+    return key;
+}
+
+void ReplayIndex::add_to_bucket( const int position )
+{
+    const auto & entry = index_.entry( position );
+
+    /* a record with neither scheme can never match a request */
+    if ( entry.scheme() != MahimahiProtobufs::RequestResponse_Scheme_HTTP
+         and entry.scheme() != MahimahiProtobufs::RequestResponse_Scheme_HTTPS ) {
+        return;
+    }
+
+    buckets_[ bucket_key( entry.scheme() == MahimahiProtobufs::RequestResponse_Scheme_HTTPS,
+                          entry.has_host(), entry.host(),
+                          entry.first_line() ) ].insert( entry.first_line(), position );
+}
+
+size_t common_prefix( const string & a, const string & b )
+{
+    return mismatch( a.begin(), a.begin() + min( a.size(), b.size() ), b.begin() ).first - a.begin();
+}
+
+int ReplayIndex::best_match_position( const bool is_https,
+                                      const bool has_host, const string & host,
+                                      const string & request_line ) const
+{
+    const auto bucket = buckets_.find( bucket_key( is_https, has_host, host, request_line ) );
+    if ( bucket == buckets_.end() ) {
+        return -1;
+    }
+
+    /* longest common prefix wins; ties go to the first record in directory order */
+    return bucket->second.best_match( request_line );
+}
+
+const MahimahiProtobufs::ReplayIndexEntry * ReplayIndex::best_match( const bool is_https,
+                                                                     const bool has_host, const string & host,
+                                                                     const string & request_line ) const
+{
+    const int position = best_match_position( is_https, has_host, host, request_line );
+    return position < 0 ? nullptr : &index_.entry( position );
+}
+
+MahimahiProtobufs::RequestResponse ReplayIndex::load( const MahimahiProtobufs::ReplayIndexEntry & entry ) const
+{
+    if ( archive_ ) {
+        return archive_->record( archive_->entry( entry.archive_entry() ) );
+    }
+
+    return read_record( recording_, recording_ + entry.filename() );
+}
+
+ReplayResponse ReplayIndex::response( const MahimahiProtobufs::ReplayIndexEntry & entry ) const
+{
+    ReplayResponse ret = stored_response( entry );
+    if ( rewriter_ ) {
+        ret.rewrite_body( *rewriter_ );
+    }
+    return ret;
+}
+
+ReplayResponse ReplayIndex::stored_response( const MahimahiProtobufs::ReplayIndexEntry & entry ) const
+{
+    if ( archive_ ) {
+        return RecordingArchive::response( archive_, archive_->entry( entry.archive_entry() ) );
+    }
+
+    if ( entry.has_body_offset() ) {
+        const string filename = recording_ + entry.filename();
+        return ReplayResponse( entry.response_head(),
+                               make_shared< FileDescriptor >( SystemCall( "open " + filename,
+                                                                          open( filename.c_str(), O_RDONLY ) ) ),
+                               entry.body_offset(), entry.body_length() );
+    }
+
+    if ( entry.has_body_digest() ) { /* the whole file is the body */
+        const string filename = body_store_file( recording_, entry.body_digest() );
+        auto file = make_shared< FileDescriptor >( SystemCall( "open " + filename,
+                                                               open( filename.c_str(), O_RDONLY ) ) );
+        struct stat info;
+        SystemCall( "fstat " + filename, fstat( file->fd_num(), &info ) );
+
+        return ReplayResponse( entry.response_head(), file, 0, info.st_size );
+    }
+
+    return ReplayResponse( load( entry ).response() );
+}
@@ -0,0 +1,162 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef REPLAY_INDEX_HH
+#define REPLAY_INDEX_HH
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+
+#include "http_record.pb.h"
+#include "http_response.hh"
+#include "file_descriptor.hh"
+#include "request_line_trie.hh"
+
+class RecordingArchive;
+class BodyRewriter;
+
+/* strip the query string from a request line */
+std::string strip_query( const std::string & request_line );
+
+/* size of common prefix between incoming and stored request lines */
+size_t common_prefix( const std::string & a, const std::string & b );
+
+/* reply given when no saved record matches a request */
+std::string not_found_reply( void );
+
+/* contents of a saved request/response file */
+std::string read_record_file( const std::string & filename );
+
+/* entry in a recording directory holding response bodies saved once each,
+   named by digest: a subdirectory, or a link to a store shared by recordings */
+extern const std::string BODY_STORE_NAME;
+
+/* file holding the body with this digest, in a recording directory's body store */
+std::string body_store_file( const std::string & recording_directory, const std::string & digest );
+
+/* file in a recording directory to which the recorder appends a serialized
+   ReplayIndex with one entry per saved record, as each is written */
+extern const std::string RECORD_INDEX_NAME;
+
+/* index fields (all but the filename) for one saved request/response file,
+   including its size and modification time as they stand now */
+MahimahiProtobufs::ReplayIndexEntry index_record( const std::string & filename );
+
+/* a saved response, ready to send. The body is normally left where it lies in
+   the recording, and goes from that file to the client inside the kernel. */
+class ReplayResponse
+{
+private:
+    HTTPResponse head_; /* status line and headers only */
+    std::string head_string_; /* ... as they go on the wire */
+
+    /* body in a file... */
+    std::shared_ptr< const FileDescriptor > file_;
+    uint64_t body_offset_, body_length_;
+
+    /* ...or in memory */
+    std::string body_;
+
+public:
+    ReplayResponse( const MahimahiProtobufs::HTTPMessage & head,
+                    const std::shared_ptr< const FileDescriptor > & file,
+                    const uint64_t body_offset, const uint64_t body_length );
+
+    ReplayResponse( const MahimahiProtobufs::HTTPMessage & response );
+
+    const HTTPResponse & head( void ) const { return head_; }
+
+    /* copy of the body, for writers that must see the bytes (e.g. TLS) */
+    std::string body( void ) const;
+
+    /* write the whole response to a socket or pipe */
+    void write_to( FileDescriptor & out ) const;
+
+    /* the whole response as it goes on the wire */
+    std::string str( void ) const { return head_string_ + body(); }
+
+    /* length of str(), without reading the body */
+    uint64_t size( void ) const;
+
+    /* for a non-blocking socket: write what it will take of the response,
+       starting sent bytes in, and return how much has now been sent */
+    uint64_t write_some( FileDescriptor & out, const uint64_t sent ) const;
+
+    /* inject the rewriter's script if this is an HTML page with a
+       Content-Length (the body is then sent from memory) */
+    void rewrite_body( BodyRewriter & rewriter );
+};
+
+/* lookup structure over a recorded session, built once per recording.
+   Saved request/response pairs are bucketed by scheme, Host header, and
+   request line up to the "?", and each bucket is a trie over the full
+   request lines, so a lookup takes time proportional to the request
+   line's length, and only the winner is read from disk.
+   The recording is either a directory or a packed RecordingArchive. */
+class ReplayIndex
+{
+private:
+    /* recording directory (ends with '/') or archive filename */
+    std::string recording_;
+
+    /* set if the recording is an archive, which holds the records */
+    std::shared_ptr< RecordingArchive > archive_;
+
+    MahimahiProtobufs::ReplayIndex index_ {};
+
+    /* bucket key -> request lines of positions in index_ */
+    std::unordered_map< std::string, RequestLineTrie > buckets_ {};
+
+    void add_to_bucket( const int position );
+
+    ReplayResponse stored_response( const MahimahiProtobufs::ReplayIndexEntry & entry ) const;
+
+    /* applied to each response served, if set */
+    std::shared_ptr< BodyRewriter > rewriter_ {};
+
+public:
+    /* index every saved request/response pair in the directory, taking
+       what the recorder's index has and scanning the rest (in parallel,
+       skipping bodies), or read the index of an archive */
+    ReplayIndex( const std::string & recording );
+
+    /* load an index previously written by save() */
+    ReplayIndex( const std::string & recording, const std::string & index_filename );
+
+    /* write the index so other processes don't have to rescan the directory */
+    void save( const int fd ) const;
+
+    const google::protobuf::RepeatedPtrField< MahimahiProtobufs::ReplayIndexEntry > & entries( void ) const
+    {
+        return index_.entry();
+    }
+
+    /* key shared by a request and every saved record that can match it */
+    static std::string bucket_key( const bool is_https,
+                                   const bool has_host, const std::string & host,
+                                   const std::string & request_line );
+
+    /* position in entries() of the best-matching saved record for an
+       incoming request, or -1 if none */
+    int best_match_position( const bool is_https,
+                             const bool has_host, const std::string & host,
+                             const std::string & request_line ) const;
+
+    /* best-matching saved record for an incoming request, or nullptr if none */
+    const MahimahiProtobufs::ReplayIndexEntry * best_match( const bool is_https,
+                                                            const bool has_host, const std::string & host,
+                                                            const std::string & request_line ) const;
+
+    /* read the full request/response pair for an entry */
+    MahimahiProtobufs::RequestResponse load( const MahimahiProtobufs::ReplayIndexEntry & entry ) const;
+
+    /* the saved response for an entry, without reading its body (unless it's rewritten) */
+    ReplayResponse response( const MahimahiProtobufs::ReplayIndexEntry & entry ) const;
+
+    /* rewrite HTML pages as response() serves them, for recordings saved
+       without rewriting (mm-webreplay --inject); call before serving */
+    void rewrite_html_with( const std::shared_ptr< BodyRewriter > & rewriter ) { rewriter_ = rewriter; }
+};
+
+#endif /* REPLAY_INDEX_HH */
@@ -0,0 +1,95 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "replay_timing.hh"
+#include "timestamp.hh"
+#include "exception.hh"
+
+using namespace std;
+
+uint64_t ReplayTimingRecord::total_ns( void ) const
+{
+    uint64_t total = 0;
+    for ( const auto & ns : stage_ns ) {
+        total += ns;
+    }
+    return total;
+}
+
+string ReplayTimingRecord::stage_name( const unsigned int stage )
+{
+    switch ( stage ) {
+    case DISPATCH: return "dispatch";
+    case INDEX: return "index";
+    case MATCH: return "match";
+    case LOAD: return "load";
+    case WRITE: return "write";
+    default: throw runtime_error( "ReplayTimingRecord: unknown stage " + to_string( stage ) );
+    }
+}
+
+ReplayTimer::ReplayTimer( const ReplayTimingRecord::Server server )
+    : record_(),
+      stage_start_( timestamp_ns() )
+{
+    record_.start = stage_start_;
+    record_.pid = getpid();
+    record_.server = server;
+    record_.outcome = ReplayTimingRecord::ERROR; /* until told otherwise */
+}
+
+void ReplayTimer::arrived( const uint64_t start )
+{
+    stage_start_ = timestamp_ns();
+
+    /* a request can't arrive in the future (the caller's clock may be coarser) */
+    record_.start = min( start, stage_start_ );
+    record_.stage_ns[ ReplayTimingRecord::DISPATCH ] = min( stage_start_ - record_.start, uint64_t( UINT32_MAX ) );
+}
+
+void ReplayTimer::end_stage( const ReplayTimingRecord::Stage stage )
+{
+    const uint64_t now = timestamp_ns();
+    record_.stage_ns[ stage ] = min( record_.stage_ns[ stage ] + (now - stage_start_), uint64_t( UINT32_MAX ) );
+    stage_start_ = now;
+}
+
+ReplayTimingLog::ReplayTimingLog( const string & filename )
+    : fd_( SystemCall( "open " + filename, open( filename.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0666 ) ) )
+{}
+
+void ReplayTimingLog::append( const ReplayTimingRecord & record )
+{
+    const ssize_t bytes_written = SystemCall( "write", ::write( fd_.fd_num(), &record, sizeof( record ) ) );
+    if ( size_t( bytes_written ) != sizeof( record ) ) {
+        throw runtime_error( "ReplayTimingLog: short write" );
+    }
+}
+
+vector< ReplayTimingRecord > ReplayTimingLog::read( const string & filename )
+{
+    FileDescriptor fd( SystemCall( "open " + filename, open( filename.c_str(), O_RDONLY ) ) );
+
+    string contents;
+    while ( not fd.eof() ) {
+        contents.append( fd.read() );
+    }
+
+    if ( contents.size() % sizeof( ReplayTimingRecord ) ) {
+        throw runtime_error( filename + ": truncated timing log" );
+    }
+
+    vector< ReplayTimingRecord > records( contents.size() / sizeof( ReplayTimingRecord ) );
+    if ( not records.empty() ) {
+        memcpy( &records[ 0 ], contents.data(), contents.size() );
+    }
+
+    return records;
+}
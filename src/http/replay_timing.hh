@@ -0,0 +1,82 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef REPLAY_TIMING_HH
+#define REPLAY_TIMING_HH
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "file_descriptor.hh"
+
+/* one request's trip through a replay server, as stored in a timing log */
+struct ReplayTimingRecord
+{
+    enum Stage : uint8_t {
+        DISPATCH, /* from Apache reading the request to the replay server starting on it */
+        INDEX,    /* listing the directory, or loading the index or archive */
+        MATCH,    /* scoring saved records against the request */
+        LOAD,     /* reading and parsing the saved response (or fetching it from the cache) */
+        WRITE,    /* serializing and writing the reply */
+        STAGE_COUNT
+    };
+
+    /* CGI_SERVER is mm-replayserver (not REPLAYSERVER, which config.h defines) */
+    enum Server : uint8_t { CGI_SERVER, DAEMON, NATIVE };
+
+    enum Outcome : uint8_t { MATCHED, CACHED, NOT_FOUND, ERROR };
+
+    uint64_t start;                     /* when the request arrived, in ns since the epoch */
+    uint32_t stage_ns[ STAGE_COUNT ];   /* time in each stage (saturates at about 4 s) */
+    uint32_t pid;
+    uint8_t server;
+    uint8_t outcome;
+    uint8_t padding[ 6 ];
+
+    uint64_t total_ns( void ) const;
+
+    static std::string stage_name( const unsigned int stage );
+};
+
+/* times the stages of one request */
+class ReplayTimer
+{
+private:
+    ReplayTimingRecord record_;
+    uint64_t stage_start_;
+
+public:
+    /* starts timing a request arriving now */
+    ReplayTimer( const ReplayTimingRecord::Server server );
+
+    /* the request really arrived at this time (ns since the epoch), e.g. when
+       Apache read it; charge the time from then until now to DISPATCH */
+    void arrived( const uint64_t start );
+
+    /* charge the time since the previous stage ended (or the request arrived) to this stage */
+    void end_stage( const ReplayTimingRecord::Stage stage );
+
+    void set_outcome( const ReplayTimingRecord::Outcome outcome ) { record_.outcome = outcome; }
+
+    const ReplayTimingRecord & record( void ) const { return record_; }
+};
+
+/* per-session binary log of fixed-size records, appended to by every
+   replay server process; each record goes out in a single write() to a
+   file opened with O_APPEND, so records from different processes never
+   interleave */
+class ReplayTimingLog
+{
+private:
+    FileDescriptor fd_;
+
+public:
+    ReplayTimingLog( const std::string & filename );
+
+    void append( const ReplayTimingRecord & record );
+
+    /* every record in a log */
+    static std::vector< ReplayTimingRecord > read( const std::string & filename );
+};
+
+#endif /* REPLAY_TIMING_HH */
@@ -0,0 +1,75 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <algorithm>
+
+#include "request_line_trie.hh"
+
+using namespace std;
+
+/* length of common prefix of label and line[ offset... ] */
+static size_t common_length( const string & label, const string & line, const size_t offset )
+{
+    const size_t limit = min( label.size(), line.size() - offset );
+    size_t i = 0;
+    while ( i < limit and label[ i ] == line[ offset + i ] ) {
+        i++;
+    }
+    return i;
+}
+
+void RequestLineTrie::insert( const string & line, const int position )
+{
+    Node * node = &root_;
+    size_t offset = 0;
+
+    while ( offset < line.size() ) {
+        auto child = node->children.find( line[ offset ] );
+        if ( child == node->children.end() ) {
+            node->children[ line[ offset ] ].reset( new Node( line.substr( offset ), position ) );
+            return;
+        }
+
+        const size_t common = common_length( child->second->label, line, offset );
+
+        if ( common < child->second->label.size() ) {
+            /* line leaves the edge partway: split it */
+            unique_ptr< Node > middle( new Node( child->second->label.substr( 0, common ),
+                                                 child->second->min_position ) );
+            child->second->label.erase( 0, common );
+            const char rest = child->second->label.front();
+            middle->children[ rest ] = move( child->second );
+            child->second = move( middle );
+        }
+
+        node = child->second.get();
+        node->min_position = min( node->min_position, position );
+        offset += common;
+    }
+}
+
+int RequestLineTrie::best_match( const string & line ) const
+{
+    const Node * node = &root_;
+    size_t offset = 0;
+    int best = -1;
+
+    /* every line below the deepest point reached shares the same, longest, prefix with this one */
+    while ( offset < line.size() ) {
+        const auto child = node->children.find( line[ offset ] );
+        if ( child == node->children.end() ) {
+            break;
+        }
+
+        const size_t common = common_length( child->second->label, line, offset );
+        best = child->second->min_position;
+
+        if ( common < child->second->label.size() ) {
+            break;
+        }
+
+        node = child->second.get();
+        offset += common;
+    }
+
+    return best;
+}
@@ -0,0 +1,38 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef REQUEST_LINE_TRIE_HH
+#define REQUEST_LINE_TRIE_HH
+
+#include <string>
+#include <map>
+#include <memory>
+
+/* radix trie over saved request lines. Finds the saved line with the
+   longest common prefix with a request in time proportional to the
+   request's length. Among equally good lines it returns the lowest
+   position, which is what a scan in directory order keeping only strictly
+   better scores would pick. */
+class RequestLineTrie
+{
+private:
+    struct Node
+    {
+        std::string label; /* characters on the edge from the parent */
+        int min_position;  /* lowest position stored in this subtree */
+        std::map< char, std::unique_ptr< Node > > children;
+
+        Node( const std::string & s_label, const int s_min_position )
+            : label( s_label ), min_position( s_min_position ), children()
+        {}
+    };
+
+    Node root_ { "", -1 };
+
+public:
+    void insert( const std::string & line, const int position );
+
+    /* position of the best match sharing at least one character, or -1 if none */
+    int best_match( const std::string & line ) const;
+};
+
+#endif /* REQUEST_LINE_TRIE_HH */
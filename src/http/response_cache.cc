@@ -0,0 +1,355 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <cstring>
+#include <algorithm>
+#include <new>
+
+#include "response_cache.hh"
+#include "exception.hh"
+
+using namespace std;
+
+struct ResponseCacheHeader
+{
+    char magic[ 8 ];
+    uint32_t version;
+    uint32_t block_size;
+
+    uint32_t record_count;
+    uint32_t block_count;
+
+    /* the rest are guarded by mutex */
+    uint32_t free_head;
+    uint32_t free_count;
+    uint32_t clock_hand;
+    uint32_t padding;
+
+    pthread_mutex_t mutex;
+};
+
+struct ResponseCacheSlot
+{
+    std::atomic< uint64_t > sequence; /* odd while the slot is changing */
+    std::atomic< uint64_t > length;   /* of the reply, or 0 if none */
+    std::atomic< uint32_t > first_block;
+    std::atomic< uint32_t > referenced;
+};
+
+static const char cache_magic[ 8 ] = { 'M', 'M', 'R', 'E', 'P', 'C', 'A', 'C' };
+static const uint32_t cache_version = 1;
+static const uint32_t no_block = UINT32_MAX;
+
+namespace {
+    uint64_t round_up( const uint64_t n, const uint64_t multiple )
+    {
+        return (n + multiple - 1) / multiple * multiple;
+    }
+
+    /* where each part of the cache lives in the file */
+    struct Layout
+    {
+        uint64_t slots_offset, next_block_offset, blocks_offset, length;
+
+        Layout( const uint64_t record_count, const uint64_t block_count )
+            : slots_offset( round_up( sizeof( ResponseCacheHeader ), 64 ) ),
+              next_block_offset( round_up( slots_offset + record_count * sizeof( ResponseCacheSlot ), 64 ) ),
+              blocks_offset( round_up( next_block_offset + block_count * sizeof( std::atomic< uint32_t > ),
+                                       ResponseCache::BLOCK_SIZE ) ),
+              length( blocks_offset + block_count * ResponseCache::BLOCK_SIZE )
+        {}
+    };
+
+    /* seqlock writer side */
+    void begin_write( ResponseCacheSlot & slot )
+    {
+        /* "| 1" also recovers a slot left odd by a writer that died */
+        slot.sequence.store( slot.sequence.load( memory_order_relaxed ) | 1, memory_order_relaxed );
+        atomic_thread_fence( memory_order_release );
+    }
+
+    void end_write( ResponseCacheSlot & slot )
+    {
+        slot.sequence.store( slot.sequence.load( memory_order_relaxed ) + 1, memory_order_release );
+    }
+
+    void pthread_check( const string & attempt, const int error )
+    {
+        if ( error ) {
+            throw unix_error( attempt, error );
+        }
+    }
+}
+
+void ResponseCache::initialize( const string & filename, const uint64_t capacity, const uint32_t record_count )
+{
+    const uint64_t block_count = capacity / BLOCK_SIZE;
+    if ( block_count >= no_block ) {
+        throw runtime_error( "ResponseCache: capacity too large" );
+    }
+
+    const Layout layout( record_count, block_count );
+
+    FileDescriptor fd( SystemCall( "open " + filename, open( filename.c_str(), O_RDWR ) ) );
+
+    /* the file stays sparse, so memory is only used as replies are cached */
+    SystemCall( "ftruncate " + filename, ftruncate( fd.fd_num(), layout.length ) );
+
+    void * base = mmap( nullptr, layout.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd.fd_num(), 0 );
+    if ( base == MAP_FAILED ) {
+        throw unix_error( "mmap " + filename );
+    }
+
+    char * const bytes = static_cast<char *>( base );
+    ResponseCacheHeader * const header = new ( bytes ) ResponseCacheHeader();
+
+    header->version = cache_version;
+    header->block_size = BLOCK_SIZE;
+    header->record_count = record_count;
+    header->block_count = block_count;
+    header->free_head = block_count ? 0 : no_block;
+    header->free_count = block_count;
+    header->clock_hand = 0;
+
+    for ( uint32_t i = 0; i < record_count; i++ ) {
+        new ( bytes + layout.slots_offset + i * sizeof( ResponseCacheSlot ) ) ResponseCacheSlot();
+    }
+
+    /* every block starts on the free list */
+    for ( uint32_t i = 0; i < block_count; i++ ) {
+        new ( bytes + layout.next_block_offset + i * sizeof( std::atomic< uint32_t > ) )
+            std::atomic< uint32_t >( i + 1 < block_count ? i + 1 : no_block );
+    }
+
+    /* shared by all processes, and recoverable if one dies holding it */
+    try {
+        pthread_mutexattr_t attributes;
+        pthread_check( "pthread_mutexattr_init", pthread_mutexattr_init( &attributes ) );
+        pthread_check( "pthread_mutexattr_setpshared",
+                       pthread_mutexattr_setpshared( &attributes, PTHREAD_PROCESS_SHARED ) );
+        pthread_check( "pthread_mutexattr_setrobust",
+                       pthread_mutexattr_setrobust( &attributes, PTHREAD_MUTEX_ROBUST ) );
+        pthread_check( "pthread_mutex_init", pthread_mutex_init( &header->mutex, &attributes ) );
+        pthread_mutexattr_destroy( &attributes );
+    } catch ( ... ) {
+        munmap( base, layout.length );
+        throw;
+    }
+
+    /* written last, so a half-built cache is never mistaken for a real one */
+    memcpy( header->magic, cache_magic, sizeof( cache_magic ) );
+
+    SystemCall( "munmap", munmap( base, layout.length ) );
+}
+
+ResponseCache::ResponseCache( const string & filename )
+    : fd_( SystemCall( "open " + filename, open( filename.c_str(), O_RDWR ) ) ),
+      length_(),
+      base_(),
+      header_(),
+      slots_(),
+      next_block_(),
+      blocks_()
+{
+    struct stat info;
+    SystemCall( "fstat " + filename, fstat( fd_.fd_num(), &info ) );
+    length_ = info.st_size;
+
+    if ( length_ < sizeof( ResponseCacheHeader ) ) {
+        throw runtime_error( filename + ": not a response cache" );
+    }
+
+    void * base = mmap( nullptr, length_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_.fd_num(), 0 );
+    if ( base == MAP_FAILED ) {
+        throw unix_error( "mmap " + filename );
+    }
+    base_ = static_cast<char *>( base );
+    header_ = reinterpret_cast<ResponseCacheHeader *>( base_ );
+
+    try {
+        if ( memcmp( header_->magic, cache_magic, sizeof( cache_magic ) )
+             or header_->version != cache_version
+             or header_->block_size != BLOCK_SIZE ) {
+            throw runtime_error( filename + ": not a response cache" );
+        }
+
+        const Layout layout( header_->record_count, header_->block_count );
+        if ( layout.length > length_ ) {
+            throw runtime_error( filename + ": response cache is truncated" );
+        }
+
+        slots_ = reinterpret_cast<ResponseCacheSlot *>( base_ + layout.slots_offset );
+        next_block_ = reinterpret_cast<std::atomic< uint32_t > *>( base_ + layout.next_block_offset );
+        blocks_ = base_ + layout.blocks_offset;
+    } catch ( ... ) {
+        munmap( base_, length_ );
+        throw;
+    }
+}
+
+ResponseCache::~ResponseCache()
+{
+    if ( munmap( base_, length_ ) < 0 ) {
+        print_exception( unix_error( "munmap" ) );
+    }
+}
+
+void ResponseCache::lock( void )
+{
+    const int error = pthread_mutex_lock( &header_->mutex );
+    if ( error == EOWNERDEAD ) {
+        /* a writer died in the middle of an update; start over */
+        clear();
+        pthread_check( "pthread_mutex_consistent", pthread_mutex_consistent( &header_->mutex ) );
+    } else {
+        pthread_check( "pthread_mutex_lock", error );
+    }
+}
+
+void ResponseCache::unlock( void )
+{
+    pthread_check( "pthread_mutex_unlock", pthread_mutex_unlock( &header_->mutex ) );
+}
+
+void ResponseCache::clear( void )
+{
+    for ( uint32_t i = 0; i < header_->record_count; i++ ) {
+        begin_write( slots_[ i ] );
+        slots_[ i ].length.store( 0, memory_order_relaxed );
+        end_write( slots_[ i ] );
+    }
+
+    for ( uint32_t i = 0; i < header_->block_count; i++ ) {
+        next_block_[ i ].store( i + 1 < header_->block_count ? i + 1 : no_block, memory_order_relaxed );
+    }
+
+    header_->free_head = header_->block_count ? 0 : no_block;
+    header_->free_count = header_->block_count;
+    header_->clock_hand = 0;
+}
+
+bool ResponseCache::evict_one( void )
+{
+    /* the first pass over the slots may do nothing but clear referenced bits */
+    for ( uint64_t step = 0; step < 2 * uint64_t( header_->record_count ); step++ ) {
+        ResponseCacheSlot & slot = slots_[ header_->clock_hand ];
+        header_->clock_hand = (header_->clock_hand + 1) % header_->record_count;
+
+        const uint64_t length = slot.length.load( memory_order_relaxed );
+        if ( length == 0 or slot.referenced.exchange( 0, memory_order_relaxed ) ) {
+            continue;
+        }
+
+        /* return the slot's chain of blocks to the free list */
+        begin_write( slot );
+
+        const uint32_t first = slot.first_block.load( memory_order_relaxed );
+        const uint64_t block_count = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        uint32_t last = first;
+        for ( uint64_t i = 1; i < block_count; i++ ) {
+            last = next_block_[ last ].load( memory_order_relaxed );
+        }
+        next_block_[ last ].store( header_->free_head, memory_order_relaxed );
+        header_->free_head = first;
+        header_->free_count += block_count;
+
+        slot.length.store( 0, memory_order_relaxed );
+        end_write( slot );
+
+        return true;
+    }
+
+    return false;
+}
+
+bool ResponseCache::get( const uint32_t record, string & reply )
+{
+    if ( record >= header_->record_count ) {
+        return false;
+    }
+
+    ResponseCacheSlot & slot = slots_[ record ];
+
+    const uint64_t sequence = slot.sequence.load( memory_order_acquire );
+    if ( sequence & 1 ) {
+        return false;
+    }
+
+    const uint64_t length = slot.length.load( memory_order_relaxed );
+    if ( length == 0 or length > uint64_t( header_->block_count ) * BLOCK_SIZE ) {
+        return false;
+    }
+
+    /* copy first, then check nothing changed underneath us */
+    string ret( length, 0 );
+    uint32_t block = slot.first_block.load( memory_order_relaxed );
+    for ( uint64_t done = 0; done < length; done += BLOCK_SIZE ) {
+        if ( block >= header_->block_count ) {
+            return false;
+        }
+        memcpy( &ret[ done ], blocks_ + uint64_t( block ) * BLOCK_SIZE, min( uint64_t( BLOCK_SIZE ), length - done ) );
+        block = next_block_[ block ].load( memory_order_relaxed );
+    }
+
+    atomic_thread_fence( memory_order_acquire );
+    if ( slot.sequence.load( memory_order_relaxed ) != sequence ) {
+        return false;
+    }
+
+    slot.referenced.store( 1, memory_order_relaxed );
+    reply = move( ret );
+    return true;
+}
+
+void ResponseCache::put( const uint32_t record, const string & reply )
+{
+    if ( record >= header_->record_count or reply.empty() ) {
+        return;
+    }
+
+    /* don't let one reply push out a large share of the cache */
+    const uint64_t block_count = (reply.size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if ( block_count > header_->block_count / 4 ) {
+        return;
+    }
+
+    lock();
+
+    ResponseCacheSlot & slot = slots_[ record ];
+
+    /* another process may have got here first */
+    if ( slot.length.load( memory_order_relaxed ) == 0 ) {
+        while ( header_->free_count < block_count and evict_one() ) {}
+
+        if ( header_->free_count >= block_count ) {
+            /* take blocks off the front of the free list */
+            const uint32_t first = header_->free_head;
+            uint32_t last = first;
+            for ( uint64_t done = 0; ; done += BLOCK_SIZE ) {
+                memcpy( blocks_ + uint64_t( last ) * BLOCK_SIZE, reply.data() + done,
+                        min( uint64_t( BLOCK_SIZE ), reply.size() - done ) );
+                if ( done + BLOCK_SIZE >= reply.size() ) {
+                    break;
+                }
+                last = next_block_[ last ].load( memory_order_relaxed );
+            }
+            header_->free_head = next_block_[ last ].load( memory_order_relaxed );
+            header_->free_count -= block_count;
+            next_block_[ last ].store( no_block, memory_order_relaxed );
+
+            begin_write( slot );
+            slot.first_block.store( first, memory_order_relaxed );
+            slot.length.store( reply.size(), memory_order_relaxed );
+            slot.referenced.store( 1, memory_order_relaxed );
+            end_write( slot );
+        }
+    }
+
+    unlock();
+}
@@ -0,0 +1,68 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef RESPONSE_CACHE_HH
+#define RESPONSE_CACHE_HH
+
+#include <string>
+#include <cstdint>
+#include <atomic>
+
+#include "file_descriptor.hh"
+
+struct ResponseCacheHeader;
+struct ResponseCacheSlot;
+
+/* Serialized replies shared by every process serving one replay session,
+   kept in a file mapped into each of them (mm-webreplay puts it in /dev/shm).
+
+   There is one slot per saved record, indexed by the record's position in
+   directory order, and a reply is stored in a chain of fixed-size blocks.
+   Lookups take no lock: each slot has a sequence number that is odd while
+   the slot is being changed, and a reader that sees it change while copying
+   the reply treats the lookup as a miss (a seqlock).
+   Writers take a process-shared mutex. When the blocks run out, the least
+   recently used replies are evicted, approximated with the CLOCK algorithm:
+   a lookup marks its slot referenced, and the clock hand passes over (and
+   clears) referenced slots before evicting one. */
+class ResponseCache
+{
+private:
+    FileDescriptor fd_;
+    size_t length_;
+    char * base_;
+
+    ResponseCacheHeader * header_;
+    ResponseCacheSlot * slots_;
+    std::atomic< uint32_t > * next_block_; /* links blocks into chains and the free list */
+    char * blocks_;
+
+    void lock( void );
+    void unlock( void );
+
+    /* with the lock held */
+    void clear( void );
+    bool evict_one( void );
+
+public:
+    static const uint32_t BLOCK_SIZE = 4096;
+
+    /* lay out an empty cache in an existing (empty) file, holding up to
+       capacity bytes of replies for a recording of record_count records */
+    static void initialize( const std::string & filename, const uint64_t capacity, const uint32_t record_count );
+
+    /* map a cache laid out by initialize() */
+    ResponseCache( const std::string & filename );
+    ~ResponseCache();
+
+    /* copy out the cached reply for a record, if present */
+    bool get( const uint32_t record, std::string & reply );
+
+    /* cache the reply for a record (unless it's too large or already there) */
+    void put( const uint32_t record, const std::string & reply );
+
+    /* ban copying */
+    ResponseCache( const ResponseCache & other ) = delete;
+    ResponseCache & operator=( const ResponseCache & other ) = delete;
+};
+
+#endif /* RESPONSE_CACHE_HH */
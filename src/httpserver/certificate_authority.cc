@@ -0,0 +1,275 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <cstdio>
+#include <ctime>
+#include <functional>
+#include <arpa/inet.h>
+
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/x509v3.h>
+
+#include "certificate_authority.hh"
+#include "temp_file.hh"
+#include "exception.hh"
+
+using namespace std;
+
+/* leaf certificates are good for a year (browsers reject much more) from a day ago (for clock skew) */
+static const long VALID_BEFORE_SECONDS = 24 * 60 * 60;
+static const long VALID_AFTER_SECONDS = 365 * 24 * 60 * 60;
+
+/* throw with OpenSSL's reason if a call failed */
+static void check( const bool ok, const string & attempt )
+{
+    if ( ok ) {
+        return;
+    }
+
+    const unsigned long error = ERR_get_error();
+    char reason[ 256 ] = "failed";
+    if ( error ) {
+        ERR_error_string_n( error, reason, sizeof( reason ) );
+    }
+
+    throw runtime_error( attempt + ": " + reason );
+}
+
+struct BIO_deleter { void operator()( BIO * x ) const { BIO_free( x ); } };
+typedef unique_ptr<BIO, BIO_deleter> BIO_handle;
+
+/* the PEM file, or null if it can't be opened */
+static BIO_handle open_pem( const string & filename )
+{
+    BIO_handle ret( BIO_new_file( filename.c_str(), "r" ) );
+    if ( not ret ) {
+        ERR_clear_error();
+    }
+    return ret;
+}
+
+/* write atomically, so a reader never sees half a file (and keys are private to the user) */
+static void write_pem( const string & filename, const function<int(BIO *)> & writer )
+{
+    BIO_handle memory( BIO_new( BIO_s_mem() ) );
+    check( memory and writer( memory.get() ), "PEM_write_bio" );
+
+    char * data;
+    const long length = BIO_get_mem_data( memory.get(), &data );
+
+    UniqueFile file( filename );
+    file.write( string( data, length ) );
+    SystemCall( "rename " + filename, rename( file.name().c_str(), filename.c_str() ) );
+}
+
+/* lowercase, and only characters that can appear in a DNS name */
+static string normalized_host_name( const string & host_name )
+{
+    string ret( host_name );
+
+    if ( not ret.empty() and ret.back() == '.' ) {
+        ret.pop_back();
+    }
+
+    if ( ret.empty() or ret.size() > 253 ) {
+        throw runtime_error( "CertificateAuthority: bad host name \"" + host_name + "\"" );
+    }
+
+    for ( auto & c : ret ) {
+        if ( c >= 'A' and c <= 'Z' ) {
+            c = c - 'A' + 'a';
+        } else if ( not ((c >= 'a' and c <= 'z') or (c >= '0' and c <= '9')
+                         or c == '-' or c == '.' or c == '_') ) {
+            throw runtime_error( "CertificateAuthority: bad host name \"" + host_name + "\"" );
+        }
+    }
+
+    return ret;
+}
+
+CertificateAuthority::CertificateAuthority( const string & ca_file, const string & cache_directory )
+    : ca_certificate_(),
+      ca_key_(),
+      cache_directory_( cache_directory ),
+      leaf_key_(),
+      mutex_(),
+      certificates_()
+{
+    if ( not cache_directory_.empty() and cache_directory_.back() != '/' ) {
+        cache_directory_.append( "/" );
+    }
+
+    /* the certificate and the key are separate blocks in the one file */
+    BIO_handle certificate_file = open_pem( ca_file );
+    check( certificate_file != nullptr, "open " + ca_file );
+    ca_certificate_.reset( PEM_read_bio_X509( certificate_file.get(), nullptr, nullptr, nullptr ) );
+    check( ca_certificate_ != nullptr, "PEM_read_bio_X509 " + ca_file );
+
+    BIO_handle key_file = open_pem( ca_file );
+    check( key_file != nullptr, "open " + ca_file );
+    ca_key_.reset( PEM_read_bio_PrivateKey( key_file.get(), nullptr, nullptr, nullptr ) );
+    check( ca_key_ != nullptr, "PEM_read_bio_PrivateKey " + ca_file );
+
+    check( X509_check_private_key( ca_certificate_.get(), ca_key_.get() ) == 1,
+           "X509_check_private_key " + ca_file );
+
+    leaf_key_ = load_or_make_leaf_key();
+}
+
+CertificateAuthority::PKEY_handle CertificateAuthority::load_or_make_leaf_key( void )
+{
+    const string filename = cache_directory_ + "leaf-key.pem";
+
+    if ( not cache_directory_.empty() ) {
+        BIO_handle file = open_pem( filename );
+        if ( file ) {
+            PKEY_handle key( PEM_read_bio_PrivateKey( file.get(), nullptr, nullptr, nullptr ) );
+            check( key != nullptr, "PEM_read_bio_PrivateKey " + filename );
+            return key;
+        }
+    }
+
+    /* P-256: quick to make and to sign with, and every browser takes it */
+    struct CTX_deleter { void operator()( EVP_PKEY_CTX * x ) const { EVP_PKEY_CTX_free( x ); } };
+    unique_ptr<EVP_PKEY_CTX, CTX_deleter> context( EVP_PKEY_CTX_new_id( EVP_PKEY_EC, nullptr ) );
+    check( context != nullptr, "EVP_PKEY_CTX_new_id" );
+    check( EVP_PKEY_keygen_init( context.get() ) == 1, "EVP_PKEY_keygen_init" );
+    check( EVP_PKEY_CTX_set_ec_paramgen_curve_nid( context.get(), NID_X9_62_prime256v1 ) == 1,
+           "EVP_PKEY_CTX_set_ec_paramgen_curve_nid" );
+
+    EVP_PKEY * key = nullptr;
+    check( EVP_PKEY_keygen( context.get(), &key ) == 1, "EVP_PKEY_keygen" );
+    PKEY_handle ret( key );
+
+    if ( not cache_directory_.empty() ) {
+        write_pem( filename, [&] ( BIO * bio ) {
+                return PEM_write_bio_PrivateKey( bio, ret.get(), nullptr, nullptr, 0, nullptr, nullptr );
+            } );
+    }
+
+    return ret;
+}
+
+CertificateAuthority::X509_handle CertificateAuthority::load_certificate( const string & host_name ) const
+{
+    BIO_handle file = open_pem( cache_directory_ + host_name + ".crt" );
+    if ( not file ) {
+        return nullptr;
+    }
+
+    X509_handle certificate( PEM_read_bio_X509( file.get(), nullptr, nullptr, nullptr ) );
+    if ( not certificate ) {
+        ERR_clear_error();
+        return nullptr;
+    }
+
+    /* still good for a day, and made by this CA for this leaf key? */
+    time_t tomorrow = time( nullptr ) + VALID_BEFORE_SECONDS;
+    if ( X509_cmp_time( X509_get0_notAfter( certificate.get() ), &tomorrow ) <= 0
+         or X509_verify( certificate.get(), ca_key_.get() ) != 1
+         or X509_check_private_key( certificate.get(), leaf_key_.get() ) != 1 ) {
+        ERR_clear_error();
+        return nullptr;
+    }
+
+    return certificate;
+}
+
+void CertificateAuthority::save_certificate( const string & host_name, X509 * certificate ) const
+{
+    write_pem( cache_directory_ + host_name + ".crt",
+               [&] ( BIO * bio ) { return PEM_write_bio_X509( bio, certificate ); } );
+}
+
+static void add_extension( X509 * certificate, X509V3_CTX & context, const int nid, const string & value )
+{
+    X509_EXTENSION * extension = X509V3_EXT_conf_nid( nullptr, &context, nid, value.c_str() );
+    check( extension != nullptr, "X509V3_EXT_conf_nid " + value );
+
+    const int ok = X509_add_ext( certificate, extension, -1 );
+    X509_EXTENSION_free( extension );
+    check( ok == 1, "X509_add_ext" );
+}
+
+CertificateAuthority::X509_handle CertificateAuthority::issue( const string & host_name ) const
+{
+    X509_handle certificate( X509_new() );
+    check( certificate != nullptr, "X509_new" );
+    X509 * const x = certificate.get();
+
+    check( X509_set_version( x, 2 ), "X509_set_version" ); /* v3 */
+
+    /* random positive serial number, so no two certificates share one */
+    unsigned char serial[ 16 ];
+    check( RAND_bytes( serial, sizeof( serial ) ) == 1, "RAND_bytes" );
+    serial[ 0 ] &= 0x7f;
+    BIGNUM * serial_number = BN_bin2bn( serial, sizeof( serial ), nullptr );
+    check( serial_number != nullptr, "BN_bin2bn" );
+    const bool serial_ok = BN_to_ASN1_INTEGER( serial_number, X509_get_serialNumber( x ) ) != nullptr;
+    BN_free( serial_number );
+    check( serial_ok, "BN_to_ASN1_INTEGER" );
+
+    check( X509_gmtime_adj( X509_getm_notBefore( x ), -VALID_BEFORE_SECONDS ), "X509_gmtime_adj" );
+    check( X509_gmtime_adj( X509_getm_notAfter( x ), VALID_AFTER_SECONDS ), "X509_gmtime_adj" );
+
+    /* a CN can be at most 64 characters; browsers only look at the subjectAltName anyway */
+    if ( host_name.size() <= 64 ) {
+        check( X509_NAME_add_entry_by_txt( X509_get_subject_name( x ), "CN", MBSTRING_ASC,
+                                           reinterpret_cast<const unsigned char *>( host_name.c_str() ),
+                                           -1, -1, 0 ),
+               "X509_NAME_add_entry_by_txt" );
+    }
+    check( X509_set_issuer_name( x, X509_get_subject_name( ca_certificate_.get() ) ), "X509_set_issuer_name" );
+    check( X509_set_pubkey( x, leaf_key_.get() ), "X509_set_pubkey" );
+
+    X509V3_CTX context;
+    X509V3_set_ctx( &context, ca_certificate_.get(), x, nullptr, nullptr, 0 );
+
+    in_addr address;
+    const bool is_address = inet_pton( AF_INET, host_name.c_str(), &address ) == 1;
+
+    add_extension( x, context, NID_basic_constraints, "critical,CA:FALSE" );
+    add_extension( x, context, NID_key_usage, "critical,digitalSignature" );
+    add_extension( x, context, NID_ext_key_usage, "serverAuth" );
+    add_extension( x, context, NID_subject_key_identifier, "hash" );
+    add_extension( x, context, NID_subject_alt_name, (is_address ? "IP:" : "DNS:") + host_name );
+
+    check( X509_sign( x, ca_key_.get(), EVP_sha256() ) > 0, "X509_sign" );
+
+    return certificate;
+}
+
+void CertificateAuthority::use_certificate( SSL * ssl, const string & host_name )
+{
+    const string name = normalized_host_name( host_name );
+
+    X509 * certificate;
+    {
+        unique_lock<mutex> lock( mutex_ );
+
+        auto cached = certificates_.find( name );
+        if ( cached == certificates_.end() ) {
+            X509_handle made = cache_directory_.empty() ? nullptr : load_certificate( name );
+
+            if ( not made ) {
+                made = issue( name );
+                if ( not cache_directory_.empty() ) {
+                    try {
+                        save_certificate( name, made.get() );
+                    } catch ( const exception & e ) { /* still good for this run */
+                        print_exception( e );
+                    }
+                }
+            }
+
+            cached = certificates_.emplace( name, move( made ) ).first;
+        }
+
+        certificate = cached->second.get();
+    }
+
+    /* the connection takes its own references */
+    check( SSL_use_certificate( ssl, certificate ) == 1, "SSL_use_certificate" );
+    check( SSL_use_PrivateKey( ssl, leaf_key_.get() ) == 1, "SSL_use_PrivateKey" );
+}
@@ -0,0 +1,57 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CERTIFICATE_AUTHORITY_HH
+#define CERTIFICATE_AUTHORITY_HH
+
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include <openssl/ssl.h>
+
+/* a local CA that signs a certificate for each host name on demand, so a
+   browser that trusts the CA sees a valid certificate for every site.
+   Leaf certificates share one key, and are kept in memory and, given a
+   cache directory, on disk from one run to the next. */
+class CertificateAuthority
+{
+private:
+    struct X509_deleter { void operator()( X509 * x ) const { X509_free( x ); } };
+    struct PKEY_deleter { void operator()( EVP_PKEY * x ) const { EVP_PKEY_free( x ); } };
+    typedef std::unique_ptr<X509, X509_deleter> X509_handle;
+    typedef std::unique_ptr<EVP_PKEY, PKEY_deleter> PKEY_handle;
+
+    X509_handle ca_certificate_;
+    PKEY_handle ca_key_;
+
+    /* empty for no disk cache; otherwise ends with '/' */
+    std::string cache_directory_;
+
+    /* the key of every leaf certificate */
+    PKEY_handle leaf_key_;
+
+    std::mutex mutex_;
+    std::map< std::string, X509_handle > certificates_;
+
+    PKEY_handle load_or_make_leaf_key( void );
+
+    /* a certificate left on disk by an earlier run, if still good */
+    X509_handle load_certificate( const std::string & host_name ) const;
+    void save_certificate( const std::string & host_name, X509 * certificate ) const;
+
+    X509_handle issue( const std::string & host_name ) const;
+
+public:
+    /* ca_file holds the CA's certificate and private key, in PEM format */
+    CertificateAuthority( const std::string & ca_file, const std::string & cache_directory = "" );
+
+    /* have this server connection present a certificate for host_name */
+    void use_certificate( SSL * ssl, const std::string & host_name );
+
+    /* ban copying */
+    CertificateAuthority( const CertificateAuthority & other ) = delete;
+    CertificateAuthority & operator=( const CertificateAuthority & other ) = delete;
+};
+
+#endif /* CERTIFICATE_AUTHORITY_HH */
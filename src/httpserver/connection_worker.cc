@@ -0,0 +1,99 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "connection_worker.hh"
+#include "exception.hh"
+
+using namespace std;
+
+ConnectionWorker::ConnectionWorker( const Factory & factory )
+    : factory_( factory ),
+      epoller_(),
+      wakeup_( SystemCall( "eventfd", eventfd( 0, EFD_NONBLOCK ) ) ),
+      mutex_(),
+      arrivals_(),
+      exiting_( false ),
+      connections_(),
+      closed_(),
+      thread_()
+{
+    epoller_.add( wakeup_, EPOLLIN, [&] ( const uint32_t ) { accept_arrivals(); } );
+
+    /* start last, once everything the thread uses exists */
+    thread_ = thread( [&] () { loop(); } );
+}
+
+static void wake( const FileDescriptor & eventfd )
+{
+    const uint64_t one = 1;
+    SystemCall( "write eventfd", ::write( eventfd.fd_num(), &one, sizeof( one ) ) );
+}
+
+ConnectionWorker::~ConnectionWorker()
+{
+    try {
+        {
+            unique_lock<mutex> lock( mutex_ );
+            exiting_ = true;
+        }
+        wake( wakeup_ );
+        thread_.join();
+    } catch ( const exception & e ) { /* don't throw from destructor */
+        print_exception( e );
+    }
+}
+
+void ConnectionWorker::add_connection( TCPSocket && client )
+{
+    {
+        unique_lock<mutex> lock( mutex_ );
+        arrivals_.emplace_back( move( client ) );
+    }
+    wake( wakeup_ );
+}
+
+void ConnectionWorker::accept_arrivals( void )
+{
+    wakeup_.read(); /* reset the eventfd's counter */
+
+    vector< TCPSocket > arrivals;
+    {
+        unique_lock<mutex> lock( mutex_ );
+        arrivals.swap( arrivals_ );
+    }
+
+    for ( auto & client : arrivals ) {
+        /* the connection tells us when it's done, by its place in the list */
+        connections_.emplace_front();
+        const auto connection = connections_.begin();
+
+        try {
+            *connection = factory_( move( client ), epoller_,
+                                    [this, connection] () { closed_.push_back( connection ); } );
+        } catch ( const exception & e ) {
+            print_exception( e );
+            connections_.erase( connection );
+        }
+    }
+}
+
+void ConnectionWorker::loop( void )
+{
+    while ( true ) {
+        {
+            unique_lock<mutex> lock( mutex_ );
+            if ( exiting_ ) {
+                return;
+            }
+        }
+
+        epoller_.wait( -1 );
+
+        for ( const auto & connection : closed_ ) {
+            connections_.erase( connection );
+        }
+        closed_.clear();
+    }
+}
@@ -0,0 +1,74 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CONNECTION_WORKER_HH
+#define CONNECTION_WORKER_HH
+
+#include <list>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <functional>
+
+#include "epoller.hh"
+#include "socket.hh"
+
+/* a thread that serves many connections at once with one Epoller.
+   Connections are handed over by the thread that accepts them. */
+class ConnectionWorker
+{
+public:
+    /* what a worker serves. A connection registers its own sockets with the
+       worker's Epoller and calls on_close once it's done with them; the
+       worker then destroys it (after the callback that closed it returns). */
+    class Connection
+    {
+    public:
+        virtual ~Connection() {}
+    };
+
+    typedef std::function< std::unique_ptr< Connection >( TCPSocket && client, Epoller & epoller,
+                                                          const std::function<void()> & on_close ) > Factory;
+
+private:
+    Factory factory_;
+
+    Epoller epoller_;
+
+    /* eventfd, readable when there are new connections (or it's time to exit) */
+    FileDescriptor wakeup_;
+
+    /* guarded by mutex_, since the accepting thread adds to them */
+    std::mutex mutex_;
+    std::vector< TCPSocket > arrivals_;
+    bool exiting_;
+
+    /* only touched by the worker thread */
+    typedef std::list< std::unique_ptr< Connection > > ConnectionList;
+    ConnectionList connections_;
+
+    /* closed during the last wait(), to be destroyed once it returns */
+    std::vector< ConnectionList::iterator > closed_;
+
+    std::thread thread_;
+
+    void loop( void );
+
+    /* start serving the connections handed over since last time */
+    void accept_arrivals( void );
+
+public:
+    ConnectionWorker( const Factory & factory );
+
+    /* closes this worker's connections once its thread has stopped */
+    ~ConnectionWorker();
+
+    /* from any thread */
+    void add_connection( TCPSocket && client );
+
+    /* ban copying */
+    ConnectionWorker( const ConnectionWorker & other ) = delete;
+    ConnectionWorker & operator=( const ConnectionWorker & other ) = delete;
+};
+
+#endif /* CONNECTION_WORKER_HH */
@@ -0,0 +1,283 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+
+#include "http2_replay_session.hh"
+#include "native_replay_server.hh"
+#include "replay_index.hh"
+#include "tokenize.hh"
+#include "exception.hh"
+
+using namespace std;
+
+static void check_nghttp2( const string & attempt, const ssize_t ret )
+{
+    if ( ret < 0 ) {
+        throw runtime_error( attempt + ": " + nghttp2_strerror( ret ) );
+    }
+}
+
+static nghttp2_session * new_server_session( void * user_data,
+                                             nghttp2_on_begin_headers_callback on_begin_headers,
+                                             nghttp2_on_header_callback on_header,
+                                             nghttp2_on_frame_recv_callback on_frame_received,
+                                             nghttp2_on_stream_close_callback on_stream_close )
+{
+    nghttp2_session_callbacks * callbacks;
+    check_nghttp2( "nghttp2_session_callbacks_new", nghttp2_session_callbacks_new( &callbacks ) );
+
+    nghttp2_session_callbacks_set_on_begin_headers_callback( callbacks, on_begin_headers );
+    nghttp2_session_callbacks_set_on_header_callback( callbacks, on_header );
+    nghttp2_session_callbacks_set_on_frame_recv_callback( callbacks, on_frame_received );
+    nghttp2_session_callbacks_set_on_stream_close_callback( callbacks, on_stream_close );
+
+    nghttp2_session * session;
+    const int ret = nghttp2_session_server_new( &session, callbacks, user_data );
+    nghttp2_session_callbacks_del( callbacks );
+    check_nghttp2( "nghttp2_session_server_new", ret );
+
+    return session;
+}
+
+HTTP2ReplaySession::HTTP2ReplaySession( const ReplayIndex & index )
+    : index_( index ),
+      session_( new_server_session( this, on_begin_headers, on_header,
+                                    on_frame_received, on_stream_close ) ),
+      streams_()
+{
+    const nghttp2_settings_entry settings[] = { { NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 100 } };
+    check_nghttp2( "nghttp2_submit_settings",
+                   nghttp2_submit_settings( session_.get(), NGHTTP2_FLAG_NONE, settings, 1 ) );
+}
+
+/* recorded bodies keep their HTTP/1.1 chunked framing, which HTTP/2 doesn't use */
+static string dechunk( const string & body )
+{
+    string ret;
+    size_t position = 0;
+
+    while ( true ) {
+        const size_t end_of_size = body.find( "\r\n", position );
+        if ( end_of_size == string::npos ) {
+            throw runtime_error( "HTTP2ReplaySession: malformed chunked body" );
+        }
+
+        /* strtoul stops at any chunk extension */
+        const size_t chunk_size = strtoul( body.substr( position, end_of_size - position ).c_str(), nullptr, 16 );
+        position = end_of_size + 2;
+
+        if ( chunk_size == 0 ) {
+            return ret;
+        }
+
+        if ( chunk_size > body.size() - position ) {
+            throw runtime_error( "HTTP2ReplaySession: chunked body ends in middle of chunk" );
+        }
+
+        ret.append( body, position, chunk_size );
+        position += chunk_size + 2;
+    }
+}
+
+/* HTTP/1.1 header fields that mean nothing (and are forbidden) in HTTP/2 */
+static bool connection_specific( const string & name )
+{
+    return name == "connection" or name == "keep-alive" or name == "proxy-connection"
+        or name == "transfer-encoding" or name == "upgrade";
+}
+
+static nghttp2_nv header_field( const string & name, const string & value )
+{
+    return { reinterpret_cast<uint8_t *>( const_cast<char *>( name.data() ) ),
+             reinterpret_cast<uint8_t *>( const_cast<char *>( value.data() ) ),
+             name.size(), value.size(), NGHTTP2_NV_FLAG_NONE };
+}
+
+void HTTP2ReplaySession::respond( const int32_t stream_id )
+{
+    Stream & stream = streams_.at( stream_id );
+
+    /* the recording holds HTTP/1.1 requests; match as if this were one */
+    const string request_line = stream.method + " " + stream.path + " HTTP/1.1";
+    const bool has_host = not stream.authority.empty();
+
+    const MahimahiProtobufs::ReplayIndexEntry * const best_match
+        = index_.best_match( true, has_host, has_host ? server_hostname( stream.authority ) : "", request_line );
+
+    string head, body;
+    if ( best_match ) {
+        const ReplayResponse reply = index_.response( *best_match );
+        head = reply.head().str();
+        body = reply.body();
+    } else {
+        const string reply = not_found_reply();
+        const size_t end_of_head = reply.find( CRLF + CRLF );
+        head = reply.substr( 0, end_of_head + 2 );
+        body = reply.substr( end_of_head + 4 );
+    }
+
+    /* status line and headers, lowercased for HTTP/2 */
+    vector< pair< string, string > > fields;
+    bool chunked = false;
+    const vector< string > lines = split( head, CRLF );
+
+    const vector< string > status_line = split( lines.at( 0 ), " " );
+    const string status = status_line.size() > 1 ? status_line.at( 1 ) : "500";
+    fields.emplace_back( ":status", status );
+
+    for ( size_t i = 1; i < lines.size(); i++ ) {
+        const size_t colon = lines.at( i ).find( ':' );
+        if ( colon == string::npos ) {
+            continue;
+        }
+
+        string name = lines.at( i ).substr( 0, colon );
+        transform( name.begin(), name.end(), name.begin(),
+                   [] ( const char c ) { return (c >= 'A' and c <= 'Z') ? c - 'A' + 'a' : c; } );
+        const size_t value_start = lines.at( i ).find_first_not_of( " \t", colon + 1 );
+        const string value = value_start == string::npos ? "" : lines.at( i ).substr( value_start );
+
+        if ( name == "transfer-encoding" and value.find( "chunked" ) != string::npos ) {
+            chunked = true;
+        }
+
+        if ( not connection_specific( name ) ) {
+            fields.emplace_back( name, value );
+        }
+    }
+
+    stream.body = chunked ? dechunk( body ) : body;
+
+    if ( stream.method == "HEAD" or status.front() == '1' or status == "204" or status == "304" ) {
+        stream.body.clear();
+    }
+
+    vector< nghttp2_nv > header_block;
+    for ( const auto & field : fields ) {
+        header_block.push_back( header_field( field.first, field.second ) );
+    }
+
+    nghttp2_data_provider body_provider;
+    body_provider.source.ptr = nullptr;
+    body_provider.read_callback = read_body;
+
+    check_nghttp2( "nghttp2_submit_response",
+                   nghttp2_submit_response( session_.get(), stream_id, header_block.data(), header_block.size(),
+                                            stream.body.empty() ? nullptr : &body_provider ) );
+}
+
+int HTTP2ReplaySession::on_begin_headers( nghttp2_session *, const nghttp2_frame * frame, void * user_data )
+{
+    HTTP2ReplaySession & session = *static_cast<HTTP2ReplaySession *>( user_data );
+
+    if ( frame->hd.type == NGHTTP2_HEADERS and frame->headers.cat == NGHTTP2_HCAT_REQUEST ) {
+        session.streams_[ frame->hd.stream_id ] = Stream();
+    }
+
+    return 0;
+}
+
+int HTTP2ReplaySession::on_header( nghttp2_session *, const nghttp2_frame * frame,
+                                   const uint8_t * name, size_t name_length,
+                                   const uint8_t * value, size_t value_length, uint8_t, void * user_data )
+{
+    HTTP2ReplaySession & session = *static_cast<HTTP2ReplaySession *>( user_data );
+
+    const auto stream = session.streams_.find( frame->hd.stream_id );
+    if ( frame->hd.type != NGHTTP2_HEADERS or stream == session.streams_.end() ) {
+        return 0;
+    }
+
+    const string field_name( reinterpret_cast<const char *>( name ), name_length );
+    const string field_value( reinterpret_cast<const char *>( value ), value_length );
+
+    if ( field_name == ":method" ) {
+        stream->second.method = field_value;
+    } else if ( field_name == ":path" ) {
+        stream->second.path = field_value;
+    } else if ( field_name == ":authority" or (field_name == "host" and stream->second.authority.empty()) ) {
+        stream->second.authority = field_value;
+    }
+
+    return 0;
+}
+
+int HTTP2ReplaySession::on_frame_received( nghttp2_session *, const nghttp2_frame * frame, void * user_data )
+{
+    HTTP2ReplaySession & session = *static_cast<HTTP2ReplaySession *>( user_data );
+
+    /* answer once the request (and any body, which we don't need) is complete */
+    if ( (frame->hd.type != NGHTTP2_HEADERS and frame->hd.type != NGHTTP2_DATA)
+         or not (frame->hd.flags & NGHTTP2_FLAG_END_STREAM)
+         or not session.streams_.count( frame->hd.stream_id ) ) {
+        return 0;
+    }
+
+    try {
+        session.respond( frame->hd.stream_id );
+    } catch ( const exception & e ) {
+        print_exception( e );
+        nghttp2_submit_rst_stream( session.session_.get(), NGHTTP2_FLAG_NONE,
+                                   frame->hd.stream_id, NGHTTP2_INTERNAL_ERROR );
+    }
+
+    return 0;
+}
+
+int HTTP2ReplaySession::on_stream_close( nghttp2_session *, int32_t stream_id, uint32_t, void * user_data )
+{
+    static_cast<HTTP2ReplaySession *>( user_data )->streams_.erase( stream_id );
+    return 0;
+}
+
+ssize_t HTTP2ReplaySession::read_body( nghttp2_session *, int32_t stream_id, uint8_t * buffer, size_t length,
+                                       uint32_t * data_flags, nghttp2_data_source *, void * user_data )
+{
+    HTTP2ReplaySession & session = *static_cast<HTTP2ReplaySession *>( user_data );
+
+    const auto stream = session.streams_.find( stream_id );
+    if ( stream == session.streams_.end() ) {
+        return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+    }
+
+    Stream & s = stream->second;
+    const size_t amount = min( length, s.body.size() - s.body_sent );
+    copy( s.body.begin() + s.body_sent, s.body.begin() + s.body_sent + amount, buffer );
+    s.body_sent += amount;
+
+    if ( s.body_sent == s.body.size() ) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    }
+
+    return amount;
+}
+
+void HTTP2ReplaySession::receive( const string & data )
+{
+    check_nghttp2( "nghttp2_session_mem_recv",
+                   nghttp2_session_mem_recv( session_.get(), reinterpret_cast<const uint8_t *>( data.data() ),
+                                             data.size() ) );
+}
+
+void HTTP2ReplaySession::send( string & output, const size_t limit )
+{
+    /* whatever nghttp2 holds back is waiting on the client's flow-control windows */
+    while ( output.size() < limit ) {
+        const uint8_t * data;
+        const ssize_t length = nghttp2_session_mem_send( session_.get(), &data );
+        check_nghttp2( "nghttp2_session_mem_send", length );
+
+        if ( length == 0 ) {
+            return;
+        }
+
+        output.append( reinterpret_cast<const char *>( data ), length );
+    }
+}
+
+bool HTTP2ReplaySession::finished( void ) const
+{
+    return not nghttp2_session_want_read( session_.get() ) and not nghttp2_session_want_write( session_.get() );
+}
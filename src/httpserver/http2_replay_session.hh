@@ -0,0 +1,68 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef HTTP2_REPLAY_SESSION_HH
+#define HTTP2_REPLAY_SESSION_HH
+
+#include <string>
+#include <map>
+#include <memory>
+
+#include <nghttp2/nghttp2.h>
+
+class ReplayIndex;
+
+/* one HTTP/2 connection to the native replay server, negotiated with ALPN.
+   Requests arrive as concurrent streams; each is matched against the
+   recording like an HTTP/1.1 request, and nghttp2 interleaves the replies'
+   DATA frames within the client's flow-control windows. The session only
+   turns bytes from the client into bytes for it, so the connection can be
+   served without blocking. */
+class HTTP2ReplaySession
+{
+private:
+    struct Stream
+    {
+        std::string method {}, path {}, authority {};
+        std::string body {};
+        size_t body_sent {};
+    };
+
+    struct session_deleter { void operator()( nghttp2_session * x ) const { nghttp2_session_del( x ); } };
+
+    const ReplayIndex & index_;
+
+    std::unique_ptr< nghttp2_session, session_deleter > session_;
+    std::map< int32_t, Stream > streams_;
+
+    /* submit the reply for a stream whose request is complete */
+    void respond( const int32_t stream_id );
+
+    static int on_begin_headers( nghttp2_session *, const nghttp2_frame * frame, void * user_data );
+    static int on_header( nghttp2_session *, const nghttp2_frame * frame,
+                          const uint8_t * name, size_t name_length,
+                          const uint8_t * value, size_t value_length, uint8_t, void * user_data );
+    static int on_frame_received( nghttp2_session *, const nghttp2_frame * frame, void * user_data );
+    static int on_stream_close( nghttp2_session *, int32_t stream_id, uint32_t, void * user_data );
+    static ssize_t read_body( nghttp2_session *, int32_t stream_id, uint8_t * buffer, size_t length,
+                              uint32_t * data_flags, nghttp2_data_source *, void * user_data );
+
+public:
+    /* queues the server's SETTINGS, which go out first */
+    HTTP2ReplaySession( const ReplayIndex & index );
+
+    /* take bytes from the client */
+    void receive( const std::string & data );
+
+    /* append frames that can go to the client now, stopping once output
+       holds limit bytes (the rest waits for the next call) */
+    void send( std::string & output, const size_t limit );
+
+    /* has the session nothing more to receive or send? */
+    bool finished( void ) const;
+
+    /* ban copying */
+    HTTP2ReplaySession( const HTTP2ReplaySession & other ) = delete;
+    HTTP2ReplaySession & operator=( const HTTP2ReplaySession & other ) = delete;
+};
+
+#endif /* HTTP2_REPLAY_SESSION_HH */
@@ -2,136 +2,97 @@
 
 #include <thread>
 #include <string>
-#include <iostream>
-#include <arpa/inet.h>
-#include <linux/netfilter_ipv4.h>
+#include <csignal>
 
 #include "address.hh"
 #include "socket.hh"
-#include "system_runner.hh"
 #include "http_proxy.hh"
-#include "poller.hh"
-#include "bytestream_queue.hh"
-#include "http_request_parser.hh"
-#include "http_response_parser.hh"
-#include "file_descriptor.hh"
+#include "connection_worker.hh"
+#include "proxy_connection.hh"
 #include "event_loop.hh"
-#include "temp_file.hh"
 #include "secure_socket.hh"
 #include "backing_store.hh"
 #include "exception.hh"
-#include "util.hh"
 
 using namespace std;
 using namespace PollerShortNames;
 
-HTTPProxy::HTTPProxy( const Address & listener_addr )
+HTTPProxy::HTTPProxy( const Address & listener_addr, const unsigned int worker_count )
     : listener_socket_(),
       server_context_( SERVER ),
-      client_context_( CLIENT )
+      client_context_( CLIENT ),
+      upstream_pool_(),
+      worker_count_( worker_count ? worker_count : max( thread::hardware_concurrency(), 1u ) ),
+      workers_(),
+      next_worker_( 0 ),
+      forwarding_( false ),
+      forward_address_(),
+      forward_tls_( false )
 {
     listener_socket_.bind( listener_addr );
     listener_socket_.listen();
 }
 
-template <class SocketType>
-void HTTPProxy::loop( SocketType & server, SocketType & client, HTTPBackingStore & backing_store )
-{
-    Poller poller;
-
-    HTTPRequestParser request_parser;
-    HTTPResponseParser response_parser;
-
-    const Address server_addr = client.original_dest();
-
-    /* poll on original connect socket and new connection socket to ferry packets */
-    /* responses from server go to response parser */
-    poller.add_action( Poller::Action( server, Direction::In,
-                                       [&] () {
-                                           string buffer = server.read();
-                                           response_parser.parse( buffer );
-                                           return ResultType::Continue;
-                                       },
-                                       [&] () { return not client.eof(); } ) );
-
-    /* requests from client go to request parser */
-    poller.add_action( Poller::Action( client, Direction::In,
-                                       [&] () {
-                                           string buffer = client.read();
-                                           request_parser.parse( buffer );
-                                           return ResultType::Continue;
-                                       },
-                                       [&] () { return not server.eof(); } ) );
-
-    /* completed requests from client are serialized and sent to server */
-    poller.add_action( Poller::Action( server, Direction::Out,
-                                       [&] () {
-                                           server.write( request_parser.front().str() );
-                                           response_parser.new_request_arrived( request_parser.front() );
-                                           request_parser.pop();
-                                           return ResultType::Continue;
-                                       },
-                                       [&] () { return not request_parser.empty(); } ) );
+/* out of line, where ConnectionWorker is complete */
+HTTPProxy::~HTTPProxy() {}
 
-    /* completed responses from server are serialized and sent to client */
-    poller.add_action( Poller::Action( client, Direction::Out,
-                                       [&] () {
-                                           client.write( response_parser.front().str() );
-                                           backing_store.save( response_parser.front(), server_addr );
-                                           response_parser.pop();
-                                           return ResultType::Continue;
-                                       },
-                                       [&] () { return not response_parser.empty(); } ) );
-
-    while ( true ) {
-        if ( poller.poll( -1 ).result == Poller::Result::Type::Exit ) {
-            return;
-        }
+void HTTPProxy::forward_to( const Address & server, const bool tls )
+{
+    if ( not workers_.empty() ) {
+        throw runtime_error( "HTTPProxy: forward_to must be called before the workers start" );
     }
+
+    forwarding_ = true;
+    forward_address_ = server;
+    forward_tls_ = tls;
 }
 
-void HTTPProxy::handle_tcp( HTTPBackingStore & backing_store )
+void HTTPProxy::handle_tcp( void )
 {
-    thread newthread( [&] ( TCPSocket client ) {
-            try {
-
-                /* get original destination for connection request */
-                Address server_addr = client.original_dest();
-
-                /* create socket and connect to original destination and send original request */
-                TCPSocket server;
-                server.connect( server_addr );
-
-                if ( server_addr.port() != 443 ) { /* normal HTTP */
-                    return loop( server, client, backing_store );
-                }
-
-                /* handle TLS */
-                SecureSocket tls_server( client_context_.new_secure_socket( move( server ) ) );
-                // Establish TSL connection only when the hostname is available
-                // tls_server.connect();
-
-                SecureSocket tls_client( server_context_.new_secure_socket( move( client ) ) );
-                tls_client.accept();
+    if ( workers_.empty() ) {
+        throw runtime_error( "HTTPProxy: no workers (call register_handlers first)" );
+    }
 
-                loop( tls_server, tls_client, backing_store );
-            } catch ( const exception & e ) {
-                print_exception( e );
-            }
-        }, listener_socket_.accept() );
+    workers_.at( next_worker_ )->add_connection( listener_socket_.accept() );
+    next_worker_ = (next_worker_ + 1) % workers_.size();
+}
 
-    /* don't wait around for the reply */
-    newthread.detach();
+void HTTPProxy::start_workers( HTTPBackingStore & backing_store )
+{
+    /* a server may close a pooled connection just as it's reused; the
+       write fails with EPIPE and the request is retried elsewhere */
+    signal( SIGPIPE, SIG_IGN );
+
+    /* threads don't survive a fork, so they start here rather than in the constructor */
+    for ( unsigned int i = 0; i < worker_count_; i++ ) {
+        workers_.emplace_back( new ConnectionWorker(
+            [this, &backing_store] ( TCPSocket && client, Epoller & epoller, const function<void()> & on_close ) {
+                const Address server = forwarding_ ? forward_address_ : client.original_dest();
+                const bool https = forwarding_ ? forward_tls_ : server.port() == 443;
+
+                return unique_ptr< ConnectionWorker::Connection >(
+                    new ProxyConnection( move( client ), server, https, server_context_, client_context_,
+                                         backing_store, epoller, upstream_pool_, on_close ) );
+            } ) );
+    }
 }
 
-/* register this HTTPProxy's TCP listener socket to handle events with
-   the given event_loop, saving request-response pairs to the given
-   backing_store (which is captured and must continue to persist) */
+/* start the workers (in this process), and register this HTTPProxy's
+   TCP listener socket to handle events with the given event_loop,
+   saving request-response pairs to the given backing_store (which is
+   captured and must continue to persist) */
 void HTTPProxy::register_handlers( EventLoop & event_loop, HTTPBackingStore & backing_store )
 {
+    start_workers( backing_store );
+
     event_loop.add_simple_input_handler( tcp_listener(),
                                          [&] () {
-                                             handle_tcp( backing_store );
+                                             handle_tcp();
                                              return ResultType::Continue;
                                          } );
 }
+
+void HTTPProxy::stop( void )
+{
+    workers_.clear();
+}
@@ -4,38 +4,77 @@
 #define HTTP_PROXY_HH
 
 #include <string>
+#include <vector>
+#include <memory>
 
 #include "socket.hh"
 #include "secure_socket.hh"
 #include "http_response.hh"
+#include "upstream_pool.hh"
 
 class HTTPBackingStore;
 class EventLoop;
-class Poller;
-class HTTPRequestParser;
-class HTTPResponseParser;
+class ConnectionWorker;
 
+/* transparent HTTP(S) proxy. Accepted connections are spread over a fixed
+   pool of worker threads, each multiplexing its share with epoll.
+   Connections to servers are kept alive and reused across clients. */
 class HTTPProxy
 {
 private:
     TCPSocket listener_socket_;
 
-    template <class SocketType>
-    void loop( SocketType & server, SocketType & client, HTTPBackingStore & backing_store );
-
     SSLContext server_context_, client_context_;
 
+    /* idle connections to servers, shared by the workers (so declared first, to outlive them) */
+    UpstreamPool upstream_pool_;
+
+    unsigned int worker_count_;
+    std::vector< std::unique_ptr< ConnectionWorker > > workers_;
+    size_t next_worker_;
+
+    /* if set, where every connection goes instead of its original destination */
+    bool forwarding_;
+    Address forward_address_;
+    bool forward_tls_;
+
 public:
-    HTTPProxy( const Address & listener_addr );
+    /* worker_count of 0 means one per core */
+    HTTPProxy( const Address & listener_addr, const unsigned int worker_count = 0 );
+
+    ~HTTPProxy();
 
     TCPSocket & tcp_listener( void ) { return listener_socket_; }
 
-    void handle_tcp( HTTPBackingStore & backing_store );
+    /* give browsers a certificate for each site, signed by authority */
+    void sign_certificates_with( const std::shared_ptr< CertificateAuthority > & authority )
+    {
+        server_context_.sign_certificates_with( authority );
+    }
 
-    /* register this HTTPProxy's TCP listener socket to handle events with
-       the given event_loop, saving request-response pairs to the given
-       backing_store (which is captured and must continue to persist) */
+    /* send every connection to server (speaking TLS to both sides if tls),
+       rather than to where it was headed, so no NAT rule is needed */
+    void forward_to( const Address & server, const bool tls );
+
+    /* accept a connection and hand it to the next worker */
+    void handle_tcp( void );
+
+    /* start the workers (in this process), saving request-response pairs
+       to the given backing_store (which must outlive them) */
+    void start_workers( HTTPBackingStore & backing_store );
+
+    /* start the workers (in this process), and register this HTTPProxy's
+       TCP listener socket to handle events with the given event_loop,
+       saving request-response pairs to the given backing_store (which is
+       captured and must continue to persist) */
     void register_handlers( EventLoop & event_loop, HTTPBackingStore & backing_store );
+
+    /* stop the workers, closing their connections, so the backing store can go away */
+    void stop( void );
+
+    /* ban copying */
+    HTTPProxy( const HTTPProxy & other ) = delete;
+    HTTPProxy & operator=( const HTTPProxy & other ) = delete;
 };
 
 #endif /* HTTP_PROXY_HH */
@@ -0,0 +1,76 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <thread>
+#include <algorithm>
+#include <csignal>
+
+#include "native_replay_server.hh"
+#include "replay_connection.hh"
+#include "connection_worker.hh"
+#include "epoller.hh"
+
+using namespace std;
+
+NativeReplayServer::NativeReplayServer( const set< Address > & addresses )
+    : listeners_(),
+      server_context_( SERVER )
+{
+    server_context_.offer_http2();
+
+    for ( const auto & address : addresses ) {
+        listeners_.emplace_back();
+        listeners_.back().set_reuseaddr();
+        listeners_.back().bind( address );
+        listeners_.back().listen( 128 );
+    }
+}
+
+string server_hostname( const string & host_header )
+{
+    string hostname = host_header;
+
+    const auto colon = hostname.rfind( ':' );
+    if ( colon != string::npos and hostname.find( ']', colon ) == string::npos ) {
+        hostname.erase( colon );
+    }
+
+    if ( not hostname.empty() and hostname.back() == '.' ) {
+        hostname.pop_back();
+    }
+
+    transform( hostname.begin(), hostname.end(), hostname.begin(),
+               [] ( const char c ) { return (c >= 'A' and c <= 'Z') ? c - 'A' + 'a' : c; } );
+
+    return hostname;
+}
+
+int NativeReplayServer::serve( const ReplayIndex & index )
+{
+    /* a client can go away in the middle of a reply */
+    signal( SIGPIPE, SIG_IGN );
+
+    /* threads don't survive a fork, so they start here rather than in the constructor */
+    vector< unique_ptr< ConnectionWorker > > workers;
+    for ( unsigned int i = 0; i < max( thread::hardware_concurrency(), 1u ); i++ ) {
+        workers.emplace_back( new ConnectionWorker(
+            [&index, this] ( TCPSocket && client, Epoller & epoller, const function<void()> & on_close ) {
+                return unique_ptr< ConnectionWorker::Connection >(
+                    new ReplayConnection( move( client ), server_context_, index, epoller, on_close ) );
+            } ) );
+    }
+
+    Epoller epoller;
+    size_t next_worker = 0;
+
+    for ( auto & listener : listeners_ ) {
+        epoller.add( listener, EPOLLIN,
+                     [&listener, &workers, &next_worker] ( const uint32_t ) {
+                         workers.at( next_worker )->add_connection( listener.accept() );
+                         next_worker = (next_worker + 1) % workers.size();
+                     } );
+    }
+
+    while ( true ) {
+        epoller.wait( -1 );
+    }
+}
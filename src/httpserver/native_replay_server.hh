@@ -0,0 +1,44 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef NATIVE_REPLAY_SERVER_HH
+#define NATIVE_REPLAY_SERVER_HH
+
+#include <vector>
+#include <set>
+#include <memory>
+
+#include "socket.hh"
+#include "secure_socket.hh"
+
+class ReplayIndex;
+
+/* the hostname Apache would have handed mod_deepcgi for a Host header (or
+   HTTP/2 :authority): lowercase, without port */
+std::string server_hostname( const std::string & host_header );
+
+/* one multi-threaded server for every recorded ip:port, in place of an
+   Apache instance per address. Port 443 is served over TLS, with HTTP/2
+   for clients that offer it with ALPN. Accepted connections are spread
+   over a fixed pool of worker threads, each answering its share (TLS
+   handshakes included) without blocking, with epoll. */
+class NativeReplayServer
+{
+private:
+    std::vector< TCPSocket > listeners_;
+    SSLContext server_context_;
+
+public:
+    /* binds every address, so call while privileged if any port is below 1024 */
+    NativeReplayServer( const std::set< Address > & addresses );
+
+    /* give HTTPS clients a certificate for each site, signed by authority */
+    void sign_certificates_with( const std::shared_ptr< CertificateAuthority > & authority )
+    {
+        server_context_.sign_certificates_with( authority );
+    }
+
+    /* accept and answer connections on every address; never returns */
+    int serve( const ReplayIndex & index );
+};
+
+#endif /* NATIVE_REPLAY_SERVER_HH */
@@ -0,0 +1,478 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <cerrno>
+#include <algorithm>
+
+#include "proxy_connection.hh"
+#include "upstream_pool.hh"
+#include "backing_store.hh"
+#include "epoller.hh"
+#include "exception.hh"
+#include "util.hh"
+
+using namespace std;
+
+/* most to read from a plain socket at a time */
+static const size_t READ_SIZE = 65536;
+
+ProxySocket::ProxySocket( TCPSocket && socket, const bool connecting )
+    : socket_( new TCPSocket( move( socket ) ) ),
+      tls_( nullptr ),
+      connecting_( connecting ),
+      handshaking_( false ),
+      hung_up_( false ),
+      tls_context_( nullptr ),
+      tls_host_name_(),
+      handshake_want_( SecureSocket::WANT_NOTHING ),
+      read_want_( SecureSocket::WANT_NOTHING ),
+      write_want_( SecureSocket::WANT_NOTHING ),
+      output_()
+{
+    socket_->set_blocking( false );
+    socket_->set_nodelay();
+}
+
+void ProxySocket::start_tls( SSLContext & context, const string & host_name )
+{
+    tls_context_ = &context;
+    tls_host_name_ = host_name;
+    handshaking_ = true;
+
+    if ( not connecting_ ) {
+        begin_tls();
+    }
+}
+
+void ProxySocket::begin_tls( void )
+{
+    unique_ptr< SecureSocket > tls( new SecureSocket( tls_context_->new_secure_socket( move( *socket_ ),
+                                                                                  tls_host_name_ ) ) );
+    tls->set_nonblocking();
+
+    /* same fd, so its epoll registration carries over */
+    tls_ = tls.get();
+    socket_ = move( tls );
+
+    handshake();
+}
+
+void ProxySocket::handshake( void )
+{
+    handshake_want_ = tls_->try_handshake();
+    handshaking_ = handshake_want_ != SecureSocket::WANT_NOTHING;
+}
+
+void ProxySocket::handle_events( const uint32_t events )
+{
+    if ( events & (EPOLLHUP | EPOLLERR) ) {
+        hung_up_ = true;
+    }
+
+    if ( connecting_ ) {
+        if ( not (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) ) {
+            return;
+        }
+
+        const int error = socket_->connect_error();
+        if ( error ) {
+            throw unix_error( "connect", error );
+        }
+
+        connecting_ = false;
+
+        if ( handshaking_ ) { /* TLS was waiting for the connection */
+            begin_tls();
+        }
+        return;
+    }
+
+    if ( handshaking_ ) {
+        handshake();
+    }
+}
+
+string ProxySocket::read( void )
+{
+    if ( not tls_ ) {
+        return socket_->read( READ_SIZE );
+    }
+
+    string data;
+    read_want_ = tls_->try_read( data );
+    return data;
+}
+
+void ProxySocket::write( void )
+{
+    if ( not ready() or output_.empty() ) {
+        return;
+    }
+
+    if ( tls_ ) {
+        write_want_ = tls_->try_write( output_ );
+        return;
+    }
+
+    auto written = output_.cbegin();
+    while ( written != output_.cend() ) {
+        const auto next = socket_->write( written, output_.cend() );
+        if ( next == written ) { /* socket buffer is full */
+            break;
+        }
+        written = next;
+    }
+
+    output_.erase( output_.cbegin(), written );
+}
+
+uint32_t ProxySocket::events( const bool reading ) const
+{
+    if ( connecting_ ) {
+        return EPOLLOUT;
+    }
+
+    if ( handshaking_ ) {
+        return handshake_want_ == SecureSocket::WANT_WRITE ? EPOLLOUT : EPOLLIN;
+    }
+
+    /* TLS can need to write in order to read, and vice versa */
+    uint32_t ret = 0;
+    if ( reading ) {
+        ret |= read_want_ == SecureSocket::WANT_WRITE ? EPOLLOUT : EPOLLIN;
+    }
+    if ( not output_.empty() ) {
+        ret |= write_want_ == SecureSocket::WANT_READ ? EPOLLIN : EPOLLOUT;
+    }
+    return ret;
+}
+
+bool ProxySocket::idle_and_open( void ) const
+{
+    char byte;
+    const ssize_t ret = ::recv( socket_->fd_num(), &byte, 1, MSG_PEEK | MSG_DONTWAIT );
+
+    /* anything else (data, EOF or an error) means it can't be reused */
+    return ret < 0 and (errno == EAGAIN or errno == EWOULDBLOCK);
+}
+
+static TCPSocket connect_nonblocking( const Address & address )
+{
+    TCPSocket socket;
+    socket.set_blocking( false );
+    socket.connect( address );
+    return socket;
+}
+
+/* will the server keep the connection open after this response? */
+static bool server_keeps_alive( const HTTPResponse & response )
+{
+    const bool http_1_0 = response.first_line().compare( 0, 8, "HTTP/1.0" ) == 0;
+
+    return not response.has_header_token( "Connection", "close" )
+        and not response.request().has_header_token( "Connection", "close" )
+        and (not http_1_0 or response.has_header_token( "Connection", "keep-alive" ));
+}
+
+ProxyConnection::ProxyConnection( TCPSocket && client, const Address & server_address, const bool https,
+                                  SSLContext & server_context, SSLContext & client_context,
+                                  HTTPBackingStore & backing_store,
+                                  Epoller & epoller, UpstreamPool & upstream_pool,
+                                  const function<void()> & on_close )
+    : backing_store_( backing_store ),
+      client_context_( client_context ),
+      epoller_( epoller ),
+      upstream_pool_( upstream_pool ),
+      on_close_( on_close ),
+      server_address_( server_address ),
+      https_( https ),
+      client_( move( client ), false ),
+      server_(),
+      upstream_pending_( https_ ),
+      upstream_reused_( false ),
+      upstream_answered_( 0 ),
+      upstream_keep_alive_( true ),
+      closed_( false )
+{
+    /* so the browser sees each response arrive as it does from the server */
+    response_parser_.forward_while_parsing();
+
+    if ( https_ ) {
+        client_.start_tls( server_context );
+    }
+
+    epoller_.add( client_.socket(), client_.events( client_may_read() ),
+                  [this] ( const uint32_t events ) { handle( true, events ); } );
+
+    try {
+        if ( not https_ ) {
+            choose_upstream();
+        } else if ( not upstream_pool_.has_idle( server_address_ ) ) {
+            /* connect while the client handshakes, unless a pooled connection is likely to do */
+            set_upstream( connect_upstream(), false );
+        }
+    } catch ( const exception & ) {
+        epoller_.remove( client_.socket() );
+        throw;
+    }
+}
+
+ProxyConnection::~ProxyConnection()
+{
+    if ( closed_ ) {
+        return;
+    }
+
+    try {
+        epoller_.remove( client_.socket() );
+        if ( server_ ) {
+            epoller_.remove( server_->socket() );
+        }
+    } catch ( const exception & e ) { /* don't throw from destructor */
+        print_exception( e );
+    }
+}
+
+unique_ptr< ProxySocket > ProxyConnection::connect_upstream( void )
+{
+    unique_ptr< ProxySocket > server( new ProxySocket( connect_nonblocking( server_address_ ), true ) );
+
+    /* TLS starts once connected, if the host name is known by then */
+    if ( https_ and not upstream_pending_ ) {
+        server->start_tls( client_context_, server_host_name_ );
+    }
+
+    return server;
+}
+
+void ProxyConnection::set_upstream( unique_ptr< ProxySocket > && server, const bool reused )
+{
+    if ( server_ ) {
+        epoller_.remove( server_->socket() );
+    }
+
+    server_ = move( server );
+    upstream_reused_ = reused;
+    upstream_answered_ = 0;
+    upstream_keep_alive_ = true;
+
+    epoller_.add( server_->socket(), server_->events( server_may_read() ),
+                  [this] ( const uint32_t events ) { handle( false, events ); } );
+}
+
+void ProxyConnection::choose_upstream( void )
+{
+    UpstreamPool::Connection pooled = upstream_pool_.take( UpstreamPool::key( server_address_, server_host_name_ ) );
+
+    if ( pooled ) {
+        set_upstream( move( pooled ), true );
+    } else if ( server_ ) { /* HTTPS, connected in advance */
+        server_->start_tls( client_context_, server_host_name_ );
+    } else {
+        set_upstream( connect_upstream(), false );
+    }
+}
+
+bool ProxyConnection::resend_in_flight( void )
+{
+    /* a pooled connection the server had already closed never saw the
+       requests. Otherwise only idempotent requests can be repeated, and only
+       if the connection answered something (or this could be a server that
+       refuses them, over and over). */
+    const bool safe = upstream_reused_
+        or (upstream_answered_ > 0
+            and all_of( in_flight_.begin(), in_flight_.end(),
+                        [] ( const InFlightRequest & request ) { return request.idempotent; } ));
+
+    /* part of a response that's gone to the client can't be taken back */
+    if ( in_flight_.empty() or not safe or not response_parser_.between_messages() ) {
+        return false;
+    }
+
+    set_upstream( connect_upstream(), false );
+    for ( const auto & request : in_flight_ ) {
+        server_->output().append( request.serialized );
+    }
+
+    return true;
+}
+
+/* backpressure: a side is only read while the other can take what it sends,
+   except once it has hung up, since then what's left is bounded by the
+   socket buffer (and epoll would otherwise keep reporting the hangup) */
+bool ProxyConnection::client_may_read( void ) const
+{
+    return client_.ready() and not client_.eof()
+        and (client_.hung_up()
+             or (request_parser_.empty() and (not server_ or server_->output().size() < OUTPUT_LIMIT)));
+}
+
+bool ProxyConnection::server_may_read( void ) const
+{
+    return server_ and server_->ready() and not server_->eof()
+        and (server_->hung_up() or client_.output().size() < OUTPUT_LIMIT);
+}
+
+/* pipelining: requests follow each other upstream without waiting for
+   their responses, up to a point. One that can't be repeated goes alone,
+   since if the connection fails it's unknown whether the server saw it. */
+bool ProxyConnection::may_send( const HTTPRequest & request ) const
+{
+    if ( in_flight_.empty() ) {
+        return true;
+    }
+
+    return in_flight_.size() < MAX_PIPELINE_DEPTH
+        and upstream_keep_alive_ and not server_->eof()
+        and in_flight_.back().idempotent and request.is_idempotent();
+}
+
+void ProxyConnection::handle( const bool from_client, const uint32_t events )
+{
+    try {
+        if ( from_client ) {
+            client_.handle_events( events );
+        } else {
+            try {
+                server_->handle_events( events );
+            } catch ( const exception & ) {
+                if ( not resend_in_flight() ) {
+                    throw;
+                }
+            }
+        }
+
+        pump();
+
+        if ( not finished() ) {
+            epoller_.modify( client_.socket(), client_.events( client_may_read() ) );
+            if ( server_ ) {
+                epoller_.modify( server_->socket(), server_->events( server_may_read() ) );
+            }
+            return;
+        }
+    } catch ( const exception & e ) {
+        print_exception( e );
+        close( false );
+        return;
+    }
+
+    close( true );
+}
+
+void ProxyConnection::pump( void )
+{
+    /* requests from client go to request parser (an empty string tells it about EOF) */
+    if ( client_may_read() ) {
+        const string buffer = client_.read();
+        if ( not buffer.empty() or client_.eof() ) {
+            request_parser_.parse( buffer );
+        }
+    }
+
+    /* responses from server go to response parser, and on to client as they're parsed */
+    if ( server_may_read() ) {
+        string buffer;
+        try {
+            buffer = server_->read();
+        } catch ( const exception & ) {
+            if ( not resend_in_flight() ) {
+                throw;
+            }
+        }
+
+        if ( not buffer.empty() ) { /* too late to resend as if the connection had been stale */
+            upstream_reused_ = false;
+        }
+
+        if ( not buffer.empty() or server_->eof() ) {
+            response_parser_.parse( buffer );
+            response_parser_.take_forwarded( client_.output() );
+        }
+    }
+
+    /* completed responses from server are saved (interim ones are only passed on) */
+    while ( not response_parser_.empty() ) {
+        const HTTPResponse & response = response_parser_.front();
+        if ( not response.is_interim() ) {
+            upstream_keep_alive_ = server_keeps_alive( response );
+            backing_store_.save( response, server_address_ );
+            in_flight_.pop_front();
+            upstream_answered_++;
+        }
+        response_parser_.pop();
+    }
+
+    /* the server closed with requests unanswered */
+    if ( server_ and server_->eof() and not in_flight_.empty() ) {
+        resend_in_flight();
+    }
+
+    /* completed requests from client are serialized and queued for server,
+       on a new connection if the server has closed (or said it will) */
+    while ( not request_parser_.empty() and may_send( request_parser_.front() ) ) {
+        const HTTPRequest & request = request_parser_.front();
+        string serialized = request.str();
+
+        if ( upstream_pending_ ) {
+            server_host_name_ = get_host_name( serialized );
+            upstream_pending_ = false;
+            choose_upstream();
+        } else if ( in_flight_.empty() and (server_->eof() or not upstream_keep_alive_) ) {
+            set_upstream( connect_upstream(), false );
+        }
+
+        server_->output().append( serialized );
+        response_parser_.new_request_arrived( request );
+        in_flight_.push_back( { move( serialized ), request.is_idempotent() } );
+        request_parser_.pop();
+    }
+
+    if ( server_ ) {
+        try {
+            server_->write();
+        } catch ( const exception & ) {
+            if ( not resend_in_flight() ) {
+                throw;
+            }
+        }
+    }
+
+    client_.write();
+}
+
+bool ProxyConnection::finished( void ) const
+{
+    /* the client is gone, or has stopped sending and has every answer; or
+       the server is gone (with nothing that could be resent) and the client
+       has everything it was sent */
+    return client_.hung_up()
+        or (client_.eof() and request_parser_.empty() and in_flight_.empty() and client_.output().empty())
+        or (server_ and server_->eof() and client_.output().empty());
+}
+
+bool ProxyConnection::upstream_reusable( void ) const
+{
+    return server_ and not upstream_pending_
+        and server_->ready() and not server_->eof() and not server_->hung_up()
+        and server_->output().empty()
+        and response_parser_.all_answered() and upstream_keep_alive_;
+}
+
+void ProxyConnection::close( const bool clean )
+{
+    closed_ = true;
+
+    epoller_.remove( client_.socket() );
+
+    if ( server_ ) {
+        epoller_.remove( server_->socket() );
+
+        if ( clean and upstream_reusable() ) {
+            upstream_pool_.put( UpstreamPool::key( server_address_, server_host_name_ ), move( server_ ) );
+        }
+    }
+
+    on_close_();
+}
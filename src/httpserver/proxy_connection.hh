@@ -0,0 +1,190 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef PROXY_CONNECTION_HH
+#define PROXY_CONNECTION_HH
+
+#include <string>
+#include <deque>
+#include <memory>
+#include <cstdint>
+#include <functional>
+
+#include "socket.hh"
+#include "secure_socket.hh"
+#include "http_request_parser.hh"
+#include "http_response_parser.hh"
+#include "connection_worker.hh"
+
+class HTTPBackingStore;
+class UpstreamPool;
+class Epoller;
+
+/* one end of a proxied (or replayed) connection, plain TCP or TLS, in
+   non-blocking mode. What TLS is waiting on (SecureSocket::Want) becomes
+   the epoll interest, so a handshake, read or write that can't finish yet
+   picks up where it left off once the socket is ready. */
+class ProxySocket
+{
+private:
+    std::unique_ptr< TCPSocket > socket_;
+    SecureSocket * tls_; /* socket_, once it speaks TLS */
+
+    bool connecting_, handshaking_, hung_up_;
+
+    /* TLS asked for while still connecting, to start once connected */
+    SSLContext * tls_context_;
+    std::string tls_host_name_;
+
+    /* what the last TLS handshake, read and write were waiting on */
+    SecureSocket::Want handshake_want_, read_want_, write_want_;
+
+    /* bytes waiting to be written */
+    std::string output_;
+
+    void begin_tls( void );
+    void handshake( void );
+
+public:
+    /* connecting: a non-blocking connect() is in progress */
+    ProxySocket( TCPSocket && socket, const bool connecting );
+
+    /* wrap the socket in TLS (with SNI and resumption, for clients) and start the handshake,
+       or start it once connected if connect() is still in progress */
+    void start_tls( SSLContext & context, const std::string & host_name = "" );
+
+    /* carry on connecting or handshaking after epoll reported these events */
+    void handle_events( const uint32_t events );
+
+    /* whatever has arrived (empty if nothing yet, or at eof) */
+    std::string read( void );
+
+    /* write as much of the output as the socket will take now */
+    void write( void );
+
+    /* epoll events to wait for, given whether the caller wants to read */
+    uint32_t events( const bool reading ) const;
+
+    bool ready( void ) const { return not connecting_ and not handshaking_; }
+
+    /* TLS: the protocol agreed on with ALPN, once ready */
+    std::string alpn_protocol( void ) const { return tls_ ? tls_->alpn_protocol() : std::string(); }
+    bool connecting( void ) const { return connecting_; }
+    bool eof( void ) const { return socket_->eof(); }
+
+    /* the peer has closed or reset the connection, so what's left to read is bounded */
+    bool hung_up( void ) const { return hung_up_; }
+
+    std::string & output( void ) { return output_; }
+    const std::string & output( void ) const { return output_; }
+
+    const TCPSocket & socket( void ) const { return *socket_; }
+    TCPSocket & socket( void ) { return *socket_; }
+
+    /* for a connection with nothing in flight: has the peer sent nothing,
+       including a close, since it went idle? */
+    bool idle_and_open( void ) const;
+
+    /* ban copying */
+    ProxySocket( const ProxySocket & other ) = delete;
+    ProxySocket & operator=( const ProxySocket & other ) = delete;
+};
+
+/* a client connection and the connection to its original destination,
+   proxied without blocking by a ConnectionWorker. The upstream connection
+   comes from the pool when there's a suitable one, and goes back to it
+   afterwards if it can be reused. Requests are pipelined to the server,
+   a bounded number at a time. */
+class ProxyConnection : public ConnectionWorker::Connection
+{
+private:
+    HTTPBackingStore & backing_store_;
+    SSLContext & client_context_;
+    Epoller & epoller_;
+    UpstreamPool & upstream_pool_;
+    const std::function<void()> on_close_;
+
+    const Address server_address_;
+    const bool https_;
+
+    ProxySocket client_;
+    std::unique_ptr< ProxySocket > server_;
+
+    HTTPRequestParser request_parser_ {};
+    HTTPResponseParser response_parser_ {};
+
+    /* HTTPS: the upstream connection is picked once a request names the host for SNI */
+    bool upstream_pending_;
+    std::string server_host_name_ {};
+
+    /* requests queued or sent upstream that don't have their whole
+       response yet, oldest first, kept so they can be sent again */
+    struct InFlightRequest
+    {
+        std::string serialized;
+        bool idempotent;
+    };
+    std::deque< InFlightRequest > in_flight_ {};
+
+    /* the upstream connection came from the pool and hasn't sent anything yet,
+       so if it turns out the server closed it, the requests can be resent */
+    bool upstream_reused_;
+
+    /* responses completed on the upstream connection */
+    unsigned int upstream_answered_;
+
+    /* did the last response leave the upstream connection open for another? */
+    bool upstream_keep_alive_;
+
+    bool closed_;
+
+    /* move data along as far as it will go */
+    void pump( void );
+
+    bool client_may_read( void ) const;
+    bool server_may_read( void ) const;
+
+    /* can this request go upstream now, behind the ones in flight? */
+    bool may_send( const HTTPRequest & request ) const;
+
+    void handle( const bool from_client, const uint32_t events );
+
+    /* use a pooled connection if there is one, otherwise connect */
+    void choose_upstream( void );
+    void set_upstream( std::unique_ptr< ProxySocket > && server, const bool reused );
+    std::unique_ptr< ProxySocket > connect_upstream( void );
+
+    /* the upstream connection failed or closed with requests in flight:
+       send them again on a new one, if that's safe */
+    bool resend_in_flight( void );
+
+    /* can the upstream connection go back in the pool? */
+    bool upstream_reusable( void ) const;
+
+    /* nothing more to do, so close both sockets */
+    bool finished( void ) const;
+
+    /* unregister and tell the owner; clean: the upstream may be pooled */
+    void close( const bool clean );
+
+public:
+    /* stop reading from one side while this much is waiting to be written to the other */
+    static const size_t OUTPUT_LIMIT = 1024 * 1024;
+
+    /* most pipelined requests to have in flight to the server at once */
+    static const size_t MAX_PIPELINE_DEPTH = 8;
+
+    /* server_address is where the client was headed; https says to speak TLS to both */
+    ProxyConnection( TCPSocket && client, const Address & server_address, const bool https,
+                     SSLContext & server_context, SSLContext & client_context,
+                     HTTPBackingStore & backing_store,
+                     Epoller & epoller, UpstreamPool & upstream_pool,
+                     const std::function<void()> & on_close );
+
+    ~ProxyConnection() override;
+
+    /* ban copying */
+    ProxyConnection( const ProxyConnection & other ) = delete;
+    ProxyConnection & operator=( const ProxyConnection & other ) = delete;
+};
+
+#endif /* PROXY_CONNECTION_HH */
@@ -0,0 +1,216 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <sys/epoll.h>
+
+#include "replay_connection.hh"
+#include "native_replay_server.hh"
+#include "http2_replay_session.hh"
+#include "replay_index.hh"
+#include "http_response.hh"
+#include "epoller.hh"
+#include "tokenize.hh"
+#include "exception.hh"
+
+using namespace std;
+
+ReplayConnection::ReplayConnection( TCPSocket && client, SSLContext & server_context, const ReplayIndex & index,
+                                    Epoller & epoller, const function<void()> & on_close )
+    : index_( index ),
+      epoller_( epoller ),
+      on_close_( on_close ),
+      https_( client.local_address().port() == 443 ),
+      client_( move( client ), false ),
+      protocol_chosen_( not https_ ),
+      http2_(),
+      reply_(),
+      reply_sent_( 0 ),
+      keep_alive_( true ),
+      closed_( false )
+{
+    if ( https_ ) {
+        /* a quick client can finish the handshake before we get here */
+        client_.start_tls( server_context );
+        choose_protocol();
+    }
+
+    epoller_.add( client_.socket(), events(), [this] ( const uint32_t events ) { handle( events ); } );
+}
+
+ReplayConnection::~ReplayConnection()
+{
+    if ( closed_ ) {
+        return;
+    }
+
+    try {
+        epoller_.remove( client_.socket() );
+    } catch ( const exception & e ) { /* don't throw from destructor */
+        print_exception( e );
+    }
+}
+
+/* can the client find the end of this response without the connection closing? */
+static bool self_delimiting( const HTTPResponse & response, const HTTPRequest & request )
+{
+    const string status_line = response.first_line();
+    const auto tokens = split( status_line, " " );
+    const string status = tokens.size() > 1 ? tokens.at( 1 ) : "";
+
+    return request.is_head()
+        or (not status.empty() and status.front() == '1')
+        or status == "204" or status == "304"
+        or response.has_header( "Content-Length" )
+        or response.has_header_token( "Transfer-Encoding", "chunked" );
+}
+
+void ReplayConnection::respond( const HTTPRequest & request )
+{
+    const bool has_host = request.has_header( "Host" );
+    const MahimahiProtobufs::ReplayIndexEntry * const best_match
+        = index_.best_match( https_,
+                             has_host, has_host ? server_hostname( request.get_header_value( "Host" ) ) : "",
+                             request.first_line() );
+
+    if ( not best_match ) {
+        client_.output().append( not_found_reply() );
+        return;
+    }
+
+    unique_ptr< ReplayResponse > reply( new ReplayResponse( index_.response( *best_match ) ) );
+    const HTTPResponse & response = reply->head();
+
+    const bool http_1_0 = request.first_line().size() >= 8
+        and request.first_line().substr( request.first_line().size() - 8 ) == "HTTP/1.0";
+
+    keep_alive_ = self_delimiting( response, request )
+        and not response.has_header_token( "Connection", "close" )
+        and not request.has_header_token( "Connection", "close" )
+        and (not http_1_0 or request.has_header_token( "Connection", "keep-alive" ));
+
+    if ( https_ ) { /* TLS has to see the bytes to encrypt them */
+        client_.output().append( reply->str() );
+    } else {
+        reply_ = move( reply );
+        reply_sent_ = 0;
+    }
+}
+
+bool ReplayConnection::may_read( void ) const
+{
+    return client_.ready() and not client_.eof() and protocol_chosen_
+        and client_.output().size() < OUTPUT_LIMIT
+        and (http2_ or (keep_alive_ and not reply_ and request_parser_.empty()));
+}
+
+uint32_t ReplayConnection::events( void ) const
+{
+    /* the body of a plain reply doesn't pass through the output buffer */
+    return client_.events( may_read() )
+        | (reply_ and client_.ready() and client_.output().empty() ? uint32_t( EPOLLOUT ) : 0);
+}
+
+void ReplayConnection::choose_protocol( void )
+{
+    if ( protocol_chosen_ or not client_.ready() ) {
+        return;
+    }
+
+    protocol_chosen_ = true;
+    if ( client_.alpn_protocol() == "h2" ) {
+        http2_.reset( new HTTP2ReplaySession( index_ ) );
+    }
+}
+
+void ReplayConnection::pump( void )
+{
+    choose_protocol();
+
+    if ( may_read() ) {
+        const string buffer = client_.read();
+        if ( http2_ ) {
+            if ( not buffer.empty() ) {
+                http2_->receive( buffer );
+            }
+        } else if ( not buffer.empty() or client_.eof() ) { /* an empty string tells the parser about EOF */
+            request_parser_.parse( buffer );
+        }
+    }
+
+    if ( http2_ ) {
+        /* until the socket is full, or nghttp2 has nothing more it may send */
+        while ( true ) {
+            const size_t queued = client_.output().size();
+            http2_->send( client_.output(), OUTPUT_LIMIT );
+            const bool sent_more = client_.output().size() > queued;
+            client_.write();
+
+            if ( not sent_more or not client_.output().empty() ) {
+                return;
+            }
+        }
+    }
+
+    /* answer what has arrived until the socket is full */
+    do {
+        /* one reply at a time, in order, so a plain reply's body can follow its head */
+        while ( keep_alive_ and not reply_ and client_.output().size() < OUTPUT_LIMIT
+                and not request_parser_.empty() ) {
+            respond( request_parser_.front() );
+            request_parser_.pop();
+        }
+
+        client_.write();
+
+        if ( reply_ and client_.ready() and client_.output().empty() ) {
+            while ( reply_sent_ < reply_->size() ) {
+                const uint64_t sent = reply_->write_some( client_.socket(), reply_sent_ );
+                if ( sent == reply_sent_ ) { /* socket buffer is full */
+                    break;
+                }
+                reply_sent_ = sent;
+            }
+
+            if ( reply_sent_ == reply_->size() ) {
+                reply_.reset();
+            }
+        }
+    } while ( keep_alive_ and not reply_ and client_.output().empty() and not request_parser_.empty() );
+}
+
+bool ReplayConnection::finished( void ) const
+{
+    if ( not client_.output().empty() or reply_ ) {
+        return false;
+    }
+
+    if ( http2_ ) {
+        return client_.eof() or http2_->finished();
+    }
+
+    /* requests the client sent before closing its side are still answered */
+    return not keep_alive_ or (client_.eof() and request_parser_.empty());
+}
+
+void ReplayConnection::handle( const uint32_t events )
+{
+    try {
+        client_.handle_events( events );
+        pump();
+
+        if ( not finished() ) {
+            epoller_.modify( client_.socket(), this->events() );
+            return;
+        }
+    } catch ( const exception & e ) {
+        print_exception( e );
+    }
+
+    close();
+}
+
+void ReplayConnection::close( void )
+{
+    closed_ = true;
+    epoller_.remove( client_.socket() );
+    on_close_();
+}
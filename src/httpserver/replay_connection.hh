@@ -0,0 +1,82 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef REPLAY_CONNECTION_HH
+#define REPLAY_CONNECTION_HH
+
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <functional>
+
+#include "proxy_connection.hh"
+#include "connection_worker.hh"
+#include "http_request_parser.hh"
+
+class ReplayIndex;
+class ReplayResponse;
+class HTTP2ReplaySession;
+class SSLContext;
+class Epoller;
+
+/* one client connection to the native replay server, answered without
+   blocking by a ConnectionWorker: HTTP/1.1 over plain TCP or TLS, or
+   HTTP/2 if the client offers it with ALPN. Port 443 is served over TLS. */
+class ReplayConnection : public ConnectionWorker::Connection
+{
+private:
+    const ReplayIndex & index_;
+    Epoller & epoller_;
+    const std::function<void()> on_close_;
+
+    const bool https_;
+    ProxySocket client_;
+
+    HTTPRequestParser request_parser_ {};
+
+    /* TLS: the protocol is settled once the handshake is done */
+    bool protocol_chosen_;
+    std::unique_ptr< HTTP2ReplaySession > http2_;
+
+    /* plain HTTP: the reply being sent (its body straight from the
+       recording, with sendfile()), and how much of it has gone */
+    std::unique_ptr< ReplayResponse > reply_;
+    uint64_t reply_sent_;
+
+    /* did the last reply leave the connection open for another request? */
+    bool keep_alive_;
+
+    bool closed_;
+
+    /* TLS: start HTTP/2 if the client asked for it, once the handshake is done */
+    void choose_protocol( void );
+
+    /* queue the reply to a request */
+    void respond( const HTTPRequest & request );
+
+    /* move data along as far as it will go */
+    void pump( void );
+
+    bool may_read( void ) const;
+    uint32_t events( void ) const;
+
+    /* everything owed to the client has been sent, and no more is coming */
+    bool finished( void ) const;
+
+    void handle( const uint32_t events );
+    void close( void );
+
+public:
+    /* stop reading requests while this much is waiting to be written */
+    static const size_t OUTPUT_LIMIT = 1024 * 1024;
+
+    ReplayConnection( TCPSocket && client, SSLContext & server_context, const ReplayIndex & index,
+                      Epoller & epoller, const std::function<void()> & on_close );
+
+    ~ReplayConnection() override;
+
+    /* ban copying */
+    ReplayConnection( const ReplayConnection & other ) = delete;
+    ReplayConnection & operator=( const ReplayConnection & other ) = delete;
+};
+
+#endif /* REPLAY_CONNECTION_HH */
@@ -1,11 +1,15 @@
 /* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
 #include <cassert>
+#include <climits>
+#include <algorithm>
 #include <vector>
+#include <map>
 #include <thread>
 #include <mutex>
 
 #include "secure_socket.hh"
+#include "certificate_authority.hh"
 #include "certificate.hh"
 #include "exception.hh"
 #include "util.hh"
@@ -87,9 +91,81 @@ SSL_CTX *initialize_new_context(const SSL_MODE type)
     return ret;
 }
 
+/* clients: the most recent session with each server name, so the next
+   connection to it can resume (with a ticket or session ID) and skip the
+   full handshake. Shared by every thread using the context. */
+class SessionCache
+{
+private:
+    struct SESSION_deleter { void operator()( SSL_SESSION * x ) const { SSL_SESSION_free( x ); } };
+
+    mutex mutex_ {};
+    map< string, unique_ptr<SSL_SESSION, SESSION_deleter> > sessions_ {};
+
+public:
+    /* takes ownership of the session */
+    void put( const string & host_name, SSL_SESSION * session )
+    {
+        unique_lock<mutex> lock( mutex_ );
+        sessions_[ host_name ].reset( session );
+    }
+
+    void resume( SSL * ssl, const string & host_name )
+    {
+        unique_lock<mutex> lock( mutex_ );
+        const auto session = sessions_.find( host_name );
+        if ( session == sessions_.end() or not SSL_SESSION_is_resumable( session->second.get() ) )
+        {
+            return;
+        }
+
+        /* a copy, so the connection can't spoil ours (see new_session) */
+        SSL_SESSION * const copy = SSL_SESSION_dup( session->second.get() );
+        if ( copy )
+        {
+            SSL_set_session( ssl, copy );
+            SSL_SESSION_free( copy );
+        }
+    }
+};
+
+/* where an SSL_CTX keeps its SessionCache */
+static int session_cache_index(void)
+{
+    static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+/* OpenSSL hands over each new session (TLS 1.3 sends them after the handshake) */
+static int new_session(SSL *ssl, SSL_SESSION *session)
+{
+    const char *host_name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (not host_name)
+    {
+        return 0; /* nothing to resume it by */
+    }
+
+    /* keep a copy: OpenSSL marks the connection's own session unresumable
+       if the connection is freed without a close_notify, as ours often are */
+    SSL_SESSION *copy = SSL_SESSION_dup(session);
+    if (copy)
+    {
+        static_cast<SessionCache *>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), session_cache_index()))
+            ->put(host_name, copy);
+    }
+    return 0; /* not keeping the original */
+}
+
 SSLContext::SSLContext(const SSL_MODE type)
-    : ctx_(initialize_new_context(type))
+    : ctx_(initialize_new_context(type)),
+      authority_(),
+      sessions_()
 {
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* treat a peer closing TCP without close_notify as a clean EOF, as OpenSSL 1.1 did */
+    SSL_CTX_set_options(ctx_.get(), SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
     if (type == SERVER)
     {
         if ( not SSL_CTX_use_certificate_ASN1( ctx_.get(), 678, certificate ) )
@@ -108,6 +184,59 @@ SSLContext::SSLContext(const SSL_MODE type)
             throw ssl_error("SSL_CTX_check_private_key");
         }
     }
+    else
+    {
+        /* keep sessions ourselves, by server name rather than address */
+        sessions_ = make_shared<SessionCache>();
+        SSL_CTX_set_session_cache_mode(ctx_.get(), SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx_.get(), new_session);
+        SSL_CTX_set_ex_data(ctx_.get(), session_cache_index(), sessions_.get());
+    }
+}
+
+/* ALPN protocol list in wire format (length-prefixed), most preferred first */
+static const unsigned char http2_protocols[] = { 2, 'h', '2', 8, 'h', 't', 't', 'p', '/', '1', '.', '1' };
+
+static int select_http2(SSL *, const unsigned char **out, unsigned char *outlen,
+                        const unsigned char *in, unsigned int inlen, void *)
+{
+    unsigned char *selected;
+    if (SSL_select_next_proto(&selected, outlen, http2_protocols, sizeof(http2_protocols), in, inlen)
+        != OPENSSL_NPN_NEGOTIATED)
+    {
+        return SSL_TLSEXT_ERR_NOACK; /* carry on without ALPN, i.e. HTTP/1.1 */
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+void SSLContext::offer_http2(void)
+{
+    SSL_CTX_set_alpn_select_cb(ctx_.get(), select_http2, nullptr);
+}
+
+static int choose_certificate(SSL *ssl, int *, void *authority)
+{
+    const char *host_name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (host_name)
+    {
+        try
+        {
+            static_cast<CertificateAuthority *>(authority)->use_certificate(ssl, host_name);
+        }
+        catch (const exception &e)
+        { /* carry on with the built-in certificate */
+            print_exception(e);
+        }
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+void SSLContext::sign_certificates_with(const shared_ptr<CertificateAuthority> &authority)
+{
+    authority_ = authority;
+    SSL_CTX_set_tlsext_servername_callback(ctx_.get(), choose_certificate);
+    SSL_CTX_set_tlsext_servername_arg(ctx_.get(), authority_.get());
 }
 
 SecureSocket::SecureSocket(TCPSocket &&sock, SSL *ssl)
@@ -135,6 +264,22 @@ SecureSocket SSLContext::new_secure_socket(TCPSocket &&sock)
                         SSL_new(ctx_.get()));
 }
 
+SecureSocket SSLContext::new_secure_socket(TCPSocket &&sock, const string &host_name)
+{
+    SecureSocket ret = new_secure_socket(move(sock));
+
+    if (not host_name.empty())
+    {
+        ret.set_host_name(host_name.c_str());
+        if (sessions_)
+        {
+            sessions_->resume(ret.ssl_.get(), host_name);
+        }
+    }
+
+    return ret;
+}
+
 void SecureSocket::set_host_name(const char *hostname)
 {
     SSL_set_tlsext_host_name(ssl_.get(), hostname);
@@ -145,6 +290,14 @@ bool SecureSocket::is_connected(void)
     return isConnected;
 }
 
+string SecureSocket::alpn_protocol(void) const
+{
+    const unsigned char *protocol;
+    unsigned int length;
+    SSL_get0_alpn_selected(ssl_.get(), &protocol, &length);
+    return protocol ? string(reinterpret_cast<const char *>(protocol), length) : string();
+}
+
 void SecureSocket::connect(void)
 {
     if (not SSL_connect(ssl_.get()))
@@ -239,3 +392,95 @@ void SecureSocket::write(const string &message)
 
     register_write();
 }
+
+SecureSocket::Want SecureSocket::want(const string &attempt, const int ret)
+{
+    switch (SSL_get_error(ssl_.get(), ret))
+    {
+    case SSL_ERROR_WANT_READ:
+        return WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+        return WANT_WRITE;
+    case SSL_ERROR_SYSCALL:
+        if (ERR_peek_error() == 0)
+        {
+            throw unix_error(attempt);
+        }
+        throw ssl_error(attempt);
+    default:
+        throw ssl_error(attempt);
+    }
+}
+
+void SecureSocket::set_nonblocking(void)
+{
+    set_blocking(false);
+
+    /* let SSL_write() finish a record at a time, and retry from a buffer that has since moved */
+    SSL_set_mode(ssl_.get(), SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+}
+
+SecureSocket::Want SecureSocket::try_handshake(void)
+{
+    const int ret = SSL_is_server(ssl_.get()) ? SSL_accept(ssl_.get()) : SSL_connect(ssl_.get());
+    if (ret == 1)
+    {
+        isConnected = true;
+        return WANT_NOTHING;
+    }
+
+    return want(SSL_is_server(ssl_.get()) ? "SSL_accept" : "SSL_connect", ret);
+}
+
+SecureSocket::Want SecureSocket::try_read(string &buffer)
+{
+    /* SSL record max size is 16kB */
+    char record[16384];
+
+    do
+    {
+        const int bytes_read = SSL_read(ssl_.get(), record, sizeof(record));
+        if (bytes_read > 0)
+        {
+            register_read();
+            buffer.append(record, bytes_read);
+            continue;
+        }
+
+        const int error = SSL_get_error(ssl_.get(), bytes_read);
+        if (error == SSL_ERROR_ZERO_RETURN
+            or (error == SSL_ERROR_SYSCALL and bytes_read == 0 and ERR_peek_error() == 0))
+        { /* clean SSL close, or the TCP connection closed under it */
+            register_read();
+            set_eof();
+            return WANT_NOTHING;
+        }
+
+        return want("SSL_read", bytes_read);
+    } while (SSL_pending(ssl_.get()) > 0);
+
+    return WANT_NOTHING;
+}
+
+SecureSocket::Want SecureSocket::try_write(string &buffer)
+{
+    size_t written = 0;
+    Want ret = WANT_NOTHING;
+
+    while (written < buffer.size())
+    {
+        const int length = min(buffer.size() - written, size_t(INT_MAX));
+        const int bytes_written = SSL_write(ssl_.get(), buffer.data() + written, length);
+        if (bytes_written <= 0)
+        {
+            ret = want("SSL_write", bytes_written);
+            break;
+        }
+
+        register_write();
+        written += bytes_written;
+    }
+
+    buffer.erase(0, written);
+    return ret;
+}
@@ -8,10 +8,15 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+#include <memory>
+
 #include "socket.hh"
 
 enum SSL_MODE { CLIENT, SERVER };
 
+class CertificateAuthority;
+class SessionCache;
+
 class SecureSocket : public TCPSocket
 {
     friend class SSLContext;
@@ -24,14 +29,40 @@ private:
 
     SecureSocket( TCPSocket && sock, SSL * ssl );
 
+public:
+    /* what a non-blocking TLS operation is waiting on before it can continue */
+    enum Want { WANT_NOTHING, WANT_READ, WANT_WRITE };
+
+private:
+    /* what a failed non-blocking SSL call is waiting on; throws if it really failed */
+    Want want( const std::string & attempt, const int ret );
+
 public:
     void set_host_name(const char * hostname);
     void connect( void );
     void accept( void );
     bool is_connected( void );
 
+    /* protocol agreed on with ALPN during the handshake, or empty if none */
+    std::string alpn_protocol( void ) const;
+
     std::string read( void );
     void write( const std::string & message );
+
+    /* non-blocking mode, for event loops that multiplex many connections.
+       Instead of waiting on the socket, these return what the connection
+       needs before it can go on, and expect to be called again once the
+       socket is ready for it. */
+    void set_nonblocking( void );
+
+    /* accept() or connect(), according to the context's mode */
+    Want try_handshake( void );
+
+    /* append whatever the peer has sent to buffer (or set eof()) */
+    Want try_read( std::string & buffer );
+
+    /* write as much of buffer as possible, and erase what was written */
+    Want try_write( std::string & buffer );
 };
 
 class SSLContext
@@ -41,10 +72,26 @@ private:
     typedef std::unique_ptr<SSL_CTX, CTX_deleter> CTX_handle;
     CTX_handle ctx_;
 
+    /* servers: signs a certificate for each SNI host name, if set */
+    std::shared_ptr< CertificateAuthority > authority_;
+
+    /* clients: the latest session with each SNI host name, to resume */
+    std::shared_ptr< SessionCache > sessions_;
+
 public:
     SSLContext( const SSL_MODE type );
 
+    /* servers: agree to HTTP/2 ("h2") if the client offers it, else HTTP/1.1 */
+    void offer_http2( void );
+
+    /* servers: present a certificate for the host name the client asks
+       for with SNI, signed by authority, instead of the built-in one */
+    void sign_certificates_with( const std::shared_ptr< CertificateAuthority > & authority );
+
     SecureSocket new_secure_socket( TCPSocket && sock );
+
+    /* clients: set SNI to host_name, and resume the last session with it if there is one */
+    SecureSocket new_secure_socket( TCPSocket && sock, const std::string & host_name );
 };
 
 #endif
@@ -0,0 +1,105 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "upstream_pool.hh"
+
+using namespace std;
+using namespace std::chrono;
+
+const unsigned int UpstreamPool::IDLE_TIMEOUT_SECONDS;
+
+/* sweep every key for expired connections once per this many check-ins */
+static const unsigned int SWEEP_INTERVAL = 64;
+
+static bool expired( const steady_clock::time_point & idle_since, const steady_clock::time_point & now )
+{
+    return now - idle_since >= seconds( UpstreamPool::IDLE_TIMEOUT_SECONDS );
+}
+
+string UpstreamPool::key( const Address & server, const string & host_name )
+{
+    return server.str() + " " + host_name;
+}
+
+UpstreamPool::Connection UpstreamPool::take( const string & key )
+{
+    const auto now = steady_clock::now();
+
+    /* connections that have gone stale are closed once the lock is released */
+    vector< Connection > stale;
+    Connection ret;
+
+    {
+        unique_lock<mutex> lock( mutex_ );
+
+        auto entry = idle_.find( key );
+        if ( entry == idle_.end() ) {
+            return nullptr;
+        }
+
+        /* most recently used first, since it's the least likely to have timed out */
+        auto & connections = entry->second;
+        while ( not connections.empty() ) {
+            IdleConnection idle = move( connections.back() );
+            connections.pop_back();
+
+            if ( not expired( idle.idle_since, now ) and idle.connection->idle_and_open() ) {
+                ret = move( idle.connection );
+                break;
+            }
+
+            stale.emplace_back( move( idle.connection ) );
+        }
+
+        if ( connections.empty() ) {
+            idle_.erase( entry );
+        }
+    }
+
+    return ret;
+}
+
+void UpstreamPool::put( const string & key, Connection && connection )
+{
+    const auto now = steady_clock::now();
+    Connection evicted;
+
+    unique_lock<mutex> lock( mutex_ );
+
+    auto & connections = idle_[ key ];
+    if ( connections.size() >= MAX_IDLE_PER_KEY ) {
+        evicted = move( connections.front().connection );
+        connections.pop_front();
+    }
+    connections.push_back( { move( connection ), now } );
+
+    if ( ++puts_since_sweep_ >= SWEEP_INTERVAL ) {
+        puts_since_sweep_ = 0;
+        sweep( now );
+    }
+}
+
+void UpstreamPool::sweep( const steady_clock::time_point & now )
+{
+    for ( auto entry = idle_.begin(); entry != idle_.end(); ) {
+        auto & connections = entry->second;
+        while ( not connections.empty() and expired( connections.front().idle_since, now ) ) {
+            connections.pop_front();
+        }
+
+        if ( connections.empty() ) {
+            entry = idle_.erase( entry );
+        } else {
+            ++entry;
+        }
+    }
+}
+
+bool UpstreamPool::has_idle( const Address & server )
+{
+    const string prefix = key( server, "" );
+
+    unique_lock<mutex> lock( mutex_ );
+
+    const auto entry = idle_.lower_bound( prefix );
+    return entry != idle_.end() and entry->first.compare( 0, prefix.size(), prefix ) == 0;
+}
@@ -0,0 +1,68 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef UPSTREAM_POOL_HH
+#define UPSTREAM_POOL_HH
+
+#include <map>
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <chrono>
+
+#include "address.hh"
+#include "proxy_connection.hh"
+
+/* idle keep-alive connections to origin servers (plain, or with TLS
+   established), shared by every worker so that later client connections
+   can skip the TCP and TLS handshakes. Connections are keyed by server
+   address and, for TLS, the SNI host name they were set up with. */
+class UpstreamPool
+{
+public:
+    typedef std::unique_ptr< ProxySocket > Connection;
+
+private:
+    struct IdleConnection
+    {
+        Connection connection;
+        std::chrono::steady_clock::time_point idle_since;
+    };
+
+    std::mutex mutex_ {};
+
+    /* newest at the back */
+    std::map< std::string, std::deque< IdleConnection > > idle_ {};
+
+    /* connections checked in since the last sweep for expired ones */
+    unsigned int puts_since_sweep_ { 0 };
+
+    void sweep( const std::chrono::steady_clock::time_point & now );
+
+public:
+    /* most idle connections to keep per key */
+    static const size_t MAX_IDLE_PER_KEY = 8;
+
+    /* servers commonly time out idle connections after a few tens of seconds */
+    static const unsigned int IDLE_TIMEOUT_SECONDS = 30;
+
+    UpstreamPool() {}
+
+    static std::string key( const Address & server, const std::string & host_name );
+
+    /* an idle connection for this key that still looks open, or null */
+    Connection take( const std::string & key );
+
+    /* check in a connection that has answered everything sent on it */
+    void put( const std::string & key, Connection && connection );
+
+    /* are there idle connections to this address, for any host name? */
+    bool has_idle( const Address & server );
+
+    /* ban copying */
+    UpstreamPool( const UpstreamPool & other ) = delete;
+    UpstreamPool & operator=( const UpstreamPool & other ) = delete;
+};
+
+#endif /* UPSTREAM_POOL_HH */
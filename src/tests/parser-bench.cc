@@ -0,0 +1,256 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* microbenchmark for the HTTP parsers on real headers: the heads (first
+   line and headers) of the requests and responses saved in one or more
+   recordings are run through HTTPRequestParser and HTTPResponseParser
+   over and over, in socket-sized reads, with each line scanner this CPU
+   has. Bodies are left out, so what's measured is header parsing. The
+   scanner is also timed on its own, finding every line of every head. */
+
+#include <unistd.h>
+#include <getopt.h>
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+
+#include "http_request_parser.hh"
+#include "http_response_parser.hh"
+#include "line_scanner.hh"
+#include "replay_index.hh"
+#include "exception.hh"
+#include "util.hh"
+#include "ezio.hh"
+
+using namespace std;
+using namespace std::chrono;
+
+/* what a read from a socket typically brings */
+static const size_t READ_SIZE = 16384;
+
+struct Corpus
+{
+    string requests {};
+    string responses {};
+    size_t request_count {0};
+    size_t response_count {0};
+};
+
+/* serialized message without its body */
+template <class MessageType>
+static string head_of( MahimahiProtobufs::HTTPMessage message )
+{
+    message.clear_body();
+    return MessageType( message ).str();
+}
+
+static void add_recording( string directory, Corpus & corpus )
+{
+    if ( directory.empty() or directory.back() != '/' ) {
+        directory.append( "/" );
+    }
+
+    for ( const auto & filename : list_directory_contents( directory ) ) {
+        if ( filename.compare( directory.size(), 1, "." ) == 0 ) {
+            continue; /* the body store and index */
+        }
+
+        MahimahiProtobufs::RequestResponse record;
+        if ( not record.ParseFromString( read_record_file( filename ) ) ) {
+            throw runtime_error( filename + ": invalid HTTP request/response" );
+        }
+
+        /* requests that would be followed by a body are left out */
+        const string & request_line = record.request().first_line();
+        if ( request_line.compare( 0, 4, "GET " ) == 0 or request_line.compare( 0, 5, "HEAD " ) == 0 ) {
+            corpus.requests.append( head_of<HTTPRequest>( record.request() ) );
+            corpus.request_count++;
+        }
+
+        /* each response is parsed as the answer to a HEAD, so it has no body */
+        if ( record.response().first_line().compare( 0, 10, "HTTP/1.1 1" ) != 0 ) {
+            corpus.responses.append( head_of<HTTPResponse>( record.response() ) );
+            corpus.response_count++;
+        }
+    }
+}
+
+/* parse all of stream, a read at a time; returns how many messages came out */
+template <class Parser>
+static size_t parse_all( Parser & parser, const string & stream )
+{
+    size_t messages = 0;
+
+    for ( size_t offset = 0; offset < stream.size(); offset += READ_SIZE ) {
+        parser.parse( stream.substr( offset, READ_SIZE ) );
+        while ( not parser.empty() ) {
+            parser.pop();
+            messages++;
+        }
+    }
+
+    return messages;
+}
+
+static HTTPRequest head_request( void )
+{
+    HTTPRequestParser parser;
+    parser.parse( "HEAD / HTTP/1.1\r\nHost: localhost\r\n\r\n" );
+    return parser.front();
+}
+
+struct Result
+{
+    double scan_seconds {0};
+    double request_seconds {0};
+    double response_seconds {0};
+};
+
+/* find every line end in stream, one head at a time */
+static size_t scan_all( const string & stream )
+{
+    vector< size_t > line_ends;
+    size_t lines = 0;
+
+    for ( size_t pos = 0; pos < stream.size(); ) {
+        line_ends.clear();
+        pos = scan_lines( stream, pos, line_ends );
+        lines += line_ends.size();
+        if ( line_ends.empty() ) {
+            break;
+        }
+    }
+
+    return lines;
+}
+
+static Result run( const Corpus & corpus, const unsigned int iterations )
+{
+    Result ret;
+    const HTTPRequest head = head_request();
+
+    auto start = steady_clock::now();
+    size_t lines = 0;
+    for ( unsigned int i = 0; i < iterations; i++ ) {
+        lines += scan_all( corpus.requests ) + scan_all( corpus.responses );
+    }
+    ret.scan_seconds = duration<double>( steady_clock::now() - start ).count();
+    if ( lines == 0 ) {
+        throw runtime_error( "no lines found" );
+    }
+
+    start = steady_clock::now();
+    for ( unsigned int i = 0; i < iterations; i++ ) {
+        HTTPRequestParser parser;
+        if ( parse_all( parser, corpus.requests ) != corpus.request_count ) {
+            throw runtime_error( "request parser lost a request" );
+        }
+    }
+    ret.request_seconds = duration<double>( steady_clock::now() - start ).count();
+
+    start = steady_clock::now();
+    for ( unsigned int i = 0; i < iterations; i++ ) {
+        HTTPResponseParser parser;
+        for ( size_t j = 0; j < corpus.response_count; j++ ) {
+            parser.new_request_arrived( head );
+        }
+        if ( parse_all( parser, corpus.responses ) != corpus.response_count ) {
+            throw runtime_error( "response parser lost a response" );
+        }
+    }
+    ret.response_seconds = duration<double>( steady_clock::now() - start ).count();
+
+    return ret;
+}
+
+static void usage( const char * argv0 )
+{
+    cerr << "Usage: " << argv0 << " [options] RECORDING_DIRECTORY..." << endl
+         << "  --iterations=N             passes over the heads (default 50)" << endl;
+}
+
+int main( int argc, char *argv[] )
+{
+    try {
+        unsigned int iterations = 50;
+
+        const option command_line_options[] = {
+            { "iterations", required_argument, nullptr, 'i' },
+            { "help",       no_argument,       nullptr, 'h' },
+            { 0,            0,                 nullptr,  0  }
+        };
+
+        while ( true ) {
+            const int opt = getopt_long( argc, argv, "", command_line_options, nullptr );
+            if ( opt == -1 ) {
+                break;
+            }
+
+            switch ( opt ) {
+            case 'i':
+                iterations = myatoi( optarg );
+                break;
+            case 'h':
+                usage( argv[ 0 ] );
+                return EXIT_SUCCESS;
+            default:
+                usage( argv[ 0 ] );
+                return EXIT_FAILURE;
+            }
+        }
+
+        if ( optind == argc or iterations == 0 ) {
+            usage( argv[ 0 ] );
+            return EXIT_FAILURE;
+        }
+
+        if ( geteuid() == 0 or getegid() == 0 ) {
+            cerr << "parser-bench SKIPPED (recordings can't be handled as root)" << endl;
+            return 77;
+        }
+
+        Corpus corpus;
+        for ( int i = optind; i < argc; i++ ) {
+            add_recording( argv[ i ], corpus );
+        }
+
+        if ( corpus.request_count == 0 and corpus.response_count == 0 ) {
+            throw runtime_error( "no requests or responses in the recordings" );
+        }
+
+        cout << corpus.request_count << " request heads (" << corpus.requests.size() << " bytes), "
+             << corpus.response_count << " response heads (" << corpus.responses.size() << " bytes), "
+             << iterations << " passes" << endl
+             << "scanner  scan MB/s  req heads/s   req MB/s  resp heads/s  resp MB/s  parse speedup" << endl;
+
+        const double total_bytes = double( corpus.requests.size() + corpus.responses.size() ) * iterations;
+        double scalar_seconds = 0;
+        for ( const auto level : { ScanLevel::SCALAR, ScanLevel::SSE2, ScanLevel::AVX2 } ) {
+            if ( not set_scan_level( level ) ) {
+                continue;
+            }
+
+            const Result result = run( corpus, iterations );
+            const double seconds = result.request_seconds + result.response_seconds;
+            if ( level == ScanLevel::SCALAR ) {
+                scalar_seconds = seconds;
+            }
+
+            cout << left << setw( 7 ) << scan_level_name( level ) << right << fixed << setprecision( 1 )
+                 << setw( 11 ) << total_bytes / result.scan_seconds / 1e6
+                 << setw( 13 ) << corpus.request_count * iterations / result.request_seconds
+                 << setw( 11 ) << corpus.requests.size() * iterations / result.request_seconds / 1e6
+                 << setw( 14 ) << corpus.response_count * iterations / result.response_seconds
+                 << setw( 11 ) << corpus.responses.size() * iterations / result.response_seconds / 1e6
+                 << setw( 14 ) << setprecision( 2 ) << scalar_seconds / seconds << "x" << endl;
+        }
+    } catch ( const exception & e ) {
+        print_exception( e );
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
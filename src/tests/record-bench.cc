@@ -0,0 +1,520 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* benchmark for the record path: a stand-in origin on loopback (plain
+   HTTP, or HTTPS with the built-in certificate) and a load generator whose
+   requests go through HTTPProxy into an HTTPDiskStore, with no namespaces
+   or NAT rules needed. Each configuration runs straight to the origin and
+   then through the proxy, and the latency percentiles of the two runs are
+   reported side by side. (They're separate runs, so the difference of two
+   percentiles isn't what the proxy added to any one request.) */
+
+#include <unistd.h>
+#include <getopt.h>
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+
+#include "http_proxy.hh"
+#include "proxy_connection.hh"
+#include "connection_worker.hh"
+#include "backing_store.hh"
+#include "secure_socket.hh"
+#include "http_request_parser.hh"
+#include "http_response_parser.hh"
+#include "epoller.hh"
+#include "poller.hh"
+#include "tokenize.hh"
+#include "exception.hh"
+#include "util.hh"
+#include "ezio.hh"
+
+using namespace std;
+using namespace std::chrono;
+using namespace PollerShortNames;
+
+/* chunked responses are sent in pieces this big */
+static const size_t CHUNK_SIZE = 16384;
+
+/* every response the origin can give, by request target ("/SIZE" or "/SIZE?chunked") */
+typedef map< string, string > ResponseTable;
+
+static string target( const size_t size, const bool chunked )
+{
+    return "/" + to_string( size ) + (chunked ? "?chunked" : "");
+}
+
+static ResponseTable make_responses( const vector< size_t > & sizes )
+{
+    ResponseTable ret;
+
+    for ( const auto size : sizes ) {
+        const string body( size, 'x' );
+        const string head = "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n";
+
+        ret[ target( size, false ) ] = head + "Content-Length: " + to_string( size ) + "\r\n\r\n" + body;
+
+        string chunked = head + "Transfer-Encoding: chunked\r\n\r\n";
+        for ( size_t offset = 0; offset < size; offset += CHUNK_SIZE ) {
+            const size_t length = min( CHUNK_SIZE, size - offset );
+            ostringstream chunk_size;
+            chunk_size << hex << length;
+            chunked += chunk_size.str() + "\r\n" + body.substr( offset, length ) + "\r\n";
+        }
+        ret[ target( size, true ) ] = chunked + "0\r\n\r\n";
+    }
+
+    return ret;
+}
+
+/* one connection to the stand-in origin, served by a ConnectionWorker */
+class OriginConnection : public ConnectionWorker::Connection
+{
+private:
+    const ResponseTable & responses_;
+    Epoller & epoller_;
+    const function<void()> on_close_;
+    ProxySocket client_;
+    HTTPRequestParser request_parser_ {};
+    bool closed_;
+
+    bool may_read( void ) const
+    {
+        return client_.ready() and not client_.eof() and client_.output().size() < ProxyConnection::OUTPUT_LIMIT;
+    }
+
+    void handle( const uint32_t events )
+    {
+        try {
+            client_.handle_events( events );
+
+            if ( may_read() ) {
+                request_parser_.parse( client_.read() );
+            }
+
+            while ( not request_parser_.empty() ) {
+                const auto tokens = split( request_parser_.front().first_line(), " " );
+                const auto response = responses_.find( tokens.size() > 1 ? tokens.at( 1 ) : "" );
+                client_.output().append( response != responses_.end() ? response->second
+                                         : "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n" );
+                request_parser_.pop();
+            }
+
+            client_.write();
+
+            if ( not client_.eof() ) {
+                epoller_.modify( client_.socket(), client_.events( may_read() ) );
+                return;
+            }
+        } catch ( const exception & e ) {
+            print_exception( e );
+        }
+
+        closed_ = true;
+        epoller_.remove( client_.socket() );
+        on_close_();
+    }
+
+public:
+    OriginConnection( TCPSocket && client, SSLContext * const tls_context, const ResponseTable & responses,
+                      Epoller & epoller, const function<void()> & on_close )
+        : responses_( responses ),
+          epoller_( epoller ),
+          on_close_( on_close ),
+          client_( move( client ), false ),
+          closed_( false )
+    {
+        if ( tls_context ) {
+            client_.start_tls( *tls_context );
+        }
+
+        epoller_.add( client_.socket(), client_.events( may_read() ),
+                      [this] ( const uint32_t events ) { handle( events ); } );
+    }
+
+    ~OriginConnection() override
+    {
+        if ( not closed_ ) {
+            epoller_.remove( client_.socket() );
+        }
+    }
+
+    /* ban copying */
+    OriginConnection( const OriginConnection & other ) = delete;
+    OriginConnection & operator=( const OriginConnection & other ) = delete;
+};
+
+/* what one configuration is asked to do */
+struct Workload
+{
+    bool https;
+    size_t size;
+    unsigned int connections;
+    unsigned int chunked_percent;
+    unsigned int requests_per_connection;
+};
+
+/* what came back */
+struct Measurement
+{
+    double seconds { 0 };
+    uint64_t requests { 0 };
+    uint64_t bytes { 0 };
+    vector< double > latencies {}; /* microseconds, sorted */
+
+    double percentile( const unsigned int p ) const
+    {
+        return latencies.empty() ? 0 : latencies.at( min( latencies.size() - 1, latencies.size() * p / 100 ) );
+    }
+};
+
+/* send each request in turn on one connection, waiting for its response */
+template <class SocketType>
+static void exchange( SocketType & socket, const Workload & workload, const ResponseTable & responses,
+                      vector< double > & latencies, uint64_t & bytes )
+{
+    const string host = "record-bench.test";
+    HTTPRequestParser request_parser;
+    HTTPResponseParser response_parser;
+
+    for ( unsigned int i = 0; i < workload.requests_per_connection; i++ ) {
+        /* spread the chunked responses evenly through the run */
+        const bool chunked = (i + 1) * workload.chunked_percent / 100 != i * workload.chunked_percent / 100;
+        const string request = "GET " + target( workload.size, chunked ) + " HTTP/1.1\r\n"
+            "Host: " + host + "\r\n\r\n";
+        const string & expected = responses.at( target( workload.size, chunked ) );
+
+        request_parser.parse( request );
+        response_parser.new_request_arrived( request_parser.front() );
+        request_parser.pop();
+
+        const auto start = steady_clock::now();
+
+        socket.write( request );
+        while ( response_parser.empty() ) {
+            const string buffer = socket.read();
+            if ( buffer.empty() ) {
+                throw runtime_error( "connection closed with a response outstanding" );
+            }
+            bytes += buffer.size();
+            response_parser.parse( buffer );
+        }
+
+        latencies.push_back( duration_cast< duration< double, micro > >( steady_clock::now() - start ).count() );
+
+        if ( response_parser.front().str() != expected ) {
+            throw runtime_error( "wrong response to " + target( workload.size, chunked ) );
+        }
+        response_parser.pop();
+    }
+}
+
+static void run_client( const Address & server, SSLContext & client_context,
+                        const Workload & workload, const ResponseTable & responses,
+                        vector< double > & latencies, uint64_t & bytes, string & error )
+{
+    try {
+        TCPSocket socket;
+        socket.connect( server );
+
+        if ( workload.https ) {
+            SecureSocket tls = client_context.new_secure_socket( move( socket ), "record-bench.test" );
+            tls.connect();
+            exchange( tls, workload, responses, latencies, bytes );
+        } else {
+            exchange( socket, workload, responses, latencies, bytes );
+        }
+    } catch ( const exception & e ) {
+        error = e.what();
+    }
+}
+
+/* run the clients against server, polling for connections to accept meanwhile */
+static Measurement run_clients( const Address & server, SSLContext & client_context,
+                                const Workload & workload, const ResponseTable & responses, Poller & poller )
+{
+    vector< vector< double > > latencies( workload.connections );
+    vector< uint64_t > bytes( workload.connections );
+    vector< string > errors( workload.connections );
+    atomic< unsigned int > running( workload.connections );
+
+    const auto start = steady_clock::now();
+
+    vector< thread > clients;
+    for ( unsigned int i = 0; i < workload.connections; i++ ) {
+        clients.emplace_back( [&, i] () {
+                run_client( server, client_context, workload, responses,
+                            latencies.at( i ), bytes.at( i ), errors.at( i ) );
+                running--;
+            } );
+    }
+
+    while ( running ) {
+        poller.poll( 10 );
+    }
+
+    const auto end = steady_clock::now();
+
+    for ( auto & client : clients ) {
+        client.join();
+    }
+
+    for ( const auto & error : errors ) {
+        if ( not error.empty() ) {
+            throw runtime_error( "client: " + error );
+        }
+    }
+
+    Measurement ret;
+    ret.seconds = duration_cast< duration< double > >( end - start ).count();
+    for ( unsigned int i = 0; i < workload.connections; i++ ) {
+        ret.requests += latencies.at( i ).size();
+        ret.bytes += bytes.at( i );
+        ret.latencies.insert( ret.latencies.end(), latencies.at( i ).begin(), latencies.at( i ).end() );
+    }
+    sort( ret.latencies.begin(), ret.latencies.end() );
+
+    return ret;
+}
+
+static string make_temp_directory( void )
+{
+    const string directory_template = "/tmp/record-bench.XXXXXX";
+    vector< char > mutable_template( directory_template.c_str(),
+                                     directory_template.c_str() + directory_template.size() + 1 );
+    if ( not mkdtemp( &mutable_template[ 0 ] ) ) {
+        throw unix_error( "mkdtemp" );
+    }
+    return string( &mutable_template[ 0 ] ) + "/";
+}
+
+/* delete a recording, returning how many records it had */
+static unsigned int remove_recording( const string & directory )
+{
+    unsigned int records = 0;
+    for ( const auto & filename : list_directory_contents( directory ) ) {
+        if ( filename.at( directory.size() ) != '.' ) { /* not the index */
+            records++;
+        }
+        SystemCall( "unlink " + filename, unlink( filename.c_str() ) );
+    }
+    SystemCall( "rmdir " + directory, rmdir( directory.c_str() ) );
+
+    return records;
+}
+
+/* hand connections to listener to worker */
+static Poller::Action accept_into( TCPSocket & listener, ConnectionWorker & worker )
+{
+    return Poller::Action( listener, Direction::In,
+                           [&] () {
+                               worker.add_connection( listener.accept() );
+                               return ResultType::Continue;
+                           } );
+}
+
+/* the same workload, through a proxy recording to a fresh directory */
+static Measurement run_proxied( const Address & origin, SSLContext & client_context,
+                                const Workload & workload, const ResponseTable & responses,
+                                const unsigned int proxy_workers,
+                                TCPSocket & origin_listener, ConnectionWorker & origin_worker )
+{
+    const string directory = make_temp_directory();
+    Measurement ret;
+
+    {
+        HTTPDiskStore backing_store( directory );
+        HTTPProxy proxy( Address( "127.0.0.1", 0 ), proxy_workers );
+        proxy.forward_to( origin, workload.https );
+        proxy.start_workers( backing_store );
+
+        Poller poller;
+        poller.add_action( Poller::Action( proxy.tcp_listener(), Direction::In,
+                                           [&] () { proxy.handle_tcp(); return ResultType::Continue; } ) );
+        poller.add_action( accept_into( origin_listener, origin_worker ) );
+
+        ret = run_clients( proxy.tcp_listener().local_address(), client_context, workload, responses, poller );
+
+        /* the proxy's pooled connections to the origin close with it */
+        proxy.stop();
+    }
+
+    /* every exchange should have been saved */
+    const unsigned int records = remove_recording( directory );
+    if ( records != ret.requests ) {
+        throw runtime_error( "recorded " + to_string( records ) + " of " + to_string( ret.requests ) + " responses" );
+    }
+
+    return ret;
+}
+
+static vector< unsigned int > parse_list( const string & list, const string & name )
+{
+    vector< unsigned int > ret;
+    for ( const auto & item : split( list, "," ) ) {
+        try {
+            ret.push_back( stoul( item ) );
+        } catch ( const exception & ) {
+            throw runtime_error( "bad number \"" + item + "\" in --" + name );
+        }
+    }
+    return ret;
+}
+
+static void usage( const char * argv0 )
+{
+    cerr << "Usage: " << argv0 << " [options]" << endl
+         << "  --schemes=http,https       protocols to run" << endl
+         << "  --sizes=LIST               response body sizes, in bytes (default 1024,65536,1048576)" << endl
+         << "  --connections=LIST         concurrent client connections (default 1,16)" << endl
+         << "  --chunked=LIST             percentages of responses sent chunked (default 0,100)" << endl
+         << "  --requests=N               requests per connection (default 200)" << endl
+         << "  --workers=N                proxy worker threads (default one per core)" << endl;
+}
+
+int main( int argc, char *argv[] )
+{
+    try {
+        vector< string > schemes = { "http", "https" };
+        vector< unsigned int > sizes = { 1024, 65536, 1048576 };
+        vector< unsigned int > connection_counts = { 1, 16 };
+        vector< unsigned int > chunked_percents = { 0, 100 };
+        unsigned int requests = 200;
+        unsigned int proxy_workers = 0;
+
+        const option command_line_options[] = {
+            { "schemes",     required_argument, nullptr, 's' },
+            { "sizes",       required_argument, nullptr, 'z' },
+            { "connections", required_argument, nullptr, 'c' },
+            { "chunked",     required_argument, nullptr, 'k' },
+            { "requests",    required_argument, nullptr, 'n' },
+            { "workers",     required_argument, nullptr, 'w' },
+            { "help",        no_argument,       nullptr, 'h' },
+            { 0,             0,                 nullptr,  0  }
+        };
+
+        while ( true ) {
+            const int opt = getopt_long( argc, argv, "", command_line_options, nullptr );
+            if ( opt == -1 ) {
+                break;
+            }
+
+            switch ( opt ) {
+            case 's':
+                schemes = split( optarg, "," );
+                for ( const auto & scheme : schemes ) {
+                    if ( scheme != "http" and scheme != "https" ) {
+                        throw runtime_error( "unknown scheme \"" + scheme + "\"" );
+                    }
+                }
+                break;
+            case 'z':
+                sizes = parse_list( optarg, "sizes" );
+                break;
+            case 'c':
+                connection_counts = parse_list( optarg, "connections" );
+                break;
+            case 'k':
+                chunked_percents = parse_list( optarg, "chunked" );
+                break;
+            case 'n':
+                requests = myatoi( optarg );
+                break;
+            case 'w':
+                proxy_workers = myatoi( optarg );
+                break;
+            case 'h':
+                usage( argv[ 0 ] );
+                return EXIT_SUCCESS;
+            default:
+                usage( argv[ 0 ] );
+                return EXIT_FAILURE;
+            }
+        }
+
+        if ( optind != argc ) {
+            usage( argv[ 0 ] );
+            return EXIT_FAILURE;
+        }
+
+        if ( geteuid() == 0 or getegid() == 0 ) {
+            cerr << "record-bench SKIPPED (recordings can't be handled as root)" << endl;
+            return 77;
+        }
+
+        for ( const auto percent : chunked_percents ) {
+            if ( percent > 100 ) {
+                throw runtime_error( "--chunked percentages go up to 100" );
+            }
+        }
+
+        const ResponseTable responses = make_responses( vector< size_t >( sizes.begin(), sizes.end() ) );
+        SSLContext origin_context( SERVER ), client_context( CLIENT );
+
+        cout << "                                     proxied   "
+             << "        direct (us)           proxied (us)" << endl
+             << "scheme      size conns chunked       req/s      MB/s   "
+             << "   p50    p90    p99      p50    p90    p99" << endl;
+
+        for ( const auto & scheme : schemes ) {
+            const bool https = scheme == "https";
+
+            /* the stand-in origin */
+            TCPSocket origin_listener;
+            origin_listener.bind( Address( "127.0.0.1", 0 ) );
+            origin_listener.listen();
+            const Address origin = origin_listener.local_address();
+
+            ConnectionWorker origin_worker(
+                [&] ( TCPSocket && client, Epoller & epoller, const function<void()> & on_close ) {
+                    return unique_ptr< ConnectionWorker::Connection >(
+                        new OriginConnection( move( client ), https ? &origin_context : nullptr,
+                                              responses, epoller, on_close ) );
+                } );
+
+            Poller origin_poller;
+            origin_poller.add_action( accept_into( origin_listener, origin_worker ) );
+
+            for ( const auto size : sizes ) {
+                for ( const auto connections : connection_counts ) {
+                    for ( const auto chunked_percent : chunked_percents ) {
+                        const Workload workload { https, size, connections, chunked_percent, requests };
+
+                        const Measurement direct = run_clients( origin, client_context, workload, responses,
+                                                                origin_poller );
+                        const Measurement proxied = run_proxied( origin, client_context, workload, responses,
+                                                                 proxy_workers, origin_listener, origin_worker );
+
+                        cout << left << setw( 7 ) << scheme << right
+                             << setw( 9 ) << size << setw( 6 ) << connections
+                             << setw( 7 ) << chunked_percent << "%"
+                             << fixed << setprecision( 1 )
+                             << setw( 12 ) << proxied.requests / proxied.seconds
+                             << setw( 10 ) << proxied.bytes / proxied.seconds / 1e6
+                             << setprecision( 0 ) << "  "
+                             << setw( 7 ) << direct.percentile( 50 )
+                             << setw( 7 ) << direct.percentile( 90 )
+                             << setw( 7 ) << direct.percentile( 99 ) << "  "
+                             << setw( 7 ) << proxied.percentile( 50 )
+                             << setw( 7 ) << proxied.percentile( 90 )
+                             << setw( 7 ) << proxied.percentile( 99 )
+                             << endl;
+                    }
+                }
+            }
+        }
+
+        return EXIT_SUCCESS;
+    } catch ( const exception & e ) {
+        print_exception( e );
+        return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,424 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/* regression test for replay matching: build a corpus of near-identical
+   saved requests (beacons that differ only in their query strings, etc.)
+   and confirm that every indexed lookup picks the same saved record as the
+   original linear scan in mm-replayserver. Some records are saved in other
+   valid encodings (the response split in two, the body given twice, fields
+   out of order, ...), and every response the index serves, whether found
+   in place by the record scanner or by a full parse, must be the one a
+   full parse of the record gives, even after some records are saved over
+   behind the recorder's index. */
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <iostream>
+#include <vector>
+#include <random>
+
+#include "replay_index.hh"
+#include "recording_archive.hh"
+#include "http_request.hh"
+#include "http_response.hh"
+#include "temp_file.hh"
+#include "file_descriptor.hh"
+#include "exception.hh"
+#include "util.hh"
+
+using namespace std;
+
+/* what mm-replayserver looked at in each saved request */
+struct SavedRequest
+{
+    MahimahiProtobufs::RequestResponse_Scheme scheme;
+    bool has_host;
+    string host;
+    string first_line;
+};
+
+/* the scan mm-replayserver used to do for every request */
+static int reference_match( const vector< SavedRequest > & saved_requests,
+                            const bool is_https, const char * const host, const string & request_line )
+{
+    unsigned int best_score = 0;
+    int best_match = -1;
+
+    for ( unsigned int i = 0; i < saved_requests.size(); i++ ) {
+        const SavedRequest & saved = saved_requests.at( i );
+
+        if ( saved.scheme != ( is_https ? MahimahiProtobufs::RequestResponse_Scheme_HTTPS
+                                        : MahimahiProtobufs::RequestResponse_Scheme_HTTP ) ) {
+            continue;
+        }
+
+        if ( saved.has_host != bool( host ) or ( host and saved.host != host ) ) {
+            continue;
+        }
+
+        if ( strip_query( request_line ) != strip_query( saved.first_line ) ) {
+            continue;
+        }
+
+        unsigned int score = 0;
+        while ( score < min( request_line.size(), saved.first_line.size() )
+                and request_line.at( score ) == saved.first_line.at( score ) ) {
+            score++;
+        }
+
+        if ( score > best_score ) {
+            best_score = score;
+            best_match = i;
+        }
+    }
+
+    return best_match;
+}
+
+/* position of an index entry in directory order, or -1 for no entry */
+static int position_of( const ReplayIndex & index, const MahimahiProtobufs::ReplayIndexEntry * const entry )
+{
+    for ( int i = 0; entry and i < index.entries().size(); i++ ) {
+        if ( &index.entries().Get( i ) == entry ) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* does the index serve each record just as a full parse of it reads?
+   counts the records whose bodies are served in place */
+static unsigned int check_responses( const ReplayIndex & index, const string & name,
+                                     unsigned int & failures )
+{
+    unsigned int in_place = 0;
+
+    for ( const auto & entry : index.entries() ) {
+        const string served = index.response( entry ).str();
+        const string expected = HTTPResponse( index.load( entry ).response() ).str();
+        if ( served != expected ) {
+            failures++;
+            cerr << name << ": wrong response for \"" << entry.first_line() << "\" ("
+                 << served.size() << " bytes, expected " << expected.size() << ")" << endl;
+        }
+
+        if ( entry.has_body_offset() ) {
+            in_place++;
+        }
+    }
+
+    return in_place;
+}
+
+/* protobuf wire format for a length-delimited field */
+static string wire_field( const unsigned int number, const string & contents )
+{
+    string ret;
+    for ( uint64_t value : { uint64_t( number << 3 | 2 ), uint64_t( contents.size() ) } ) {
+        for ( ; value >= 0x80; value >>= 7 ) {
+            ret.push_back( char( (value & 0x7f) | 0x80 ) );
+        }
+        ret.push_back( char( value ) );
+    }
+
+    return ret + contents;
+}
+
+/* files written for the test, removed when it's done (or fails) */
+struct SavedFiles
+{
+    vector< string > names {};
+
+    void remove_all( void )
+    {
+        for ( const auto & name : names ) {
+            SystemCall( "unlink " + name, unlink( name.c_str() ) );
+        }
+        names.clear();
+    }
+
+    ~SavedFiles()
+    {
+        for ( const auto & name : names ) {
+            unlink( name.c_str() );
+        }
+    }
+};
+
+class Corpus
+{
+private:
+    minstd_rand prng_ { 1 };
+
+    template <typename T>
+    const T & pick( const vector< T > & choices )
+    {
+        return choices.at( uniform_int_distribution< size_t >( 0, choices.size() - 1 )( prng_ ) );
+    }
+
+public:
+    unsigned int number( const unsigned int limit )
+    {
+        return uniform_int_distribution< unsigned int >( 0, limit - 1 )( prng_ );
+    }
+
+    string host( void )
+    {
+        return pick( vector< string > { "a.com", "A.com", "ads.example.net", "cdn.example.net", "" } );
+    }
+
+    string request_line( void )
+    {
+        string line = pick( vector< string > { "GET ", "GET ", "GET ", "POST " } );
+        line += pick( vector< string > { "/", "/index.html", "/b", "/beacon", "/beacon/", "/collect", "/ads/pixel.gif" } );
+
+        switch ( number( 6 ) ) {
+        case 0:
+            break;
+        case 1:
+            line += "?";
+            break;
+        case 2:
+            line += "?id=" + to_string( number( 40 ) );
+            break;
+        case 3:
+            line += "?id=" + to_string( number( 40 ) ) + "&t=" + to_string( number( 1000 ) );
+            break;
+        case 4:
+            line += "?t=" + to_string( number( 1000 ) ) + "&id=" + to_string( number( 40 ) );
+            break;
+        default:
+            line += "?cb=" + to_string( number( 100000000 ) );
+        }
+
+        return line + pick( vector< string > { " HTTP/1.1", " HTTP/1.1", " HTTP/1.0" } );
+    }
+
+    MahimahiProtobufs::RequestResponse record( const unsigned int serial )
+    {
+        MahimahiProtobufs::RequestResponse ret;
+        ret.set_ip( "10.0.0." + to_string( 1 + number( 4 ) ) );
+        ret.set_port( number( 3 ) ? 80 : 443 );
+        ret.set_scheme( ret.port() == 443 ? MahimahiProtobufs::RequestResponse_Scheme_HTTPS
+                                          : MahimahiProtobufs::RequestResponse_Scheme_HTTP );
+
+        ret.mutable_request()->set_first_line( request_line() );
+        const string saved_host = host();
+        if ( not saved_host.empty() ) {
+            MahimahiProtobufs::HTTPHeader * const header = ret.mutable_request()->add_header();
+            header->set_key( number( 2 ) ? "Host" : "host" );
+            header->set_value( saved_host );
+        }
+
+        /* some bodies and headers larger than the record scanner's read window */
+        string body = "record " + to_string( serial );
+        if ( number( 8 ) == 0 ) {
+            body.append( 16384 + number( 32768 ), "abcdefgh"[ number( 8 ) ] );
+        }
+        ret.mutable_response()->set_first_line( "HTTP/1.1 200 OK" );
+        MahimahiProtobufs::HTTPHeader * const header = ret.mutable_response()->add_header();
+        header->set_key( "Content-Length" );
+        header->set_value( to_string( body.size() ) );
+        if ( number( 16 ) == 0 ) {
+            MahimahiProtobufs::HTTPHeader * const padding = ret.mutable_response()->add_header();
+            padding->set_key( "X-Padding" );
+            padding->set_value( string( 20000 + number( 4000 ), 'p' ) );
+        }
+        ret.mutable_response()->set_body( body );
+
+        return ret;
+    }
+
+    /* the record as saved: usually as protobuf serializes it, but sometimes
+       encoded another way that a full parse reads the same */
+    string encode( const MahimahiProtobufs::RequestResponse & record )
+    {
+        MahimahiProtobufs::RequestResponse rest = record;
+        rest.clear_response();
+        MahimahiProtobufs::HTTPMessage head = record.response();
+        head.clear_body();
+        const string body_field = wire_field( 3, record.response().body() );
+
+        switch ( number( 10 ) ) {
+        case 0: /* response in two fields, which a full parse merges */
+            return rest.SerializeAsString() + wire_field( 5, head.SerializeAsString() )
+                + wire_field( 5, body_field );
+        case 1: /* body given twice; the last one counts */
+            return rest.SerializeAsString()
+                + wire_field( 5, wire_field( 3, "stale body" ) + head.SerializeAsString() + body_field );
+        case 2: /* body before the headers */
+            return rest.SerializeAsString() + wire_field( 5, body_field + head.SerializeAsString() );
+        case 3: { /* response before the request */
+            MahimahiProtobufs::RequestResponse address = rest;
+            address.clear_request();
+            return address.SerializeAsString() + wire_field( 5, record.response().SerializeAsString() )
+                + wire_field( 4, record.request().SerializeAsString() );
+        }
+        case 4: /* an unknown field in a group, which the record scanner gives up on */
+            return record.SerializeAsString() + "\x7b" + wire_field( 1, "unknown" ) + "\x7c";
+        default:
+            return record.SerializeAsString();
+        }
+    }
+};
+
+int main()
+{
+    try {
+        if ( geteuid() == 0 or getegid() == 0 ) {
+            cerr << "replay-match-test SKIPPED (recordings can't be read as root)" << endl;
+            return 77;
+        }
+
+        const string directory_template = "/tmp/replay-match-test.XXXXXX";
+        vector< char > mutable_template( directory_template.c_str(),
+                                         directory_template.c_str() + directory_template.size() + 1 );
+        if ( not mkdtemp( &mutable_template[ 0 ] ) ) {
+            throw unix_error( "mkdtemp" );
+        }
+        const string directory = string( &mutable_template[ 0 ] ) + "/";
+        const string archive_filename = string( &mutable_template[ 0 ] ) + ".archive";
+
+        /* save the corpus, with some requests saved more than once */
+        Corpus corpus;
+        SavedFiles files;
+        for ( unsigned int i = 0; i < 1500; i++ ) {
+            MahimahiProtobufs::RequestResponse record = corpus.record( i );
+            if ( i > 0 and corpus.number( 10 ) == 0 ) {
+                record = corpus.record( i );
+                record.mutable_request()->CopyFrom( corpus.record( i - 1 ).request() );
+            }
+
+            /* closed once written, so the corpus doesn't need an fd per record */
+            UniqueFile file( directory + "save" );
+            file.write( corpus.encode( record ) );
+            files.names.push_back( file.name() );
+        }
+
+        /* the recorder's index of every record, as mm-webrecord appends it */
+        MahimahiProtobufs::ReplayIndex recorded;
+        for ( const auto & name : files.names ) {
+            MahimahiProtobufs::ReplayIndexEntry entry = index_record( name );
+            entry.set_filename( name.substr( directory.size() ) );
+            recorded.add_entry()->Swap( &entry );
+        }
+        const string index_filename = directory + RECORD_INDEX_NAME;
+        FileDescriptor( SystemCall( "open " + index_filename,
+                                    open( index_filename.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600 ) ) )
+            .write( recorded.SerializeAsString() );
+        files.names.push_back( index_filename );
+
+        /* then some records are saved over, so their entries are stale (each
+           at a new size, since a rewrite can keep the old mtime) */
+        for ( unsigned int i = 0; i < files.names.size() - 1; i += 1 + corpus.number( 40 ) ) {
+            const string & name = files.names.at( i );
+            const string old_record = read_record_file( name );
+            string new_record;
+            do {
+                new_record = corpus.encode( corpus.record( 1500 + i ) );
+            } while ( new_record.size() == old_record.size() );
+
+            FileDescriptor file( SystemCall( "open " + name, open( name.c_str(), O_WRONLY | O_TRUNC ) ) );
+            file.write( new_record );
+        }
+
+        RecordingArchive::pack( directory, archive_filename );
+
+        /* records in the order mm-replayserver used to visit them */
+        vector< SavedRequest > saved_requests;
+        for ( const auto & filename : list_directory_contents( directory ) ) {
+            if ( filename == index_filename ) {
+                continue;
+            }
+
+            MahimahiProtobufs::RequestResponse record;
+            if ( not record.ParseFromString( read_record_file( filename ) ) ) {
+                throw runtime_error( filename + ": invalid HTTP request/response" );
+            }
+
+            const HTTPRequest request( record.request() );
+            saved_requests.push_back( { record.scheme(), request.has_header( "Host" ),
+                                        request.has_header( "Host" ) ? request.get_header_value( "Host" ) : "",
+                                        request.first_line() } );
+        }
+
+        const ReplayIndex directory_index( directory );
+        const ReplayIndex archive_index( archive_filename );
+        const RecordingArchive archive( archive_filename );
+
+        /* every response, served as mm-webreplay would serve it */
+        unsigned int response_failures = 0;
+        const unsigned int in_place = check_responses( directory_index, "directory index", response_failures );
+        check_responses( archive_index, "archive index", response_failures );
+        if ( in_place == 0 or int( in_place ) == directory_index.entries().size() ) {
+            response_failures++;
+            cerr << "expected some (but not all) bodies served in place, got "
+                 << in_place << " of " << directory_index.entries().size() << endl;
+        }
+
+        /* ask for saved lines, near misses, and lines that were never saved */
+        unsigned int failures = 0, matches = 0;
+        const unsigned int query_count = 20000;
+        for ( unsigned int i = 0; i < query_count; i++ ) {
+            string request_line = corpus.number( 2 )
+                ? saved_requests.at( corpus.number( saved_requests.size() ) ).first_line
+                : corpus.request_line();
+
+            switch ( corpus.number( 4 ) ) {
+            case 0:
+                request_line.erase( corpus.number( request_line.size() + 1 ) );
+                break;
+            case 1:
+                request_line.insert( corpus.number( request_line.size() + 1 ), 1, "?&=1x"[ corpus.number( 5 ) ] );
+                break;
+            default:
+                break;
+            }
+
+            const bool is_https = corpus.number( 3 ) == 0;
+            const string host = corpus.host();
+            const char * const host_header = host.empty() ? nullptr : host.c_str();
+
+            const int expected = reference_match( saved_requests, is_https, host_header, request_line );
+            const int directory_position
+                = position_of( directory_index, directory_index.best_match( is_https, host_header, host, request_line ) );
+            const int archive_index_position
+                = position_of( archive_index, archive_index.best_match( is_https, host_header, host, request_line ) );
+            const RecordingArchiveEntry * const from_archive
+                = archive.best_match( is_https, host_header, host, request_line );
+            const int archive_position = from_archive ? int( from_archive->position ) : -1;
+
+            if ( directory_position != expected or archive_index_position != expected
+                 or archive_position != expected ) {
+                failures++;
+                cerr << "mismatch for \"" << request_line << "\" (" << ( is_https ? "https" : "http" )
+                     << ", Host: " << ( host_header ? host : "none" ) << "): expected " << expected
+                     << ", directory index " << directory_position
+                     << ", archive index " << archive_index_position
+                     << ", archive " << archive_position << endl;
+            }
+
+            if ( expected >= 0 ) {
+                matches++;
+            }
+        }
+
+        files.remove_all();
+        SystemCall( "unlink " + archive_filename, unlink( archive_filename.c_str() ) );
+        SystemCall( "rmdir " + directory, rmdir( directory.c_str() ) );
+
+        if ( failures or response_failures ) {
+            cerr << "replay-match-test FAILED with " << failures << " of " << query_count << " lookups and "
+                 << response_failures << " responses wrong" << endl;
+            return EXIT_FAILURE;
+        }
+
+        cerr << "replay-match-test PASSED (" << query_count << " lookups, " << matches << " matched; "
+             << directory_index.entries().size() << " responses, " << in_place << " served in place)" << endl;
+        return EXIT_SUCCESS;
+    } catch ( const exception & e ) {
+        print_exception( e );
+        return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,87 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "epoller.hh"
+#include "exception.hh"
+
+using namespace std;
+
+Epoller::Epoller()
+    : epoll_fd_( SystemCall( "epoll_create1", epoll_create1( EPOLL_CLOEXEC ) ) ),
+      next_id_( 0 ),
+      registrations_(),
+      ids_()
+{}
+
+void Epoller::add( const FileDescriptor & fd, const uint32_t events, const CallbackType & callback )
+{
+    if ( ids_.count( fd.fd_num() ) ) {
+        throw runtime_error( "Epoller: fd already registered" );
+    }
+
+    const uint64_t id = next_id_++;
+
+    epoll_event event;
+    event.events = events;
+    event.data.u64 = id;
+    SystemCall( "epoll_ctl ADD", epoll_ctl( epoll_fd_.fd_num(), EPOLL_CTL_ADD, fd.fd_num(), &event ) );
+
+    registrations_.emplace( id, Registration { callback, events } );
+    ids_.emplace( fd.fd_num(), id );
+}
+
+void Epoller::modify( const FileDescriptor & fd, const uint32_t events )
+{
+    const uint64_t id = ids_.at( fd.fd_num() );
+    Registration & registration = registrations_.at( id );
+    if ( registration.events == events ) {
+        return;
+    }
+
+    epoll_event event;
+    event.events = events;
+    event.data.u64 = id;
+    SystemCall( "epoll_ctl MOD", epoll_ctl( epoll_fd_.fd_num(), EPOLL_CTL_MOD, fd.fd_num(), &event ) );
+
+    registration.events = events;
+}
+
+void Epoller::remove( const FileDescriptor & fd )
+{
+    const auto id = ids_.find( fd.fd_num() );
+    if ( id == ids_.end() ) {
+        return;
+    }
+
+    SystemCall( "epoll_ctl DEL", epoll_ctl( epoll_fd_.fd_num(), EPOLL_CTL_DEL, fd.fd_num(), nullptr ) );
+
+    registrations_.erase( id->second );
+    ids_.erase( id );
+}
+
+unsigned int Epoller::wait( const int timeout_ms )
+{
+    static const int MAX_EVENTS = 256;
+    epoll_event events[ MAX_EVENTS ];
+
+    int ready;
+    do {
+        ready = epoll_wait( epoll_fd_.fd_num(), events, MAX_EVENTS, timeout_ms );
+    } while ( ready < 0 and errno == EINTR );
+    SystemCall( "epoll_wait", ready );
+
+    unsigned int callbacks_run = 0;
+    for ( int i = 0; i < ready; i++ ) {
+        /* an earlier callback in this batch may have removed this registration */
+        const auto registration = registrations_.find( events[ i ].data.u64 );
+        if ( registration == registrations_.end() ) {
+            continue;
+        }
+
+        /* copy, since the callback may remove itself */
+        const CallbackType callback = registration->second.callback;
+        callback( events[ i ].events );
+        callbacks_run++;
+    }
+
+    return callbacks_run;
+}
@@ -0,0 +1,53 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef EPOLLER_HH
+#define EPOLLER_HH
+
+#include <functional>
+#include <unordered_map>
+#include <cstdint>
+
+#include <sys/epoll.h>
+
+#include "file_descriptor.hh"
+
+/* epoll-based counterpart to Poller, for loops that watch many file
+   descriptors whose interest changes over time. Unlike Poller, each
+   file descriptor is registered once and its interest is changed in place. */
+class Epoller
+{
+public:
+    /* called with the epoll events (EPOLLIN, EPOLLOUT, EPOLLHUP, ...) that occurred */
+    typedef std::function<void(uint32_t)> CallbackType;
+
+private:
+    struct Registration
+    {
+        CallbackType callback;
+        uint32_t events;
+    };
+
+    FileDescriptor epoll_fd_;
+
+    /* registrations are keyed by id rather than fd number, so a stale event
+       for a removed fd is never delivered to a later fd with the same number */
+    uint64_t next_id_;
+    std::unordered_map< uint64_t, Registration > registrations_;
+    std::unordered_map< int, uint64_t > ids_;
+
+public:
+    Epoller();
+
+    void add( const FileDescriptor & fd, const uint32_t events, const CallbackType & callback );
+    /* cheap to call with unchanged events: only a change reaches the kernel */
+    void modify( const FileDescriptor & fd, const uint32_t events );
+    void remove( const FileDescriptor & fd );
+
+    bool empty( void ) const { return registrations_.empty(); }
+
+    /* wait up to timeout_ms (-1 for forever) and run callbacks for ready fds.
+       returns the number of callbacks run (0 on timeout) */
+    unsigned int wait( const int timeout_ms );
+};
+
+#endif /* EPOLLER_HH */
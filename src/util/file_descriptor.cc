@@ -4,7 +4,10 @@
 #include "exception.hh"
 
 #include <unistd.h>
+#include <cerrno>
 #include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 
 using namespace std;
 
@@ -49,6 +52,13 @@ FileDescriptor::~FileDescriptor()
     }
 }
 
+void FileDescriptor::set_blocking( const bool blocking )
+{
+    int flags = SystemCall( "fcntl F_GETFL", fcntl( fd_, F_GETFL ) );
+    flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+    SystemCall( "fcntl F_SETFL", fcntl( fd_, F_SETFL, flags ) );
+}
+
 /* attempt to write a portion of a string */
 string::const_iterator FileDescriptor::write( const string::const_iterator & begin,
                                               const string::const_iterator & end )
@@ -57,7 +67,12 @@ string::const_iterator FileDescriptor::write( const string::const_iterator & beg
         throw runtime_error( "nothing to write" );
     }
 
-    ssize_t bytes_written = SystemCall( "write", ::write( fd_, &*begin, end - begin ) );
+    const ssize_t ret = ::write( fd_, &*begin, end - begin );
+    if ( ret < 0 and (errno == EAGAIN or errno == EWOULDBLOCK) ) { /* non-blocking and not ready */
+        return begin;
+    }
+
+    ssize_t bytes_written = SystemCall( "write", ret );
     if ( bytes_written == 0 ) {
         throw runtime_error( "write returned 0" );
     }
@@ -72,7 +87,12 @@ string FileDescriptor::read( const size_t limit )
 {
     char buffer[ BUFFER_SIZE ];
 
-    ssize_t bytes_read = SystemCall( "read", ::read( fd_, buffer, min( BUFFER_SIZE, limit ) ) );
+    const ssize_t ret = ::read( fd_, buffer, min( BUFFER_SIZE, limit ) );
+    if ( ret < 0 and (errno == EAGAIN or errno == EWOULDBLOCK) ) { /* non-blocking and nothing yet */
+        return string();
+    }
+
+    ssize_t bytes_read = SystemCall( "read", ret );
     if ( bytes_read == 0 ) {
         set_eof();
     }
@@ -93,3 +113,74 @@ string::const_iterator FileDescriptor::write( const std::string & buffer, const
 
     return it;
 }
+
+/* gather write, resuming after short writes */
+void FileDescriptor::writev( const string & first, const string & second )
+{
+    iovec buffers[ 2 ] = { { const_cast<char *>( first.data() ), first.size() },
+                           { const_cast<char *>( second.data() ), second.size() } };
+    iovec * next = buffers;
+    int count = 2;
+
+    while ( count > 0 ) {
+        if ( next->iov_len == 0 ) {
+            next++;
+            count--;
+            continue;
+        }
+
+        size_t bytes_written = SystemCall( "writev", ::writev( fd_, next, count ) );
+        if ( bytes_written == 0 ) {
+            throw runtime_error( "writev returned 0" );
+        }
+
+        register_write();
+
+        while ( count > 0 and bytes_written >= next->iov_len ) {
+            bytes_written -= next->iov_len;
+            next++;
+            count--;
+        }
+
+        if ( count > 0 ) {
+            next->iov_base = static_cast<char *>( next->iov_base ) + bytes_written;
+            next->iov_len -= bytes_written;
+        }
+    }
+}
+
+/* copy from another file in the kernel, falling back to read and write
+   where sendfile() can't reach this kind of descriptor */
+void FileDescriptor::sendfile( const FileDescriptor & file, const uint64_t offset, const uint64_t length )
+{
+    off_t position = offset;
+    const off_t end = offset + length;
+
+    while ( position < end ) {
+        const ssize_t bytes_sent = ::sendfile( fd_, file.fd_num(), &position,
+                                               min( uint64_t( end - position ), uint64_t( BUFFER_SIZE ) ) );
+
+        if ( bytes_sent < 0 and ( errno == EINVAL or errno == ENOSYS ) ) {
+            char buffer[ BUFFER_SIZE ];
+
+            while ( position < end ) {
+                const ssize_t bytes_read = SystemCall( "pread", pread( file.fd_num(), buffer,
+                                                                       min( uint64_t( end - position ),
+                                                                            uint64_t( BUFFER_SIZE ) ),
+                                                                       position ) );
+                if ( bytes_read == 0 ) {
+                    throw runtime_error( "sendfile: file ended early" );
+                }
+                write( string( buffer, bytes_read ) );
+                position += bytes_read;
+            }
+            return;
+        }
+
+        if ( SystemCall( "sendfile", bytes_sent ) == 0 ) {
+            throw runtime_error( "sendfile: file ended early" );
+        }
+
+        register_write();
+    }
+}
@@ -4,6 +4,7 @@
 #define FILE_DESCRIPTOR_HH
 
 #include <string>
+#include <cstdint>
 
 /* Unix file descriptors (sockets, files, etc.) */
 class FileDescriptor
@@ -38,12 +39,23 @@ public:
     unsigned int read_count( void ) const { return read_count_; }
     unsigned int write_count( void ) const { return write_count_; }
 
-    /* read and write methods */
+    /* make reads and writes return at once instead of waiting on the fd */
+    void set_blocking( const bool blocking );
+
+    /* read and write methods. on a non-blocking fd that isn't ready,
+       read() returns an empty string without setting eof(), and write()
+       returns begin (so don't ask it to write_all) */
     std::string read( const size_t limit = BUFFER_SIZE );
     std::string::const_iterator write( const std::string & buffer, const bool write_all = true );
     std::string::const_iterator write( const std::string::const_iterator & begin,
                                        const std::string::const_iterator & end );
 
+    /* write two buffers (e.g. headers and body) in full without joining them first */
+    void writev( const std::string & first, const std::string & second );
+
+    /* write length bytes of file, starting at offset, without copying them through user space */
+    void sendfile( const FileDescriptor & file, const uint64_t offset, const uint64_t length );
+
     /* forbid copying FileDescriptor objects or assigning them */
     FileDescriptor( const FileDescriptor & other ) = delete;
     const FileDescriptor & operator=( const FileDescriptor & other ) = delete;
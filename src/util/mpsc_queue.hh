@@ -0,0 +1,74 @@
+/* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef MPSC_QUEUE_HH
+#define MPSC_QUEUE_HH
+
+#include <atomic>
+#include <vector>
+#include <utility>
+
+/* lock-free queue for many producer threads and one consumer, which takes
+   everything queued so far in one go. Producers push onto a linked stack
+   with compare-and-swap; the consumer swaps the whole stack out and
+   reverses it, so items still come out in the order they went in. */
+template <class T>
+class MPSCQueue
+{
+private:
+    struct Node
+    {
+        T value;
+        Node * next;
+    };
+
+    std::atomic< Node * > head_;
+
+public:
+    MPSCQueue() : head_( nullptr ) {}
+
+    ~MPSCQueue()
+    {
+        pop_all();
+    }
+
+    /* from any thread */
+    void push( T && value )
+    {
+        Node * const node = new Node { std::move( value ), head_.load( std::memory_order_relaxed ) };
+        while ( not head_.compare_exchange_weak( node->next, node,
+                                                 std::memory_order_release, std::memory_order_relaxed ) ) {}
+    }
+
+    /* from the consumer thread: everything pushed so far, oldest first */
+    std::vector< T > pop_all( void )
+    {
+        Node * node = head_.exchange( nullptr, std::memory_order_acquire );
+
+        /* the stack is newest first */
+        Node * oldest = nullptr;
+        while ( node ) {
+            Node * const next = node->next;
+            node->next = oldest;
+            oldest = node;
+            node = next;
+        }
+
+        std::vector< T > ret;
+        while ( oldest ) {
+            ret.emplace_back( std::move( oldest->value ) );
+            Node * const next = oldest->next;
+            delete oldest;
+            oldest = next;
+        }
+
+        return ret;
+    }
+
+    bool empty( void ) const { return head_.load( std::memory_order_acquire ) == nullptr; }
+
+    /* ban copying */
+    MPSCQueue( const MPSCQueue & other ) = delete;
+    MPSCQueue & operator=( const MPSCQueue & other ) = delete;
+};
+
+#endif /* MPSC_QUEUE_HH */
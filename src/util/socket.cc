@@ -1,12 +1,15 @@
 /* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <linux/netfilter_ipv4.h>
 
 #include "socket.hh"
 #include "timestamp.hh"
 #include "exception.hh"
+#include "util.hh"
 
 using namespace std;
 
@@ -70,9 +73,19 @@ void Socket::bind( const Address & address )
 /* connect socket to a specified peer address */
 void Socket::connect( const Address & address )
 {
-    SystemCall( "connect", ::connect( fd_num(),
-                                      &address.to_sockaddr(),
-                                      address.size() ) );
+    const int ret = ::connect( fd_num(), &address.to_sockaddr(), address.size() );
+    if ( ret < 0 and errno == EINPROGRESS ) { /* non-blocking */
+        return;
+    }
+
+    SystemCall( "connect", ret );
+}
+
+int Socket::connect_error( void ) const
+{
+    int error;
+    getsockopt( SOL_SOCKET, SO_ERROR, error );
+    return error;
 }
 
 /* send datagram to specified address */
@@ -187,3 +200,36 @@ Address TCPSocket::original_dest( void ) const
 
     return Address( dstaddr, len );
 }
+
+void TCPSocket::set_nodelay( void )
+{
+    setsockopt( IPPROTO_TCP, TCP_NODELAY, int( true ) );
+}
+
+Address UnixStreamSocket::path_address( const string & path )
+{
+    sockaddr_un addr;
+    zero( addr );
+
+    if ( path.size() >= sizeof( addr.sun_path ) ) {
+        throw runtime_error( "Unix socket path too long: " + path );
+    }
+
+    addr.sun_family = AF_UNIX;
+    path.copy( addr.sun_path, path.size() );
+
+    return Address( reinterpret_cast<const sockaddr &>( addr ), sizeof( addr ) );
+}
+
+/* mark the socket as listening for incoming connections */
+void UnixStreamSocket::listen( const int backlog )
+{
+    SystemCall( "listen", ::listen( fd_num(), backlog ) );
+}
+
+/* accept a new incoming connection */
+UnixStreamSocket UnixStreamSocket::accept( void )
+{
+    register_read();
+    return UnixStreamSocket( FileDescriptor( SystemCall( "accept", ::accept( fd_num(), nullptr, nullptr ) ) ) );
+}
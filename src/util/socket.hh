@@ -34,9 +34,14 @@ public:
     /* bind socket to a specified local address (usually to listen/accept) */
     void bind( const Address & address );
 
-    /* connect socket to a specified peer address */
+    /* connect socket to a specified peer address. a non-blocking socket
+       returns while the connection is still in progress: wait for it to be
+       writable, then check connect_error() */
     void connect( const Address & address );
 
+    /* outcome of a non-blocking connect(): 0, or the errno it failed with */
+    int connect_error( void ) const;
+
     /* accessors */
     Address local_address( void ) const;
     Address peer_address( void ) const;
@@ -82,6 +87,32 @@ public:
 
     /* original destination of a DNAT connection */
     Address original_dest( void ) const;
+
+    /* send small writes at once, rather than waiting to fill a segment */
+    void set_nodelay( void );
+};
+
+/* Unix-domain stream socket, named by a path in the filesystem */
+class UnixStreamSocket : public Socket
+{
+private:
+    /* constructor used by accept() */
+    UnixStreamSocket( FileDescriptor && fd ) : Socket( std::move( fd ), AF_UNIX, SOCK_STREAM ) {}
+
+    static Address path_address( const std::string & path );
+
+public:
+    UnixStreamSocket() : Socket( AF_UNIX, SOCK_STREAM ) {}
+
+    /* bind or connect to a filesystem path */
+    void bind( const std::string & path ) { Socket::bind( path_address( path ) ); }
+    void connect( const std::string & path ) { Socket::connect( path_address( path ) ); }
+
+    /* mark the socket as listening for incoming connections */
+    void listen( const int backlog = 128 );
+
+    /* accept a new incoming connection */
+    UnixStreamSocket accept( void );
 };
 
 #endif /* SOCKET_HH */
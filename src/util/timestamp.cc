@@ -26,3 +26,11 @@ uint64_t timestamp( void )
 {
     return raw_timestamp() - initial_timestamp();
 }
+
+uint64_t timestamp_ns( void )
+{
+    timespec ts;
+    SystemCall( "clock_gettime", clock_gettime( CLOCK_REALTIME, &ts ) );
+
+    return uint64_t( ts.tv_sec ) * 1000000000 + ts.tv_nsec;
+}
@@ -8,4 +8,7 @@
 uint64_t timestamp( void );
 uint64_t initial_timestamp( void );
 
+/* nanoseconds since the epoch */
+uint64_t timestamp_ns( void );
+
 #endif /* TIMESTAMP_HH */